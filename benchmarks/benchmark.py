@@ -1,10 +1,33 @@
 import glob
+import json
 import os
+import statistics
+import subprocess
+import time
+from concurrent.futures import ThreadPoolExecutor
 from typing import List
 
-from compilation_strategy import ICompilationStrategy, OptClangStrategy, ClangStrategy
-from example_generator import IExampleGenerator, TestExampleGenerator
-from execution_strategy import IExecutionStrategy, LineGraph
+from compilation_strategy import ICompilationStrategy, OptClangStrategy, ClangStrategy, OptStrategy, OPT_PATH, \
+    POLY_PATH, KernelObjectStrategy, KERNELS_PATH, HARNESS_PATH
+from example_generator import IExampleGenerator, TestExampleGenerator, NestScalingGenerator
+from execution_strategy import IExecutionStrategy, LineGraph, BarChart
+
+
+# Runs the execution strategies over the binaries of each example. Strategies that only check results run across a
+# pool of workers; timing strategies then run one example at a time, so no other benchmark process competes with them.
+def run_examples(examples: List[List[str]], exec_strategies: List[IExecutionStrategy], jobs: int):
+    concurrent = [strategy for strategy in exec_strategies if strategy.concurrent]
+    serial = [strategy for strategy in exec_strategies if not strategy.concurrent]
+    if concurrent:
+        with ThreadPoolExecutor(jobs) as pool:
+            runs = pool.map(lambda binaries: [strategy.run(binaries) for strategy in concurrent], examples)
+            for i, _ in enumerate(runs):
+                print(f"Validated {i + 1}/{len(examples)}")
+    if serial:
+        for i, binaries in enumerate(examples):
+            print(f"Timed {i + 1}/{len(examples)}")
+            for strategy in serial:
+                strategy.run(binaries)
 
 
 class Benchmark:
@@ -13,22 +36,21 @@ class Benchmark:
                  comp_strategies: List[ICompilationStrategy],
                  exec_strategies: List[IExecutionStrategy],
                  example_count=100,
-                 skip_tests=False):
+                 skip_tests=False,
+                 jobs=None):
         self._generator = generator
         self._comp_strategies = comp_strategies
         self._exec_strategies = exec_strategies
         self._example_count = example_count
         self._skip_tests = skip_tests
+        self._jobs = jobs or os.cpu_count()
 
     def run(self):
         sizes = self._generator.gen(self._example_count)
         if not self._skip_tests:
             examples = [example for example in sorted(glob.glob("./dump/*")) if os.path.isfile(example)]
-            for i, example in enumerate(examples):
-                print(f"Completed {i}/{self._example_count}")
-                binaries = [strategy.compile(example) for strategy in self._comp_strategies]
-                for exec_strategy in self._exec_strategies:
-                    exec_strategy.run(binaries)
+            compiled = [strategy.compile_batch(examples) for strategy in self._comp_strategies]
+            run_examples([list(binaries) for binaries in zip(*compiled)], self._exec_strategies, self._jobs)
         for exec_strategy in self._exec_strategies:
             if isinstance(exec_strategy, LineGraph):
                 exec_strategy.set_sizes(sizes)
@@ -59,13 +81,194 @@ class ComparisonBenchmark:
         if not self._skip_tests:
             examplesA = sorted(glob.glob("./dump/A/*"))
             examplesB = sorted(glob.glob("./dump/B/*"))
-            for i, (A, B) in enumerate(zip(examplesA, examplesB)):
-                print(f"Completed {i}/{self._example_count}")
-                binaries = [self._compiler.compile(A), self._compiler.compile(B)]
-                for exec_strategy in self._exec_strategies:
-                    exec_strategy.run(binaries)
+            binariesA = self._compiler.compile_batch(examplesA)
+            binariesB = self._compiler.compile_batch(examplesB)
+            run_examples([[A, B] for A, B in zip(binariesA, binariesB)], self._exec_strategies, os.cpu_count())
         for exec_strategy in self._exec_strategies:
             if isinstance(exec_strategy, LineGraph):
                 exec_strategy.set_sizes(sizes)
                 exec_strategy._skip_tests = self._skip_tests
             exec_strategy.show()
+
+
+# Measures the wall time and peak memory of the polytope pass as the number and depth of nests in a module grow.
+# Results are compared against a stored baseline so that compile-time regressions are flagged.
+class CompileTimeBenchmark:
+    def __init__(self,
+                 nest_counts: List[int],
+                 depths: List[int],
+                 size=100,
+                 repetitions=3,
+                 baseline="./logs/compile_time_baseline.json",
+                 tolerance=0.1):
+        self._nest_counts = nest_counts
+        self._depths = depths
+        self._size = size
+        self._repetitions = repetitions
+        self._baseline = baseline
+        self._tolerance = tolerance
+        self._results = []
+
+    def run(self):
+        for depth in self._depths:
+            for count in self._nest_counts:
+                print(f"Measuring {count} nests at depth {depth}")
+                ir = OptStrategy().compile(NestScalingGenerator(depth, self._size).gen(count))
+                # Parsing and verifying the module is measured separately so only the pass itself is reported
+                load_times = [self.__measure(ir, [])[0] for _ in range(self._repetitions)]
+                pass_runs = [self.__measure(ir, ["-load-pass-plugin", POLY_PATH, "-passes", "polytope"])
+                             for _ in range(self._repetitions)]
+                self._results.append({
+                    "nests": count,
+                    "depth": depth,
+                    "pass_time": statistics.median([t for t, _ in pass_runs]) - statistics.median(load_times),
+                    "peak_rss_kb": max([rss for _, rss in pass_runs]),
+                })
+                os.remove(ir)
+        self.show()
+
+    def show(self):
+        print()
+        print("----Compile Time----")
+        print(f"{'nests':>8} {'depth':>6} {'pass time (s)':>14} {'peak RSS (MB)':>14}")
+        for result in self._results:
+            print(f"{result['nests']:>8} {result['depth']:>6} {result['pass_time']:>14.3f} "
+                  f"{result['peak_rss_kb'] / 1024:>14.1f}")
+
+        with open("./logs/compile_time.json", "w") as f:
+            json.dump(self._results, f, indent=2)
+
+        if not os.path.isfile(self._baseline):
+            print(f"No baseline at {self._baseline} - run save_baseline() to record one")
+            return
+        with open(self._baseline, "r") as f:
+            baseline = {(r["nests"], r["depth"]): r for r in json.load(f)}
+        regressions = 0
+        for result in self._results:
+            old = baseline.get((result["nests"], result["depth"]))
+            if old is None:
+                continue
+            for key in ["pass_time", "peak_rss_kb"]:
+                if result[key] > old[key] * (1 + self._tolerance):
+                    regressions += 1
+                    print(f"REGRESSION: {key} for {result['nests']} nests at depth {result['depth']} "
+                          f"went from {old[key]:.3f} to {result[key]:.3f}")
+        print("PASSED" if regressions == 0 else "FAILED")
+
+    def save_baseline(self):
+        with open(self._baseline, "w") as f:
+            json.dump(self._results, f, indent=2)
+
+    @staticmethod
+    def __measure(ir: str, args: List[str]):
+        start = time.perf_counter()
+        process = subprocess.Popen([OPT_PATH, "-disable-output", *args, ir])
+        _, _, usage = os.wait4(process.pid, 0)
+        return time.perf_counter() - start, usage.ru_maxrss
+
+
+# Times the kernels of ./examples inside one harness binary rather than timing whole processes, so start-up,
+# initialisation and printing are excluded. The harness pins itself to a core, runs warm-up iterations and reports the
+# median of the repetitions; medians are passed to the execution strategies (eg. BarChart, LineGraph) as the times of
+# the two compilation names, and BarChart also gets the 95% confidence interval of each median for its error bars.
+class HarnessBenchmark:
+    def __init__(self,
+                 sizes: List[int],
+                 exec_strategies: List[IExecutionStrategy],
+                 names=("Clang+Opt", "Tope"),
+                 kernel=None,
+                 repetitions=30,
+                 warmup=3,
+                 cpu=0):
+        self._sizes = sizes
+        self._exec_strategies = exec_strategies
+        self._names = names
+        self._kernel = kernel
+        self._repetitions = repetitions
+        self._warmup = warmup
+        self._cpu = cpu
+
+    def run(self):
+        for size in self._sizes:
+            print(f"Timing kernels at size {size}")
+            results = self.__run_harness(size)
+            with open(f"./logs/harness_{size}.json", "w") as f:
+                json.dump(results, f, indent=2)
+            for kernel in sorted({result["kernel"] for result in results}):
+                kernel_results = {result["variant"]: result for result in results if result["kernel"] == kernel}
+                medians = {name: kernel_results[variant]["median"]
+                           for name, variant in zip(self._names, ("base", "poly"))}
+                intervals = {name: (kernel_results[variant]["ci_low"], kernel_results[variant]["ci_high"])
+                             for name, variant in zip(self._names, ("base", "poly"))}
+                for exec_strategy in self._exec_strategies:
+                    if isinstance(exec_strategy, BarChart):
+                        exec_strategy.record(medians, intervals)
+                    else:
+                        exec_strategy.record(medians)
+        for exec_strategy in self._exec_strategies:
+            if isinstance(exec_strategy, LineGraph):
+                exec_strategy.set_sizes(self._sizes)
+            exec_strategy.show()
+
+    def __run_harness(self, size: int):
+        base = KernelObjectStrategy(polytope=False, size=size).compile(KERNELS_PATH)
+        poly = KernelObjectStrategy(polytope=True, size=size).compile(KERNELS_PATH)
+        binary = f"./bin/harness_{size}"
+        subprocess.run(["clang++", "-O2", f"-DN={size}", HARNESS_PATH, base, poly, "-o", binary])
+        args = [binary, "--repetitions", str(self._repetitions), "--warmup", str(self._warmup), "--cpu", str(self._cpu)]
+        if self._kernel is not None:
+            args += ["--kernel", self._kernel]
+        process = subprocess.run(args, capture_output=True, text=True)
+        if process.returncode != 0:
+            print(process.stderr)
+        return [json.loads(line) for line in process.stdout.splitlines()]
+
+
+# Times the 2-D recurrence kernels transformed by the polytope pass with software prefetches at several distances
+# against the same kernels without them. Each distance is its own harness binary, timing "base" (no prefetches) against
+# "poly" (prefetches -polytope-prefetch-distance iterations ahead). The speedups are printed with both confidence
+# intervals and the samples are written to ./logs/prefetch.json.
+class PrefetchBenchmark:
+    KERNELS = ["arr_red", "dithering", "lcs"]
+
+    def __init__(self, sizes: List[int], distances: List[int], repetitions=30, warmup=3, cpu=0):
+        self._sizes = sizes
+        self._distances = distances
+        self._repetitions = repetitions
+        self._warmup = warmup
+        self._cpu = cpu
+
+    def run(self):
+        results = []
+        for size in self._sizes:
+            base = KernelObjectStrategy(polytope=True, size=size, variant="base").compile(KERNELS_PATH)
+            for distance in self._distances:
+                poly = KernelObjectStrategy(polytope=True, size=size, pass_args=[
+                    f"-polytope-prefetch-distance={distance}"], tag=f"_prefetch{distance}").compile(KERNELS_PATH)
+                binary = f"./bin/harness_prefetch{distance}_{size}"
+                subprocess.run(["clang++", "-O2", f"-DN={size}", HARNESS_PATH, base, poly, "-o", binary])
+                for kernel in self.KERNELS:
+                    process = subprocess.run([binary, "--repetitions", str(self._repetitions), "--warmup",
+                                              str(self._warmup), "--cpu", str(self._cpu), "--kernel", kernel],
+                                             capture_output=True, text=True)
+                    if process.returncode != 0:
+                        print(process.stderr)
+                        continue
+                    variants = {}
+                    for line in process.stdout.splitlines():
+                        result = json.loads(line)
+                        variants[result["variant"]] = result
+                        results.append({**result, "size": size, "distance": distance})
+                    print(f"{kernel} N={size} distance {distance}: "
+                          f"{variants['base']['median'] / variants['poly']['median']:.2f}x over no prefetches"
+                          f"{self.__describe(variants['base'], variants['poly'])}")
+        with open("./logs/prefetch.json", "w") as f:
+            json.dump(results, f, indent=2)
+
+    # The medians of a few dozen repetitions move by several percent between runs on a busy machine, so the 95%
+    # confidence intervals are printed next to the speedup, which is marked as noise when they overlap
+    @staticmethod
+    def __describe(base, poly):
+        overlap = base["ci_low"] <= poly["ci_high"] and poly["ci_low"] <= base["ci_high"]
+        return (f" (base {base['ci_low'] * 1e3:.1f}-{base['ci_high'] * 1e3:.1f}ms, "
+                f"poly {poly['ci_low'] * 1e3:.1f}-{poly['ci_high'] * 1e3:.1f}ms{', within noise' if overlap else ''})")
@@ -1,10 +1,15 @@
 import os
 import subprocess
 from abc import abstractmethod, ABC
+from concurrent.futures import ThreadPoolExecutor
+from typing import List
 
 # Nasty
 OPT_PATH = "../llvm-project/llvm/build/bin/opt"
 POLY_PATH = "../polytope-pass/cmake-build-debug/libpolytope-pass.so"
+DRIVER_PATH = "../polytope-pass/cmake-build-debug/polytope-cc"
+KERNELS_PATH = "./harness/kernels.c"
+HARNESS_PATH = "./harness/harness.cpp"
 
 
 class ICompilationStrategy(ABC):
@@ -12,6 +17,12 @@ class ICompilationStrategy(ABC):
     def compile(self, file: str) -> str:
         pass
 
+    # Compiles the files concurrently, one clang/opt pipeline per core. Output names are derived from the input names,
+    # so the pipelines never share files.
+    def compile_batch(self, files: List[str]) -> List[str]:
+        with ThreadPoolExecutor(os.cpu_count()) as pool:
+            return list(pool.map(self.compile, files))
+
 
 class ClangStrategy(ICompilationStrategy):
     def compile(self, file: str) -> str:
@@ -72,3 +83,64 @@ class PolytopeStrategy(ICompilationStrategy):
         # os.remove(ir)
         # os.remove(file_name)
         return res
+
+
+# Compiles a whole batch with one clang call, which lowers every example to bitcode, and one polytope-cc process, which
+# runs the OptStrategy pipeline, the pass and code generation in memory, in parallel across examples. Produces the same
+# binaries as OptClangStrategy and PolytopeStrategy. Raises when either step fails.
+class DriverStrategy(ICompilationStrategy):
+    def __init__(self, polytope: bool):
+        self._polytope = polytope
+
+    def compile(self, file: str) -> str:
+        return self.compile_batch([file])[0]
+
+    def compile_batch(self, files: List[str]) -> List[str]:
+        suffix = "_opt_poly_clang" if self._polytope else "_opt_clang"
+        # clang names each output after its input, so every strategy gets a directory of its own
+        bitcode_dir = f"./bin/bitcode{suffix}"
+        os.makedirs(bitcode_dir, exist_ok=True)
+        subprocess.run(
+            ["clang", "-c", "-emit-llvm", "-fno-discard-value-names", "-O0", "-Xclang", "-disable-O0-optnone",
+             *[os.path.abspath(file) for file in files]],
+            cwd=bitcode_dir, check=True
+        )
+        bitcode = [f"{bitcode_dir}/{os.path.splitext(os.path.basename(file))[0]}.bc" for file in files]
+        args = [DRIVER_PATH, "-output-dir", "./bin", "-suffix", suffix]
+        if self._polytope:
+            args.append("-polytope")
+        process = subprocess.run(args + bitcode, stdout=subprocess.PIPE, text=True, check=True)
+        return process.stdout.splitlines()
+
+
+# Compiles the kernels in harness/kernels.c to an object file for the timing harness, with or without the polytope
+# pass. The kernel functions are suffixed with the variant name so that both objects link into one binary.
+class KernelObjectStrategy(ICompilationStrategy):
+    # pass_args are extra options for the polytope pass, and tag tells apart objects compiled with different ones
+    def __init__(self, polytope: bool, size: int, variant=None, pass_args=(), tag=""):
+        self._polytope = polytope
+        self._size = size
+        self._variant = variant
+        self._pass_args = list(pass_args)
+        self._tag = tag
+
+    def compile(self, file: str) -> str:
+        variant = self._variant or ("poly" if self._polytope else "base")
+        ir = f"./bin/kernels_{variant}{self._tag}_{self._size}.ll"
+        obj = f"./bin/kernels_{variant}{self._tag}_{self._size}.o"
+        subprocess.run(
+            ["clang", "-emit-llvm", "-fno-discard-value-names", "-O0", "-Xclang", "-disable-O0-optnone",
+             f"-DN={self._size}", f"-DVARIANT={variant}", file, "-S", "-o", ir]
+        )
+        subprocess.run(
+            [OPT_PATH, "-S", "-passes", "mem2reg,loop-rotate,simplifycfg,instcombine,loop-vectorize", ir, "-o", ir]
+        )
+        if self._polytope:
+            # Options of a plugin are only registered when it is also loaded with -load
+            load = ["-load", POLY_PATH] if self._pass_args else []
+            subprocess.run([OPT_PATH, "-S", *load, "-load-pass-plugin", POLY_PATH, "-passes", "polytope",
+                            *self._pass_args, ir, "-o", ir])
+            subprocess.run([OPT_PATH, "-S", "-passes", "simplifycfg,instcombine", ir, "-o", ir])
+        subprocess.run(["clang", "-O0", "-c", ir, "-o", obj])
+        os.remove(ir)
+        return obj
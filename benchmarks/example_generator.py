@@ -104,6 +104,54 @@ int main() {{
         return "A" + "".join(access_str)
 
 
+# Builds a single module containing n random affine nests, each in its own function and wrapped in depth - 2 outer
+# loops, for measuring how the cost of the pass grows with module size.
+class NestScalingGenerator(IExampleGenerator):
+    def __init__(self, depth: int, size: int):
+        self._depth = depth
+        self._size = size
+
+    def gen(self, n) -> str:
+        random.seed(4)
+        nests = []
+        for k in range(n):
+            write = (RandomLinGenerator.get_rand_affine(), RandomLinGenerator.get_rand_affine())
+            num_reads = random.randint(1, 4)
+            reads = [(RandomLinGenerator.get_rand_affine(), RandomLinGenerator.get_rand_affine())
+                     for _ in range(num_reads)]
+            body = f"""{RandomLinGenerator.stringify(write)} = ({" + ".join([RandomLinGenerator.stringify(read) for read in reads])}) % 17;"""
+            loops = [f"for (int t{d} = 0; t{d} < 2; ++t{d}) {{" for d in range(self._depth - 2)]
+            loops += ["for (int i = 3; i < N/4 - 1; ++i) {", "for (int j = 3; j < N/4 - 1; ++j) {"]
+            nest = "\n".join(f"{'    ' * (d + 1)}{loop}" for d, loop in enumerate(loops))
+            nest += f"\n{'    ' * (len(loops) + 1)}{body}\n"
+            nest += "\n".join(f"{'    ' * (d + 1)}}}" for d in reversed(range(len(loops))))
+            nests.append(f"""static void nest_{k}(int (*A)[M]) {{
+{nest}
+}}
+
+""")
+
+        calls = "\n".join(f"    nest_{k}(A);" for k in range(n))
+        program = f"""#include <stdio.h>
+#include <stdlib.h>
+#define N {self._size}
+#define M {self._size}
+
+{"".join(nests)}
+int main() {{
+    int (*A)[M] = calloc(N, sizeof(int[M]));
+{calls}
+    printf("%d\\n", A[5][2]);
+    free(A);
+    return 0;
+}}
+"""
+        file_name = f"./dump/scale_{n}_{self._depth}.c"
+        with open(file_name, "w") as f:
+            f.write(program)
+        return file_name
+
+
 class TestGenerator(IExampleGenerator):
     def __init__(self, size: int):
         self._size = size
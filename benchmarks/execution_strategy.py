@@ -1,10 +1,14 @@
+import hashlib
 import math
+import os
 import subprocess
+import tempfile
+import threading
 import time
 from abc import abstractmethod, ABC
 from datetime import datetime
 from random import random
-from typing import List, Dict, TypedDict
+from typing import List, Dict, Tuple, TypedDict
 import matplotlib.pyplot as plt
 import numpy as np
 import pandas as pd
@@ -14,6 +18,10 @@ from scipy.stats import norm
 debug = True
 
 class IExecutionStrategy(ABC):
+    # Strategies that only check results may run on several examples at once; timing strategies are run one example
+    # at a time on a pinned core
+    concurrent = False
+
     @abstractmethod
     def run(self, files: List[str]) -> any:
         pass
@@ -24,15 +32,19 @@ class IExecutionStrategy(ABC):
 
 
 class CorrectnessTest(IExecutionStrategy):
+    concurrent = True
+
     def __init__(self):
         self._correct_count = 0
         self._count = 0
+        self._lock = threading.Lock()
 
     def run(self, files: List[str]) -> bool:
-        self._count += 1
         res = self.__run(files)
-        if res:
-            self._correct_count += 1
+        with self._lock:
+            self._count += 1
+            if res:
+                self._correct_count += 1
         return res
 
     def show(self) -> any:
@@ -48,54 +60,78 @@ class CorrectnessTest(IExecutionStrategy):
                 print("FAILED")
             print(f"{self._correct_count}/{self._count} passed")
 
+    # Compares a digest of each program's output, computed while it runs, so the printed arrays are never held in
+    # memory. The outputs are only written out, by running the programs again, when the digests differ.
     @staticmethod
     def __run(files: List[str]) -> bool:
-        outputs = []
+        digests = []
         for file in files:
-            process = subprocess.run([file, str(500)],
-                                     capture_output=True,
-                                     text=True)
-            stdout = process.stdout
-            stderr = process.stderr
+            digest, stderr = CorrectnessTest.__digest(file)
             if stderr != '':
-                log_file = f"correctness_{datetime.now().strftime('%H:%M:%S')}.txt"
+                log_file = f"correctness_{os.path.basename(file)}_{datetime.now().strftime('%H:%M:%S')}.txt"
                 print(f"Error running {file} - printing to {log_file}...")
                 with open(f"./logs/{log_file}", 'w') as f:
                     f.write(stderr)
                 return False
-            outputs.append(stdout)
+            digests.append(digest)
 
-        for i in range(len(outputs) - 1):
-            if outputs[i] != outputs[i + 1]:
-                log_file = f"correctness_{datetime.now().strftime('%H:%M:%S')}.txt"
+        for i in range(len(digests) - 1):
+            if digests[i] != digests[i + 1]:
+                log_file = f"correctness_{os.path.basename(files[i])}_{datetime.now().strftime('%H:%M:%S')}.txt"
                 print(f"{files[i]} and {files[i + 1]} do not match - printing to {log_file}...")
                 with open(f"./logs/{log_file}", 'w') as f:
-                    f.write(outputs[i])
+                    subprocess.run([files[i], str(500)], stdout=f)
                     f.write("\n")
-                    f.write(outputs[i + 1])
+                    f.flush()
+                    subprocess.run([files[i + 1], str(500)], stdout=f)
                 return False
         return True
 
+    @staticmethod
+    def __digest(file: str):
+        digest = hashlib.blake2b()
+        with tempfile.TemporaryFile("w+") as stderr:
+            process = subprocess.Popen([file, str(500)], stdout=subprocess.PIPE, stderr=stderr)
+            for chunk in iter(lambda: process.stdout.read(1 << 16), b""):
+                digest.update(chunk)
+            process.wait()
+            stderr.seek(0)
+            return digest.hexdigest(), stderr.read()
 
-# Assumes CorrectnessTest has been run beforehand.
+
+# Assumes CorrectnessTest has been run beforehand. Every run is pinned to one core (the last one by default), which
+# should be kept free of other work, eg. with isolcpus.
 class TimeTest(IExecutionStrategy):
-    def __init__(self, iterations: int, names: List[str]):
+    def __init__(self, iterations: int, names: List[str], cpu=None):
         self._iterations = iterations
         self._names = names
         self._times = {name: [] for name in names}
+        # Distance from each time down and up to the ends of its confidence interval, when the measurement has one
+        self._errors = {name: [] for name in names}
+        self._cpu = os.cpu_count() - 1 if cpu is None else cpu
 
     def run(self, files: List[str]) -> any:
         results = dict()
         for file, name in zip(files, self._names):
             start = time.time()
             for _ in range(self._iterations):
-                subprocess.run(file, stdout=subprocess.DEVNULL)
+                subprocess.run(file, stdout=subprocess.DEVNULL, preexec_fn=self.__pin)
             results[name] = time.time() - start
 
+        self.record(results)
+        return results
+
+    # Adds one measurement per compilation strategy, eg. from the in-process harness, optionally with the (low, high)
+    # confidence interval of each time
+    def record(self, results: Dict[str, float], intervals: Dict[str, Tuple[float, float]] = None):
         for name, t in results.items():
             self._times[name].append(t)
+            if intervals is not None:
+                low, high = intervals[name]
+                self._errors[name].append((t - low, high - t))
 
-        return results
+    def __pin(self):
+        os.sched_setaffinity(0, {self._cpu})
 
     def show(self) -> any:
         print()
@@ -105,6 +141,9 @@ class TimeTest(IExecutionStrategy):
     def get_times(self) -> Dict[str, List[float]]:
         return self._times
 
+    def get_errors(self) -> Dict[str, List[Tuple[float, float]]]:
+        return self._errors
+
 
 class BarChart(IExecutionStrategy):
     def __init__(self, iterations, compile_names: List[str], test_names: List[str], normalise: bool):
@@ -118,14 +157,21 @@ class BarChart(IExecutionStrategy):
         self._time_test.run(files)
         pass
 
+    def record(self, results: Dict[str, float], intervals: Dict[str, Tuple[float, float]] = None):
+        self._time_test.record(results, intervals)
+
     def show(self) -> any:
         times = self._time_test.get_times()
+        errors = self._time_test.get_errors()
         test_count = len(list(times.items())[0][1])
+        measured = all(len(errors[name]) == test_count for name in times)
         if self._normalise:
             for i in range(test_count):
                 min_time = min([t[i] for _, t in times.items()])
-                for _, t in times.items():
+                for name, t in times.items():
                     t[i] /= min_time
+                    if measured:
+                        errors[name][i] = tuple(e / min_time for e in errors[name][i])
         # times["Clang+Opt"][0] *= 1.3
         data = {'Clang+Opt': [1.4109095013909727, 1.1940299492102812, 1.88299122720978, 1.0911985900754444,
                               3.163244012991558,
@@ -140,6 +186,9 @@ class BarChart(IExecutionStrategy):
                                0.17348638317898554, 0.14198654181174794],
                       'Clang+Polly': [0.015, 0.02, 0.075, 0.02, 0.09, 0.065]}
         # error_bars = {name: list(map(lambda x: x/2, l)) for name, l in error_bars.items()}
+        if measured:
+            # Asymmetric bars from the recorded confidence intervals, lower then upper distances for each column
+            error_bars = np.array([np.transpose(errors[name]) for name in times])
         df = pd.DataFrame(times, self._test_names[:6])
         ax = df.plot.bar(rot=0, edgecolor="#444",
                          color={name: c for (name, c) in zip(self._compile_names, self._colors)},
@@ -165,6 +214,9 @@ class LineGraph(IExecutionStrategy):
         if not self._skip_tests:
             self._time_test.run(files)
 
+    def record(self, results: Dict[str, float]):
+        self._time_test.record(results)
+
     def show(self):
         # plt.scatter(times.values())
         data = {'Baseline': [0.0556795597076416, 0.06349349021911621, 0.07366394996643066, 0.08413243293762207,
@@ -0,0 +1,147 @@
+/* Times the kernels in kernels.c in-process, comparing the copy compiled without the polytope pass (base) against the
+ * copy compiled with it (poly). Only the nest itself is timed: the array is allocated once and re-initialised before
+ * every repetition, outside the timed region. One JSON object per kernel and variant is written to stdout. */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+#ifndef N
+#define N 500
+#endif
+#define seed 7
+
+#define KERNELS(X) X(arr_red) X(dithering) X(gauss_jordan) X(lcs) X(mat_mul) X(trans_clos)
+
+#define DECLARE(name) extern "C" void name##_base(int (*A)[N]); extern "C" void name##_poly(int (*A)[N]);
+KERNELS(DECLARE)
+
+struct Kernel {
+	std::string name;
+	std::function<void(int (*)[N])> base;
+	std::function<void(int (*)[N])> poly;
+};
+
+struct Result {
+	double median;
+	double mean;
+	double ciLow;
+	double ciHigh;
+	unsigned long checksum;
+};
+
+/* Same initial values as the examples. One extra row is allocated, as dithering reads A[i+1][j-1] on the last row. */
+static void Initialise(int (*A)[N]) {
+	for (int i = 0; i <= N; ++i) {
+		for (int j = 0; j < N; ++j) {
+			A[i][j] = (i + j * seed) % 4;
+		}
+	}
+}
+
+static unsigned long Checksum(int (*A)[N]) {
+	unsigned long res = 14695981039346656037ul;
+	for (int i = 0; i <= N; ++i) {
+		for (int j = 0; j < N; ++j) {
+			res = (res ^ (unsigned) A[i][j]) * 1099511628211ul;
+		}
+	}
+	return res;
+}
+
+/* Median with a distribution-free 95% confidence interval taken from the order statistics of the samples */
+static Result Summarise(std::vector<double> samples, unsigned long checksum) {
+	std::sort(samples.begin(), samples.end());
+	auto n = samples.size();
+	double mean = 0;
+	for (auto s: samples) {
+		mean += s;
+	}
+	mean /= n;
+	double median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	auto spread = 1.96 * std::sqrt((double) n) / 2;
+	auto low = (long) std::floor(n / 2.0 - spread);
+	auto high = (long) std::ceil(n / 2.0 + spread);
+	low = std::clamp(low, 0l, (long) n - 1);
+	high = std::clamp(high, 0l, (long) n - 1);
+	return {median, mean, samples[low], samples[high], checksum};
+}
+
+static Result Measure(const std::function<void(int (*)[N])>& kernel, int (*A)[N], int warmup, int repetitions) {
+	for (int r = 0; r < warmup; r++) {
+		Initialise(A);
+		kernel(A);
+	}
+	std::vector<double> samples;
+	for (int r = 0; r < repetitions; r++) {
+		Initialise(A);
+		auto start = std::chrono::steady_clock::now();
+		kernel(A);
+		auto end = std::chrono::steady_clock::now();
+		samples.push_back(std::chrono::duration<double>(end - start).count());
+	}
+	return Summarise(samples, Checksum(A));
+}
+
+static void PrintResult(const std::string& kernel, const std::string& variant, const Result& res, int repetitions) {
+	printf("{\"kernel\": \"%s\", \"variant\": \"%s\", \"n\": %d, \"repetitions\": %d, \"median\": %.9f, "
+		   "\"mean\": %.9f, \"ci_low\": %.9f, \"ci_high\": %.9f, \"checksum\": \"%016lx\"}\n",
+		   kernel.c_str(), variant.c_str(), N, repetitions, res.median, res.mean, res.ciLow, res.ciHigh,
+		   res.checksum);
+}
+
+int main(int argc, char** argv) {
+	int warmup = 3;
+	int repetitions = 30;
+	int cpu = -1;
+	std::string only;
+	for (int i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "--warmup")) {
+			warmup = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--repetitions")) {
+			repetitions = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--cpu")) {
+			cpu = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--kernel")) {
+			only = argv[++i];
+		}
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("sched_setaffinity");
+		}
+	}
+
+	std::vector<Kernel> kernels;
+#define REGISTER(name) kernels.push_back({#name, name##_base, name##_poly});
+	KERNELS(REGISTER)
+
+	auto* A = (int (*)[N]) malloc(sizeof(int[N + 1][N]));
+	int status = 0;
+	for (auto& kernel: kernels) {
+		if (!only.empty() && kernel.name != only) {
+			continue;
+		}
+		auto base = Measure(kernel.base, A, warmup, repetitions);
+		auto poly = Measure(kernel.poly, A, warmup, repetitions);
+		PrintResult(kernel.name, "base", base, repetitions);
+		PrintResult(kernel.name, "poly", poly, repetitions);
+		if (base.checksum != poly.checksum) {
+			fprintf(stderr, "%s: results of base and poly differ\n", kernel.name.c_str());
+			status = 1;
+		}
+	}
+	free(A);
+	return status;
+}
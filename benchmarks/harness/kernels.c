@@ -0,0 +1,66 @@
+/* The compute nests of benchmarks/examples as functions, for timing in-process by harness.cpp. This file is compiled
+ * once per variant with -DVARIANT=<name>, so that copies with and without the polytope pass link into one binary. */
+
+#ifndef N
+#define N 500
+#endif
+/* The triple nests are cubic, so they run over a smaller part of the array, as in the examples */
+#define N3 (N / 3)
+
+#define CONCAT(name, variant) name ## _ ## variant
+#define EXPAND(name, variant) CONCAT(name, variant)
+#define KERNEL(name) EXPAND(name, VARIANT)
+
+void KERNEL(arr_red)(int (*A)[N]) {
+    for (int i = 1; i < N; ++i) {
+        for (int j = 1; j < N; ++j) {
+            A[i][j] = A[i-1][j] + A[i][j-1];
+        }
+    }
+}
+
+void KERNEL(dithering)(int (*A)[N]) {
+    for (int i = 1; i < N; ++i) {
+        for (int j = 1; j < N; ++j) {
+            A[i][j] = A[i][j-1] + A[i-1][j] + A[i+1][j-1];
+        }
+    }
+}
+
+void KERNEL(gauss_jordan)(int (*A)[N]) {
+    for (int i = 1; i < N3; ++i) {
+        for (int j = 1; j < N3; ++j) {
+            for (int k = 1; k < N3; ++k) {
+                A[j][k] = A[j][k-1] + A[j-1][k];
+            }
+        }
+    }
+}
+
+void KERNEL(lcs)(int (*A)[N]) {
+    for (int i = 1; i < N; ++i) {
+        for (int j = 1; j < N; ++j) {
+            A[i][j] = A[i][j-1] + A[i-1][j] + A[i-1][j-1];
+        }
+    }
+}
+
+void KERNEL(mat_mul)(int (*A)[N]) {
+    for (int i = 1; i < N3; ++i) {
+        for (int j = 1; j < N3; ++j) {
+            for (int k = 1; k < N3; ++k) {
+                A[i][j] = A[i][k] * A[k][j];
+            }
+        }
+    }
+}
+
+void KERNEL(trans_clos)(int (*A)[N]) {
+    for (int i = 1; i < N3; ++i) {
+        for (int j = 1; j < N3; ++j) {
+            for (int k = 1; k < N3; ++k) {
+                A[j][k] = (A[j][i]&A[i][k]);
+            }
+        }
+    }
+}
@@ -1,9 +1,10 @@
 import glob
 import os
+import sys
 from typing import List
 
-from benchmark import Benchmark, ComparisonBenchmark
-from compilation_strategy import ClangStrategy, OptClangStrategy, PolytopeStrategy, ClangO3Strategy
+from benchmark import Benchmark, ComparisonBenchmark, CompileTimeBenchmark, HarnessBenchmark, PrefetchBenchmark
+from compilation_strategy import ClangStrategy, OptClangStrategy, PolytopeStrategy, ClangO3Strategy, DriverStrategy
 from example_generator import TestGenerator, RandomLinGenerator, SelectedExampleGenerator, RepeatedExampleGenerator, \
     TestExampleGenerator
 from execution_strategy import CorrectnessTest, TimeTest, BarChart, LineGraph
@@ -16,7 +17,8 @@ def main():
         # TestGenerator(1000),
         RandomLinGenerator(100),
         # SelectedExampleGenerator(2000),
-        [OptClangStrategy(), PolytopeStrategy()],
+        [DriverStrategy(polytope=False), DriverStrategy(polytope=True)],
+        # [OptClangStrategy(), PolytopeStrategy()],
         # [ClangStrategy(), OptClangStrategy(), PolytopeStrategy(), ClangO3Strategy()],
         # [BarChart(iterations=30, compile_names=["Clang+Opt", "Tope", "Clang+Polly"], test_names=test_names,
         #           normalise=True)],
@@ -35,6 +37,35 @@ def main():
     # comparison_benchmark.run()
 
 
+def harness():
+    clear()
+    test_names = sorted(["LCS", "Dither", "ArrReduce", "TransClos", "GaussJordan", "MatMul"])
+    benchmark = HarnessBenchmark(
+        [2000],
+        [BarChart(iterations=0, compile_names=["Clang+Opt", "Tope"], test_names=test_names, normalise=True)],
+    )
+    benchmark.run()
+
+
+def compile_time():
+    clear()
+    benchmark = CompileTimeBenchmark(
+        nest_counts=[10, 100, 1000, 4000],
+        depths=[2, 3, 4],
+    )
+    benchmark.run()
+    # benchmark.save_baseline()
+
+
+def prefetch():
+    clear()
+    benchmark = PrefetchBenchmark(
+        sizes=[2000, 8000],
+        distances=[4, 8, 16, 32],
+    )
+    benchmark.run()
+
+
 def create(examples: List[str], name="example"):
     for (i, program) in enumerate(examples):
         f = open(f"./dump/{name}_{i}.c", 'w')
@@ -51,4 +82,11 @@ def clear():
 
 
 if __name__ == "__main__":
-    main()
+    if len(sys.argv) > 1 and sys.argv[1] == "compile-time":
+        compile_time()
+    elif len(sys.argv) > 1 and sys.argv[1] == "harness":
+        harness()
+    elif len(sys.argv) > 1 and sys.argv[1] == "prefetch":
+        prefetch()
+    else:
+        main()
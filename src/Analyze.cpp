@@ -0,0 +1,240 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "Polytope.h"
+#include "ScheduleVerifier.h"
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/LCSSA.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+
+/* Runs the polytope analysis and transform search over a corpus of IR files without generating code, writing one
+ * JSON object per loop nest. Each worker thread owns its own LLVMContext and pass instance. */
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+									cl::desc("<.ll/.bc files or directories to scan>"));
+static cl::opt<std::string> Output("o", cl::init("-"), cl::desc("Output file for JSON lines"),
+								   cl::value_desc("filename"));
+static cl::opt<bool> VerifySchedules("verify-schedules", cl::init(false),
+									 cl::desc("Check every transform found by interpreting its nest over the constant "
+											  "iteration domain"));
+static cl::opt<unsigned> Threads("j", cl::init(0), cl::desc("Number of worker threads (default: all cores)"));
+
+static json::Array AccessesToJSON(const std::vector<std::vector<std::vector<int>>>& accesses) {
+	json::Array res;
+	for (auto& access: accesses) {
+		json::Array indices;
+		for (auto& index: access) {
+			indices.push_back(json::Array(index));
+		}
+		res.push_back(std::move(indices));
+	}
+	return res;
+}
+
+static json::Array MatrixToJSON(const std::vector<std::vector<int>>& A) {
+	json::Array res;
+	for (auto& row: A) {
+		res.push_back(json::Array(row));
+	}
+	return res;
+}
+
+static json::Object ReportToJSON(StringRef file, Function& F, Loop& L, const NestReport& report) {
+	json::Object res{
+			{"file",     file},
+			{"function", F.getName()},
+			{"loop",     L.getHeader()->getName()},
+			{"depth",    L.getLoopDepth()},
+	};
+	if (auto loc = L.getStartLoc()) {
+		res["line"] = loc.getLine();
+		res["column"] = loc.getCol();
+	}
+	if (report.transform) {
+		res["status"] = "transformed";
+		res["transform"] = MatrixToJSON(*report.transform);
+	} else {
+		res["status"] = "missed";
+		res["reason"] = PolytopePass::RejectionName(report.rejection);
+	}
+	if (report.assignment) {
+		res["writes"] = AccessesToJSON(report.assignment->writes);
+		res["reads"] = AccessesToJSON(report.assignment->reads);
+		res["dependence_vectors"] = MatrixToJSON(report.assignment->GetDependenceVectors());
+		if (!report.assignment->reductions.empty()) {
+			res["reductions"] = AccessesToJSON(report.assignment->reductions);
+		}
+	}
+	if (VerifySchedules && report.transform) {
+		ScheduleVerifier verifier(*report.assignment, report.bounds.value_or(std::vector<std::pair<int, int>>{}));
+		if (!verifier.Checkable()) {
+			res["schedule"] = "unchecked";
+		} else if (auto violation = verifier.Verify(*report.transform)) {
+			res["schedule"] = "illegal";
+			res["violation"] = json::Object{
+					{"kind",    violation->kind},
+					{"source",  json::Array(violation->source)},
+					{"sink",    json::Array(violation->sink)},
+					{"element", json::Array(violation->element)},
+			};
+		} else {
+			res["schedule"] = "legal";
+		}
+	}
+	auto& profile = report.profile;
+	if (profile.count || profile.hot || profile.cold ||
+		std::any_of(profile.tripCounts.begin(), profile.tripCounts.end(), [](auto t) { return t.has_value(); })) {
+		json::Array tripCounts;
+		for (auto tripCount: profile.tripCounts) {
+			tripCounts.push_back(tripCount ? json::Value((int64_t) *tripCount) : json::Value(nullptr));
+		}
+		res["profile"] = json::Object{
+				{"count",       profile.count ? json::Value((int64_t) *profile.count) : json::Value(nullptr)},
+				{"trip_counts", std::move(tripCounts)},
+				{"hot",         profile.hot},
+				{"cold",        profile.cold},
+		};
+	}
+	res["times_us"] = json::Object{
+			{"analysis", report.times.analysis},
+			{"search",   report.times.search},
+	};
+	return res;
+}
+
+/* Analyses every loop nest in a module, in the same order the loop pass manager visits them */
+static void AnalyzeModule(StringRef file, Module& M, PolytopePass& pass, std::vector<json::Object>& reports) {
+	ProfileSummaryInfo PSI(M);
+	for (auto& F: M) {
+		if (F.isDeclaration()) {
+			continue;
+		}
+		DominatorTree DT(F);
+		LoopInfo LI(DT);
+		TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+		TargetLibraryInfo TLI(TLII, &F);
+		AssumptionCache AC(F);
+		/* Put loops into the canonical form the loop pass manager guarantees before running the pass */
+		for (auto* L: LI) {
+			simplifyLoop(L, &DT, &LI, nullptr, &AC, nullptr, false);
+			formLCSSARecursively(*L, DT, &LI, nullptr);
+		}
+		ScalarEvolution SE(F, TLI, AC, DT, LI);
+		/* Reductions are only recognised when the other accesses provably do not alias their element */
+		BasicAAResult BAA(M.getDataLayout(), F, TLI, AC, &DT);
+		AAResults AA(TLI);
+		AA.addAAResult(BAA);
+		TargetTransformInfo TTI(M.getDataLayout());
+		PostDominatorTree PDT(F);
+		BranchProbabilityInfo BPI(F, LI, &TLI, &DT, &PDT);
+		BlockFrequencyInfo BFI(F, BPI, LI);
+		LoopStandardAnalysisResults AR{AA, AC, DT, LI, SE, TLI, TTI, &BFI, &BPI, nullptr};
+
+		/* The loop pass manager pops its worklist of each top-level loop's preorder, pushed in LoopInfo's order, from
+		 * the back: inner loops before the loops around them, and top-level loops in program order */
+		std::vector<Loop*> worklist;
+		for (auto* root: LI) {
+			auto preorder = root->getLoopsInPreorder();
+			worklist.insert(worklist.end(), preorder.begin(), preorder.end());
+		}
+		for (auto* L: reverse(worklist)) {
+			if (L->getSubLoops().empty()) {
+				continue;
+			}
+			auto report = pass.AnalyzeNest(*L, AR, {&BFI, &PSI});
+			reports.push_back(ReportToJSON(file, F, *L, report));
+		}
+	}
+}
+
+static std::vector<std::string> CollectInputs() {
+	std::vector<std::string> files;
+	for (auto& input: Inputs) {
+		if (!sys::fs::is_directory(input)) {
+			files.push_back(input);
+			continue;
+		}
+		std::error_code EC;
+		for (sys::fs::recursive_directory_iterator it(input, EC), end; it != end && !EC; it.increment(EC)) {
+			auto ext = sys::path::extension(it->path());
+			if (ext == ".ll" || ext == ".bc") {
+				files.push_back(it->path());
+			}
+		}
+	}
+	return files;
+}
+
+int main(int argc, char** argv) {
+	InitLLVM X(argc, argv);
+	cl::ParseCommandLineOptions(argc, argv, "polytope loop nest analyser\n");
+
+	auto files = CollectInputs();
+	std::error_code EC;
+	raw_fd_ostream out(Output, EC, sys::fs::OF_Text);
+	if (EC) {
+		errs() << "Could not open " << Output << ": " << EC.message() << "\n";
+		return 1;
+	}
+
+	unsigned threadCount = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+	std::atomic<size_t> next = 0;
+	std::atomic<unsigned> failures = 0;
+	std::mutex outputLock;
+
+	auto worker = [&]() {
+		LLVMContext ctx;
+		PolytopePass pass;
+		size_t i;
+		while ((i = next++) < files.size()) {
+			SMDiagnostic err;
+			auto M = parseIRFile(files[i], err, ctx);
+			if (!M) {
+				std::lock_guard<std::mutex> guard(outputLock);
+				err.print("polytope-analyze", errs());
+				failures++;
+				continue;
+			}
+			std::vector<json::Object> reports;
+			AnalyzeModule(files[i], *M, pass, reports);
+
+			std::lock_guard<std::mutex> guard(outputLock);
+			for (auto& report: reports) {
+				out << json::Value(std::move(report)) << "\n";
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threadCount; t++) {
+		workers.emplace_back(worker);
+	}
+	for (auto& t: workers) {
+		t.join();
+	}
+	return failures ? 1 : 0;
+}
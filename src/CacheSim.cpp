@@ -0,0 +1,158 @@
+#include <sstream>
+#include "CacheSimulator.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+/* Simulates a nest under several transforms and tile shapes, to compare interchange, skewing and tiling offline.
+ * Accesses use the index format of LoopDependencies, one row per array dimension with a coefficient per induction
+ * variable and the constant last, eg. for A[i][j] = A[i-1][j] + A[i][j-1] over 1 <= i, j <= 499:
+ *
+ *   polytope-cachesim -write "1 0 0; 0 1 0" -read "1 0 -1; 0 1 0" -read "1 0 0; 0 1 -1" -bounds 1:499,1:499 \
+ *     -row-length 500 -transform "1 0; 0 1" -transform "1 1; 0 1" -tile 32,32
+ *
+ * One JSON object is printed per transform and tile shape, including the untiled schedule. */
+
+using namespace llvm;
+
+static cl::list<std::string> Writes("write", cl::desc("Index rows of an array write, separated by ';'"));
+static cl::list<std::string> Reads("read", cl::desc("Index rows of an array read, separated by ';'"));
+static cl::opt<std::string> Bounds("bounds", cl::Required,
+								   cl::desc("Inclusive range of each induction variable, eg. 1:499,1:499"));
+static cl::opt<long> RowLength("row-length", cl::init(1024), cl::desc("Elements per row of the array"));
+static cl::opt<unsigned> ElementSize("element-size", cl::init(4), cl::desc("Bytes per array element"));
+static cl::list<std::string> Transforms("transform", cl::desc("Rows of a transform matrix, separated by ';' "
+															   "(default: identity)"));
+static cl::list<std::string> Tiles("tile", cl::desc("Tile sizes in the transformed space, eg. 32,32"));
+static cl::opt<std::string> Hierarchy("cache", cl::init("32K:64:8,1M:64:16,32M:64:16"),
+									  cl::desc("Cache levels as size:line:ways,..."));
+
+static std::optional<std::vector<std::vector<int>>> ParseMatrix(const std::string& text) {
+	std::vector<std::vector<int>> res;
+	std::istringstream rows(text);
+	std::string row;
+	while (std::getline(rows, row, ';')) {
+		std::istringstream values(row);
+		std::vector<int> r;
+		int x;
+		while (values >> x) {
+			r.push_back(x);
+		}
+		if (r.empty() || (!res.empty() && r.size() != res[0].size())) {
+			return {};
+		}
+		res.push_back(r);
+	}
+	if (res.empty()) {
+		return {};
+	}
+	return res;
+}
+
+static std::optional<std::vector<int>> ParseList(const std::string& text) {
+	std::vector<int> res;
+	std::istringstream values(text);
+	std::string value;
+	while (std::getline(values, value, ',')) {
+		try {
+			res.push_back(std::stoi(value));
+		} catch (std::exception&) {
+			return {};
+		}
+	}
+	return res;
+}
+
+static std::optional<std::vector<std::pair<int, int>>> ParseBounds(const std::string& text) {
+	std::vector<std::pair<int, int>> res;
+	std::istringstream ranges(text);
+	std::string range;
+	while (std::getline(ranges, range, ',')) {
+		std::istringstream fields(range);
+		int lower, upper;
+		char sep;
+		if (!(fields >> lower >> sep >> upper) || sep != ':') {
+			return {};
+		}
+		res.emplace_back(lower, upper);
+	}
+	return res;
+}
+
+static json::Array MatrixToJSON(const std::vector<std::vector<int>>& A) {
+	json::Array res;
+	for (auto& row: A) {
+		res.push_back(json::Array(row));
+	}
+	return res;
+}
+
+static json::Object StatsToJSON(const CacheStats& stats) {
+	return json::Object{
+			{"accesses",            (int64_t) stats.accesses},
+			{"misses",              json::Array(stats.misses)},
+			{"cold",                (int64_t) stats.coldAccesses},
+			{"mean_reuse_distance", stats.meanReuseDistance},
+			{"reuse_histogram",     json::Array(stats.reuseHistogram)},
+			{"cost",                stats.Cost()},
+	};
+}
+
+int main(int argc, char** argv) {
+	InitLLVM X(argc, argv);
+	cl::ParseCommandLineOptions(argc, argv, "cache simulator for polytope loop nests\n");
+
+	auto bounds = ParseBounds(Bounds);
+	auto levels = CacheSimulator::ParseHierarchy(Hierarchy);
+	if (!bounds || bounds->empty() || !levels) {
+		errs() << "Invalid -bounds or -cache\n";
+		return 1;
+	}
+	auto dim = bounds->size();
+	std::vector<std::vector<std::vector<int>>> writes, reads;
+	for (auto [list, accesses]: {std::pair{&Writes, &writes}, {&Reads, &reads}}) {
+		for (auto& text: *list) {
+			auto access = ParseMatrix(text);
+			if (!access || (*access)[0].size() != dim + 1) {
+				errs() << "Invalid access '" << text << "': expected " << dim + 1 << " values per row\n";
+				return 1;
+			}
+			accesses->push_back(*access);
+		}
+	}
+	std::vector<std::vector<std::vector<int>>> transforms;
+	for (auto& text: Transforms) {
+		auto T = ParseMatrix(text);
+		if (!T || T->size() != dim || (*T)[0].size() != dim) {
+			errs() << "Invalid transform '" << text << "'\n";
+			return 1;
+		}
+		transforms.push_back(*T);
+	}
+	if (transforms.empty()) {
+		transforms.push_back(IntegerSolver::IdentityMatrix(dim));
+	}
+	std::vector<std::vector<int>> tiles = {{}};
+	for (auto& text: Tiles) {
+		auto tile = ParseList(text);
+		if (!tile || tile->size() != dim || std::count_if(tile->begin(), tile->end(), [](int t) { return t <= 0; })) {
+			errs() << "Invalid tile '" << text << "'\n";
+			return 1;
+		}
+		tiles.push_back(*tile);
+	}
+
+	LoopDependencies assignment(writes, reads);
+	for (auto& T: transforms) {
+		for (auto& tile: tiles) {
+			auto stats = CacheSimulator::SimulateNest(assignment, *bounds, T, {RowLength, ElementSize}, *levels, tile);
+			json::Object res{{"transform", MatrixToJSON(T)}};
+			res["tile"] = json::Array(tile);
+			res["stats"] = StatsToJSON(stats);
+			outs() << json::Value(std::move(res)) << "\n";
+		}
+	}
+	return 0;
+}
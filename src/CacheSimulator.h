@@ -0,0 +1,355 @@
+#ifndef LLVM_TRANSFORMS_POLYLOOP_CACHESIMULATOR_H
+#define LLVM_TRANSFORMS_POLYLOOP_CACHESIMULATOR_H
+
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "LoopDependencies.h"
+#include "ScheduleVerifier.h"
+
+/* One level of a set-associative cache */
+struct CacheLevel {
+	unsigned long size;
+	unsigned line;
+	unsigned ways;
+};
+
+/* Row-major layout of the array a nest accesses */
+struct ArrayLayout {
+	long rowLength;
+	unsigned elementSize;
+};
+
+struct CacheStats {
+	unsigned long accesses = 0;
+	/* Misses at each level, first level first */
+	std::vector<unsigned long> misses;
+	/* Accesses to lines not seen before, which have no reuse distance */
+	unsigned long coldAccesses = 0;
+	double meanReuseDistance = 0;
+	/* Number of reuses with a distance in [2^(k-1), 2^k), with bucket 0 holding distance 0 */
+	std::vector<unsigned long> reuseHistogram;
+
+	/* Misses weighted by the relative cost of going one level further out, used to rank transforms */
+	double Cost() const {
+		double res = 0;
+		double weight = 1;
+		for (auto m: misses) {
+			res += weight * (double) m;
+			weight *= 10;
+		}
+		return res;
+	}
+};
+
+/* Trace-driven simulator of a non-inclusive multi-level cache with LRU replacement. A miss at one level is looked up at
+ * the next and fills every level it missed in. Reuse distance, the number of distinct lines touched between two
+ * accesses to the same line, is computed exactly over the whole trace. */
+class CacheSimulator {
+public:
+	explicit CacheSimulator(const std::vector<CacheLevel>& config) {
+		for (auto& level: config) {
+			Level l;
+			l.config = level;
+			l.sets = std::max(1ul, level.size / (level.line * level.ways));
+			l.tags.assign(l.sets * level.ways, ~0ul);
+			l.stamps.assign(l.sets * level.ways, 0);
+			levels.push_back(l);
+		}
+		stats.misses.assign(levels.size(), 0);
+	}
+
+	/* 32KiB 8-way L1, 1MiB 16-way L2 and 32MiB 16-way L3 with 64 byte lines */
+	static std::vector<CacheLevel> DefaultHierarchy() {
+		return {{32 << 10, 64, 8},
+				{1 << 20,  64, 16},
+				{32 << 20, 64, 16}};
+	}
+
+	/* Parses "size:line:ways,..." with sizes optionally suffixed by K or M, eg. "32K:64:8,1M:64:16" */
+	static std::optional<std::vector<CacheLevel>> ParseHierarchy(const std::string& spec) {
+		std::vector<CacheLevel> res;
+		std::istringstream in(spec);
+		std::string level;
+		while (std::getline(in, level, ',')) {
+			std::istringstream fields(level);
+			unsigned long size;
+			char unit = 0;
+			char sep1, sep2;
+			CacheLevel l{};
+			if (!(fields >> size)) {
+				return {};
+			}
+			if (fields.peek() == 'K' || fields.peek() == 'M') {
+				fields >> unit;
+			}
+			l.size = size << (unit == 'K' ? 10 : unit == 'M' ? 20 : 0);
+			if (!(fields >> sep1 >> l.line >> sep2 >> l.ways) || sep1 != ':' || sep2 != ':' || !l.line || !l.ways) {
+				return {};
+			}
+			res.push_back(l);
+		}
+		if (res.empty()) {
+			return {};
+		}
+		return res;
+	}
+
+	void Access(unsigned long address) {
+		stats.accesses++;
+		time++;
+		for (size_t i = 0; i < levels.size(); i++) {
+			if (Lookup(levels[i], address)) {
+				break;
+			}
+			stats.misses[i]++;
+		}
+		RecordReuse(address / (levels.empty() ? 64 : levels[0].config.line));
+	}
+
+	CacheStats Stats() const {
+		auto res = stats;
+		auto reuses = res.accesses - res.coldAccesses;
+		res.meanReuseDistance = reuses ? distanceSum / (double) reuses : 0;
+		return res;
+	}
+
+	/* Simulates the nest executed in the order given by transform T, optionally tiled in the transformed space.
+	 * Each iteration performs its reads and then its writes. */
+	static CacheStats SimulateNest(const LoopDependencies& assignment, const std::vector<std::pair<int, int>>& bounds,
+								   const std::vector<std::vector<int>>& T, ArrayLayout layout,
+								   const std::vector<CacheLevel>& levels, const std::vector<int>& tiles = {}) {
+		CacheSimulator simulator(levels);
+		std::vector<int> x(bounds.size());
+		/* Keeps addresses of elements at negative indices positive */
+		const unsigned long base = 1ul << 40;
+		auto access = [&](const std::vector<std::vector<int>>& index) {
+			long element = 0;
+			for (size_t d = 0; d < index.size(); d++) {
+				element = element * (d ? layout.rowLength : 1) + ScheduleVerifier::Index(index[d], x);
+			}
+			simulator.Access(base + element * (long) layout.elementSize);
+		};
+		for (auto it: ScheduleVerifier::ExecutionOrder(bounds, T, tiles)) {
+			ScheduleVerifier::Point(bounds, it, x);
+			for (auto& read: assignment.reads) {
+				access(read);
+			}
+			for (auto& write: assignment.writes) {
+				access(write);
+			}
+		}
+		return simulator.Stats();
+	}
+
+	/* Side of the square tiles the skewed copies of PolytopeLayout.c move elements in; the pass hands it to the runtime
+	 * in the layout descriptor */
+	static constexpr int SkewCopyTile = 32;
+
+	/* Misses of the nest run in the order given by T, estimated from the strides of its accesses rather than simulated,
+	 * in the manner of Wolf and Lam. Element f(x) of every access is at address weights . f(x) elements from the start
+	 * of the array. Accesses with the same linear part that the outer loop p reaches at the same offset share their
+	 * lines, and each such group touches a new line every line / stride iterations of the inner loop q. A level that
+	 * holds the lines of one sweep of q keeps them for the next value of p, and then only misses on footprint lines,
+	 * or on none when warm, as the data is already there. T is unimodular. */
+	static CacheStats EstimateNest(const LoopDependencies& assignment, const std::vector<std::pair<int, int>>& bounds,
+								   const std::vector<std::vector<int>>& T, const std::vector<long>& weights,
+								   unsigned elementSize, double footprint, const std::vector<CacheLevel>& levels,
+								   bool warm = false) {
+		CacheStats res;
+		double iterations = 1;
+		for (auto [lower, upper]: bounds) {
+			iterations *= upper - lower + 1;
+		}
+		/* Values p takes, and the steps in x that advance q and p */
+		long firstRow = 0;
+		long lastRow = 0;
+		for (size_t d = 0; d < bounds.size(); d++) {
+			long a = (long) T[0][d] * bounds[d].first;
+			long b = (long) T[0][d] * bounds[d].second;
+			firstRow += std::min(a, b);
+			lastRow += std::max(a, b);
+		}
+		double sweep = iterations / (double) (lastRow - firstRow + 1);
+		auto inverseT = IntegerSolver::InverseTranspose(T);
+		assert(inverseT && "EstimateNest needs a unimodular transform");
+		auto& inverse = *inverseT;
+
+		/* Stride along q of each group, in elements */
+		std::vector<std::pair<std::vector<std::vector<int>>, long>> groups;
+		std::vector<long> strides;
+		auto group = [&](const std::vector<std::vector<int>>& access) {
+			std::vector<std::vector<int>> linear;
+			long stride = 0;
+			bool identity = true;
+			for (size_t d = 0; d < access.size(); d++) {
+				linear.emplace_back(access[d].begin(), access[d].end() - 1);
+				for (size_t v = 0; v < linear[d].size(); v++) {
+					stride += weights[d] * linear[d][v] * inverse[1][v];
+					identity = identity && linear[d][v] == (d == v);
+				}
+			}
+			/* x + c is reached by p at offset T0 c; other accesses are told apart by their whole constant */
+			std::vector<long> offset;
+			for (size_t d = 0; d < access.size(); d++) {
+				offset.push_back(identity ? (long) T[0][d] * access[d].back() : access[d].back());
+			}
+			auto key = std::make_pair(linear, identity ? std::accumulate(offset.begin(), offset.end(), 0l) : 0l);
+			if (!identity || std::find(groups.begin(), groups.end(), key) == groups.end()) {
+				groups.push_back(key);
+				strides.push_back(stride);
+			}
+			res.accesses += (unsigned long) iterations;
+		};
+		std::for_each(assignment.reads.begin(), assignment.reads.end(), group);
+		std::for_each(assignment.writes.begin(), assignment.writes.end(), group);
+
+		for (auto& level: levels) {
+			double perIteration = 0;
+			double sweepLines = 0;
+			for (auto stride: strides) {
+				double lines = std::min(1.0, (double) std::abs(stride) * elementSize / level.line);
+				perIteration += lines;
+				sweepLines += std::max(1.0, sweep * lines);
+			}
+			bool reused = sweepLines * level.line <= (double) level.size / 2;
+			bool fits = footprint * level.line <= (double) level.size / 2;
+			double misses = reused ? (warm && fits ? 0 : footprint) : std::max(footprint, iterations * perIteration);
+			res.misses.push_back((unsigned long) misses);
+		}
+		res.coldAccesses = (unsigned long) footprint;
+		return res;
+	}
+
+	/* Estimated misses of the nest run on a skewed copy of its array, with the copies. The copy moves the elements of
+	 * box, tile by tile, into a buffer of the given columns that keeps element x at row T0 x and column T1 x, less an
+	 * origin, and back when copyBack is set. A tile walks rows of the array, so the array costs a miss per line; the
+	 * buffer too at levels that hold the buffer lines of a tile, and a miss per element elsewhere when its stride
+	 * spans a line. The nest then walks rows of the buffer and finds it warm at levels that hold it. */
+	static CacheStats EstimateSkewedNest(const LoopDependencies& assignment,
+										 const std::vector<std::pair<int, int>>& bounds,
+										 const std::vector<std::vector<int>>& T, ArrayLayout layout,
+										 const std::vector<std::pair<long, long>>& box, long columns,
+										 const std::vector<CacheLevel>& levels, bool copyBack) {
+		double elements = 1;
+		for (auto [lower, upper]: box) {
+			elements *= (double) (upper - lower + 1);
+		}
+		std::vector<long> weights;
+		for (size_t d = 0; d < T.size(); d++) {
+			weights.push_back(T[0][d] * columns + T[1][d]);
+		}
+		double footprint = std::ceil(elements * layout.elementSize / (levels.empty() ? 64 : levels[0].line));
+		auto res = EstimateNest(assignment, bounds, T, weights, layout.elementSize, footprint, levels, true);
+
+		/* Buffer rows a tile spans, and the distance in the buffer between the elements the copy visits in turn */
+		long tileRows = (std::abs(T[0][0]) + std::abs(T[0][1])) * (long) SkewCopyTile;
+		long stride = std::abs(T[0][1] * columns + T[1][1]) * (long) layout.elementSize;
+		for (size_t i = 0; i < levels.size(); i++) {
+			auto& level = levels[i];
+			double lines = elements * layout.elementSize / level.line;
+			double tileLines = std::ceil((double) SkewCopyTile * layout.elementSize / level.line);
+			double arrayMisses = elements / std::min((double) level.line / layout.elementSize, (double) SkewCopyTile);
+			bool tileFits = (double) (tileRows + SkewCopyTile) * tileLines * level.line <= (double) level.size / 2;
+			double bufferMisses = tileFits ? lines : elements * std::min(1.0, (double) stride / level.line);
+			res.misses[i] += (unsigned long) ((arrayMisses + bufferMisses) * (copyBack ? 2 : 1));
+		}
+		res.accesses += (unsigned long) (elements * (copyBack ? 4 : 2));
+		return res;
+	}
+
+	/* The first extent iterations of each dimension, so that large or symbolic domains can be simulated cheaply */
+	static std::vector<std::pair<int, int>> SampleDomain(const std::vector<std::pair<int, int>>& bounds, int extent) {
+		std::vector<std::pair<int, int>> res;
+		for (auto [lower, upper]: bounds) {
+			res.emplace_back(lower, std::min(upper, lower + extent - 1));
+		}
+		return res;
+	}
+
+private:
+	struct Level {
+		CacheLevel config;
+		unsigned long sets;
+		std::vector<unsigned long> tags;
+		std::vector<unsigned long> stamps;
+	};
+
+	std::vector<Level> levels;
+	CacheStats stats;
+	unsigned long time = 0;
+
+	/* Time of the last access to each line, and a Fenwick tree with a mark at each of those times */
+	std::unordered_map<unsigned long, unsigned long> lastAccess;
+	std::vector<int> marks;
+	double distanceSum = 0;
+
+	bool Lookup(Level& level, unsigned long address) {
+		auto line = address / level.config.line;
+		auto set = line % level.sets;
+		auto* tags = &level.tags[set * level.config.ways];
+		auto* stamps = &level.stamps[set * level.config.ways];
+		unsigned victim = 0;
+		for (unsigned way = 0; way < level.config.ways; way++) {
+			if (tags[way] == line) {
+				stamps[way] = time;
+				return true;
+			}
+			if (stamps[way] < stamps[victim]) {
+				victim = way;
+			}
+		}
+		tags[victim] = line;
+		stamps[victim] = time;
+		return false;
+	}
+
+	void AddMark(unsigned long t, int delta) {
+		for (; t < marks.size(); t += t & -t) {
+			marks[t] += delta;
+		}
+	}
+
+	int CountMarks(unsigned long t) const {
+		int res = 0;
+		for (; t > 0; t -= t & -t) {
+			res += marks[t];
+		}
+		return res;
+	}
+
+	void RecordReuse(unsigned long line) {
+		if (time >= marks.size()) {
+			/* Rebuild the tree at twice the size from the live marks */
+			marks.assign(std::max(1024ul, 2 * marks.size()), 0);
+			for (auto [l, t]: lastAccess) {
+				AddMark(t, 1);
+			}
+		}
+		auto it = lastAccess.find(line);
+		if (it == lastAccess.end()) {
+			stats.coldAccesses++;
+			lastAccess[line] = time;
+			AddMark(time, 1);
+			return;
+		}
+		/* Lines touched since the last access are exactly the marks after it */
+		auto distance = (unsigned long) (CountMarks(time - 1) - CountMarks(it->second));
+		distanceSum += (double) distance;
+		size_t bucket = distance ? (size_t) std::log2((double) distance) + 1 : 0;
+		if (stats.reuseHistogram.size() <= bucket) {
+			stats.reuseHistogram.resize(bucket + 1, 0);
+		}
+		stats.reuseHistogram[bucket]++;
+		AddMark(it->second, -1);
+		it->second = time;
+		AddMark(time, 1);
+	}
+};
+
+#endif // LLVM_TRANSFORMS_POLYLOOP_CACHESIMULATOR_H
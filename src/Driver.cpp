@@ -0,0 +1,194 @@
+#include <atomic>
+#include <thread>
+#include "Polytope.h"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+/* Compiles a batch of IR files, as clang -emit-llvm -O0 -Xclang -disable-O0-optnone writes them, to executables in a
+ * single process: the same opt pipelines as benchmarks/compilation_strategy.py, optionally the polytope pass, then
+ * object emission. IR stays in memory between stages, and inputs are compiled in parallel with one LLVMContext per
+ * worker. Only the system linker is spawned, through cc. The path of each executable is printed on its own line, in
+ * input order, with an empty line for inputs that failed. */
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore, cl::desc("<.ll/.bc files>"));
+static cl::opt<std::string> OutputDir("output-dir", cl::init("./bin"), cl::desc("Directory for executables"));
+static cl::opt<std::string> Suffix("suffix", cl::init(""), cl::desc("Suffix appended to each executable name"));
+static cl::opt<bool> RunPolytope("polytope", cl::init(false), cl::desc("Run the polytope pass after the pre-pipeline"));
+static cl::opt<std::string> PrePasses("pre-passes", cl::init("mem2reg,loop-rotate,simplifycfg,instcombine,loop-vectorize"),
+									  cl::desc("Pipeline run on the input IR"));
+static cl::opt<std::string> PostPasses("post-passes", cl::init("simplifycfg,instcombine"),
+									   cl::desc("Pipeline run after the polytope pass"));
+static cl::opt<std::string> LinkerName("cc", cl::init("cc"), cl::desc("C compiler driver used to link"));
+static cl::opt<bool> SaveTemps("save-temps", cl::init(false),
+							   cl::desc("Write the bitcode after each stage next to the executable"));
+static cl::opt<std::string> Runtime("runtime", cl::init(""),
+									cl::desc("Library linked into every executable, eg. libpolytope-runtime.a when "
+											 "compiling with -polytope-instrument, -polytope-autotune, "
+											 "-polytope-skew-layout, -polytope-contract or -polytope-out-of-core"));
+static cl::opt<unsigned> Threads("j", cl::init(0), cl::desc("Number of worker threads (default: all cores)"));
+
+static std::string LinkerPath;
+
+static bool RunPipeline(Module& M, StringRef pipeline) {
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+	PassBuilder PB;
+	getPolyLoopPluginInfo().RegisterPassBuilderCallbacks(PB);
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+	ModulePassManager MPM;
+	if (auto err = PB.parsePassPipeline(MPM, pipeline)) {
+		errs() << "Invalid pipeline '" << pipeline << "': " << toString(std::move(err)) << "\n";
+		return false;
+	}
+	MPM.run(M, MAM);
+	return !verifyModule(M, &errs());
+}
+
+static bool Backend(Module& M, const std::string& object) {
+	std::string error;
+	auto triple = M.getTargetTriple().empty() ? sys::getDefaultTargetTriple() : M.getTargetTriple();
+	auto* target = TargetRegistry::lookupTarget(triple, error);
+	if (!target) {
+		errs() << error << "\n";
+		return false;
+	}
+	std::unique_ptr<TargetMachine> TM(target->createTargetMachine(triple, "generic", "", TargetOptions(),
+																  Reloc::PIC_, None, CodeGenOpt::None));
+	M.setDataLayout(TM->createDataLayout());
+
+	std::error_code EC;
+	raw_fd_ostream out(object, EC, sys::fs::OF_None);
+	if (EC) {
+		errs() << "Could not open " << object << ": " << EC.message() << "\n";
+		return false;
+	}
+	legacy::PassManager PM;
+	if (TM->addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile)) {
+		return false;
+	}
+	PM.run(M);
+	return true;
+}
+
+static bool Link(const std::string& object, const std::string& binary) {
+	SmallVector<StringRef, 8> args = {LinkerPath, object, "-o", binary};
+	if (!Runtime.empty()) {
+		args.append({Runtime, "-lpthread", "-lm"});
+	}
+	std::string error;
+	if (sys::ExecuteAndWait(LinkerPath, args, None, {}, 0, 0, &error) != 0) {
+		errs() << "Could not link " << binary << (error.empty() ? "" : ": " + error) << "\n";
+		return false;
+	}
+	return true;
+}
+
+static void SaveBitcode(const Module& M, const std::string& path) {
+	std::error_code EC;
+	raw_fd_ostream out(path, EC, sys::fs::OF_None);
+	if (!EC) {
+		WriteBitcodeToFile(M, out);
+	}
+}
+
+static bool Compile(const std::string& file, const std::string& binary, LLVMContext& ctx) {
+	SMDiagnostic error;
+	auto M = parseIRFile(file, error, ctx);
+	if (!M) {
+		error.print("polytope-cc", errs());
+		return false;
+	}
+	if (!RunPipeline(*M, PrePasses)) {
+		return false;
+	}
+	if (SaveTemps) {
+		SaveBitcode(*M, binary + "_opt.bc");
+	}
+	if (RunPolytope) {
+		if (!RunPipeline(*M, "require<profile-summary>,function(polytope)") || !RunPipeline(*M, PostPasses)) {
+			return false;
+		}
+		if (SaveTemps) {
+			SaveBitcode(*M, binary + "_poly.bc");
+		}
+	}
+
+	auto object = binary + ".o";
+	auto res = Backend(*M, object) && Link(object, binary);
+	sys::fs::remove(object);
+	return res;
+}
+
+int main(int argc, char** argv) {
+	InitLLVM X(argc, argv);
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	cl::ParseCommandLineOptions(argc, argv, "in-process compiler for the polytope benchmarks\n");
+
+	auto linker = sys::findProgramByName(LinkerName);
+	if (!linker) {
+		errs() << "Could not find " << LinkerName << "\n";
+		return 1;
+	}
+	LinkerPath = *linker;
+	sys::fs::create_directories(OutputDir);
+
+	std::vector<std::string> binaries(Inputs.size());
+	unsigned threadCount = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+	std::atomic<size_t> next = 0;
+	std::atomic<unsigned> failures = 0;
+
+	auto worker = [&]() {
+		LLVMContext ctx;
+		size_t i;
+		while ((i = next++) < Inputs.size()) {
+			std::string binary = OutputDir + "/" + sys::path::stem(Inputs[i]).str() + Suffix;
+			if (Compile(Inputs[i], binary, ctx)) {
+				binaries[i] = binary;
+			} else {
+				errs() << "Failed to compile " << Inputs[i] << "\n";
+				failures++;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threadCount; t++) {
+		workers.emplace_back(worker);
+	}
+	for (auto& t: workers) {
+		t.join();
+	}
+
+	for (auto& binary: binaries) {
+		outs() << binary << "\n";
+	}
+	return failures ? 1 : 0;
+}
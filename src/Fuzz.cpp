@@ -0,0 +1,683 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Polytope.h"
+#include "ScheduleVerifier.h"
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LCSSA.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+
+/* Differential fuzzer for the legality of the polytope transforms. Random affine nests, in the same form as the
+ * examples from RandomLinGenerator, are built directly as IR in batches. Each batch is cloned, the clone is run through
+ * the polytope pass, and both versions are JIT-compiled and executed on the same random array. Any difference in the
+ * final array, or a transformed function that fails verification, is a failure: the case is shrunk while it still
+ * fails and written out as a reproducer that can be passed straight to opt. The transform the pass chooses for each
+ * nest is also checked by ScheduleVerifier, so a nest whose run matches although its schedule reverses a dependence
+ * fails as well. Each case runs in a child process, so that
+ * one that crashes, hangs or cannot be compiled fails on its own, and the JIT links the nests against
+ * libpolytope-runtime, so that options which call into it can be fuzzed as well. */
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> Cases("cases", cl::init(10000), cl::desc("Number of nests to generate"));
+static cl::opt<unsigned> Seed("seed", cl::init(1), cl::desc("Seed of the first batch"));
+static cl::opt<unsigned> MaxDepth("max-depth", cl::init(3),
+								  cl::desc("Maximum nest depth; loops outside the innermost two repeat the nest"));
+static cl::opt<unsigned> Size("size", cl::init(64), cl::desc("Rows and columns of the array"));
+static cl::opt<unsigned> BatchSize("batch", cl::init(64), cl::desc("Nests compiled together in one module"));
+static cl::opt<std::string> OutputDir("o", cl::init("./fuzz-failures"), cl::desc("Directory for reproducers"));
+static cl::opt<bool> ShrinkFailures("minimise", cl::init(true),
+									cl::desc("Shrink failing nests before writing reproducers"));
+static cl::opt<unsigned> Threads("j", cl::init(0), cl::desc("Number of worker threads (default: all cores)"));
+static cl::opt<unsigned> IVBits("iv-bits", cl::init(32),
+								cl::desc("Width of the induction variables and indices, 32 as clang emits for int "
+										 "loops or 64 as for long ones"));
+static cl::opt<unsigned> Runs("runs", cl::init(5),
+							  cl::desc("Times each transformed nest runs from the same array; an autotuned nest tries "
+									   "its next variant on each run"));
+static cl::opt<unsigned> Timeout("timeout", cl::init(10), cl::desc("Seconds a case may run before it fails"));
+static cl::opt<bool> VerifySchedules("verify-schedules", cl::init(true),
+									 cl::desc("Check the transform chosen for each nest by interpreting it over the "
+											  "nest's iteration domain"));
+
+/* Entry points of libpolytope-runtime the pass can emit calls to */
+extern "C" {
+void __polytope_nest_enter(void** handle, const char* location, const char* function, const char* kind,
+						   const char* transform);
+void __polytope_nest_exit(void** handle);
+int __polytope_variant_select(void** handle, const char* key, const char* location, int variants);
+void __polytope_variant_exit(void** handle);
+void* __polytope_skew_enter(char* array, const long* skew);
+void* __polytope_rolling_enter(const long* skew);
+void __polytope_skew_rows(char* array, char* buffer, const long* skew, long first, long last, int toBuffer);
+void __polytope_skew_exit(char* array, char* buffer, const long* skew, int copyBack);
+void* __polytope_ooc_alloc(unsigned long size);
+void __polytope_ooc_free(void* address);
+void __polytope_ooc_advance(char* array, const long* ooc, long p);
+}
+
+/* An affine index a*i + b*j + c */
+struct Affine {
+	int i = 0;
+	int j = 0;
+	int c = 0;
+};
+
+using Access = std::pair<Affine, Affine>;
+
+/* A[write] = (A[read0] + A[read1] + ...) % 17 over lower <= i, j < upper, inside depth - 2 outer loops of 2 iterations */
+struct Case {
+	unsigned depth = 2;
+	int lower = 3;
+	int upper = 0;
+	Access write;
+	std::vector<Access> reads;
+};
+
+enum class Outcome {
+	Unchanged,
+	Transformed,
+	Mismatch,
+	Invalid,
+	/* The transformed nest could not be compiled or linked, or the case crashed or timed out */
+	Error,
+	/* The run matched, but ScheduleVerifier found a dependence the chosen transform reverses */
+	Illegal
+};
+
+static const char* OutcomeName(Outcome outcome) {
+	switch (outcome) {
+		case Outcome::Mismatch:
+			return "mismatch";
+		case Outcome::Invalid:
+			return "invalid IR";
+		case Outcome::Error:
+			return "error";
+		case Outcome::Illegal:
+			return "illegal schedule";
+		default:
+			return "ok";
+	}
+}
+
+/* Coefficients and offsets follow RandomLinGenerator: indices stay inside the array for 3 <= i, j < Size / 4 - 1 */
+static Affine RandomAffine(std::mt19937& rng) {
+	std::uniform_int_distribution<int> coefficient(0, 2);
+	Affine res{coefficient(rng), coefficient(rng), 0};
+	res.c = res.i == 0 && res.j == 0 ? coefficient(rng) : std::uniform_int_distribution<int>(-2, 2)(rng);
+	return res;
+}
+
+static Case RandomCase(std::mt19937& rng) {
+	Case res;
+	res.depth = std::uniform_int_distribution<unsigned>(2, std::max(2u, MaxDepth.getValue()))(rng);
+	res.upper = std::uniform_int_distribution<int>(res.lower + 2, (int) Size / 4 - 1)(rng);
+	res.write = {RandomAffine(rng), RandomAffine(rng)};
+	auto reads = std::uniform_int_distribution<int>(1, 4)(rng);
+	for (int r = 0; r < reads; r++) {
+		res.reads.push_back({RandomAffine(rng), RandomAffine(rng)});
+	}
+	return res;
+}
+
+static std::string AffineToString(const Affine& a) {
+	return std::to_string(a.i) + "*i + " + std::to_string(a.j) + "*j + " + std::to_string(a.c);
+}
+
+static std::string AccessToString(const Access& access) {
+	return "A[" + AffineToString(access.first) + "][" + AffineToString(access.second) + "]";
+}
+
+static std::string CaseToString(const Case& c) {
+	std::string res = "depth " + std::to_string(c.depth) + ", " + std::to_string(c.lower) + " <= i, j < " +
+					  std::to_string(c.upper) + ": " + AccessToString(c.write) + " = (";
+	for (size_t r = 0; r < c.reads.size(); r++) {
+		res += (r ? " + " : "") + AccessToString(c.reads[r]);
+	}
+	return res + ") % 17";
+}
+
+/* Builds the loop structure clang produces after the OptStrategy pipeline (see output/test_opt.ll): rotated loops whose
+ * latch compares the induction variable, i32 unless -iv-bits says otherwise, before the increment against the last
+ * value, and indices sign-extended to i64 into a [Size x i32] array */
+class NestBuilder {
+public:
+	NestBuilder(Module& M) : M(M), ctx(M.getContext()), builder(ctx) {}
+
+	Function* Build(const Case& c, StringRef name) {
+		auto* Int32Ty = Type::getInt32Ty(ctx);
+		IVTy = Type::getIntNTy(ctx, IVBits);
+		rowTy = ArrayType::get(Int32Ty, Size);
+		auto* F = Function::Create(FunctionType::get(Type::getVoidTy(ctx), {rowTy->getPointerTo()}, false),
+								   GlobalValue::ExternalLinkage, name, M);
+		array = F->getArg(0);
+		array->setName("A");
+
+		auto* entry = BasicBlock::Create(ctx, "entry", F);
+		auto* exit = BasicBlock::Create(ctx, "exit");
+		ReturnInst::Create(ctx, exit);
+
+		/* Outer repetition loops, each with its own header and latch around the next level */
+		auto* preheader = entry;
+		std::vector<std::pair<PHINode*, BasicBlock*>> outer;
+		for (unsigned d = 2; d < c.depth; d++) {
+			auto* header = BasicBlock::Create(ctx, "t" + std::to_string(d) + ".header", F);
+			BranchInst::Create(header, preheader);
+			builder.SetInsertPoint(header);
+			auto* t = builder.CreatePHI(IVTy, 2, "t" + std::to_string(d));
+			t->addIncoming(IVConstant(0), preheader);
+			outer.push_back({t, header});
+			preheader = header;
+		}
+
+		auto* iHeader = BasicBlock::Create(ctx, "for.body", F);
+		auto* jBody = BasicBlock::Create(ctx, "for.body3", F);
+		auto* iLatch = BasicBlock::Create(ctx, "for.inc", F);
+		BranchInst::Create(iHeader, preheader);
+
+		builder.SetInsertPoint(iHeader);
+		auto* i = builder.CreatePHI(IVTy, 2, "i");
+		i->addIncoming(IVConstant(c.lower), preheader);
+		builder.CreateBr(jBody);
+
+		builder.SetInsertPoint(jBody);
+		auto* j = builder.CreatePHI(IVTy, 2, "j");
+		j->addIncoming(IVConstant(c.lower), iHeader);
+		Value* sum = nullptr;
+		for (auto& read: c.reads) {
+			auto* value = builder.CreateLoad(Int32Ty, Address(read, i, j), "read");
+			sum = sum ? builder.CreateAdd(sum, value, "sum", false, true) : value;
+		}
+		builder.CreateStore(builder.CreateSRem(sum, builder.getInt32(17), "mod"), Address(c.write, i, j));
+		auto* jInc = builder.CreateAdd(j, IVConstant(1), "j.inc", true, true);
+		j->addIncoming(jInc, jBody);
+		builder.CreateCondBr(builder.CreateICmpULT(j, IVConstant(c.upper - 1)), jBody, iLatch);
+
+		builder.SetInsertPoint(iLatch);
+		auto* iInc = builder.CreateAdd(i, IVConstant(1), "i.inc", true, true);
+		i->addIncoming(iInc, iLatch);
+		auto* next = outer.empty() ? exit : BasicBlock::Create(ctx, "t.latch", F);
+		builder.CreateCondBr(builder.CreateICmpULT(i, IVConstant(c.upper - 1)), iHeader, next);
+
+		for (auto level = outer.rbegin(); level != outer.rend(); level++) {
+			auto* latch = next;
+			builder.SetInsertPoint(latch);
+			auto* tInc = builder.CreateAdd(level->first, IVConstant(1), "t.inc", true, true);
+			level->first->addIncoming(tInc, latch);
+			next = level + 1 == outer.rend() ? exit : BasicBlock::Create(ctx, "t.latch", F);
+			builder.CreateCondBr(builder.CreateICmpULT(level->first, IVConstant(1)), level->second, next);
+		}
+		exit->insertInto(F);
+		return F;
+	}
+
+private:
+	Module& M;
+	LLVMContext& ctx;
+	IRBuilder<> builder;
+	Type* rowTy = nullptr;
+	Type* IVTy = nullptr;
+	Value* array = nullptr;
+
+	Constant* IVConstant(long n) {
+		return ConstantInt::get(IVTy, n, true);
+	}
+
+	Value* Index(const Affine& a, Value* i, Value* j) {
+		Value* res = nullptr;
+		for (auto [coefficient, IV]: {std::pair<int, Value*>{a.i, i}, {a.j, j}}) {
+			if (coefficient == 0) {
+				continue;
+			}
+			Value* term = coefficient == 1 ? IV : builder.CreateMul(IV, IVConstant(coefficient), "", false, true);
+			res = res ? builder.CreateAdd(res, term, "", false, true) : term;
+		}
+		if (!res) {
+			return IVConstant(a.c);
+		}
+		return a.c ? builder.CreateAdd(res, IVConstant(a.c), "", false, true) : res;
+	}
+
+	Value* Address(const Access& access, Value* i, Value* j) {
+		auto* Int64Ty = builder.getInt64Ty();
+		auto* row = builder.CreateSExt(Index(access.first, i, j), Int64Ty);
+		auto* col = builder.CreateSExt(Index(access.second, i, j), Int64Ty);
+		return builder.CreateInBoundsGEP(rowTy, array, {row, col});
+	}
+};
+
+static std::string CaseName(size_t index) {
+	return "nest_" + std::to_string(index);
+}
+
+static std::unique_ptr<Module> BuildModule(LLVMContext& ctx, const std::vector<Case>& cases) {
+	auto M = std::make_unique<Module>("polytope-fuzz", ctx);
+	M->setTargetTriple(sys::getDefaultTargetTriple());
+	NestBuilder nestBuilder(*M);
+	for (size_t c = 0; c < cases.size(); c++) {
+		nestBuilder.Build(cases[c], CaseName(c));
+	}
+	return M;
+}
+
+static void RunPolytope(Module& M) {
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+	PassBuilder PB;
+	getPolyLoopPluginInfo().RegisterPassBuilderCallbacks(PB);
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+	ModulePassManager MPM;
+	cantFail(PB.parsePassPipeline(MPM, "function(loop(polytope))"));
+	MPM.run(M, MAM);
+}
+
+/* Analyses the nest of a case as polytope-analyze does and checks the transform the pass chooses for it. Returns a
+ * description of the first dependence it reverses, or an empty string when there is none or nothing was chosen. */
+static std::string CheckSchedule(Function& F) {
+	auto& M = *F.getParent();
+	DominatorTree DT(F);
+	LoopInfo LI(DT);
+	TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+	TargetLibraryInfo TLI(TLII, &F);
+	AssumptionCache AC(F);
+	/* In the canonical form the loop pass manager guarantees, as the pass sees them */
+	for (auto* L: LI) {
+		simplifyLoop(L, &DT, &LI, nullptr, &AC, nullptr, false);
+		formLCSSARecursively(*L, DT, &LI, nullptr);
+	}
+	ScalarEvolution SE(F, TLI, AC, DT, LI);
+	BasicAAResult BAA(M.getDataLayout(), F, TLI, AC, &DT);
+	AAResults AA(TLI);
+	AA.addAAResult(BAA);
+	TargetTransformInfo TTI(M.getDataLayout());
+	PostDominatorTree PDT(F);
+	BranchProbabilityInfo BPI(F, LI, &TLI, &DT, &PDT);
+	BlockFrequencyInfo BFI(F, BPI, LI);
+	LoopStandardAnalysisResults AR{AA, AC, DT, LI, SE, TLI, TTI, &BFI, &BPI, nullptr};
+
+	PolytopePass pass;
+	for (auto* L: LI.getLoopsInPreorder()) {
+		/* Only the i, j nest; the repetition loops around it are never transformed */
+		if (L->getSubLoops().size() != 1 || !L->getSubLoops().front()->getSubLoops().empty()) {
+			continue;
+		}
+		auto report = pass.AnalyzeNest(*L, AR);
+		if (!report.transform || !report.bounds) {
+			return "";
+		}
+		ScheduleVerifier verifier(*report.assignment, *report.bounds);
+		auto violation = verifier.Verify(*report.transform, report.tiles);
+		if (!violation) {
+			return "";
+		}
+		return "transform " + PolytopePass::MatrixToString(*report.transform) + " reverses the " + violation->kind +
+			   " dependence from " + PolytopePass::MatrixToString({violation->source}) + " to " +
+			   PolytopePass::MatrixToString({violation->sink});
+	}
+	return "";
+}
+
+/* The generated code always calls smin/smax to clamp the new bounds, so their presence marks a transformed nest */
+static bool IsTransformed(const Function& F) {
+	for (auto& I: instructions(F)) {
+		if (auto* call = dyn_cast<CallInst>(&I)) {
+			if (call->getCalledFunction() && call->getCalledFunction()->isIntrinsic()) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Runs every case of the batch before and after the pass on the same random array, and returns the outcome of each
+ * with the error message of those that failed with Outcome::Error */
+static std::pair<std::vector<Outcome>, std::vector<std::string>> RunBatch(const std::vector<Case>& cases,
+																		  unsigned seed) {
+	auto ctx = std::make_unique<LLVMContext>();
+	auto original = BuildModule(*ctx, cases);
+	auto transformed = CloneModule(*original);
+	RunPolytope(*transformed);
+
+	std::vector<Outcome> res(cases.size(), Outcome::Unchanged);
+	for (size_t c = 0; c < cases.size(); c++) {
+		auto* F = transformed->getFunction(CaseName(c));
+		if (verifyFunction(*F)) {
+			res[c] = Outcome::Invalid;
+		} else if (IsTransformed(*F)) {
+			res[c] = Outcome::Transformed;
+		}
+	}
+
+	/* Checked on a copy, as the analysis first puts the nests into canonical form */
+	std::vector<std::string> violations(cases.size());
+	if (VerifySchedules) {
+		auto analysed = CloneModule(*original);
+		for (size_t c = 0; c < cases.size(); c++) {
+			if (res[c] == Outcome::Transformed) {
+				violations[c] = CheckSchedule(*analysed->getFunction(CaseName(c)));
+			}
+		}
+	}
+
+	/* Only transformed nests need to run, and JIT compile time dominates, so drop the rest before compiling */
+	for (size_t c = 0; c < cases.size(); c++) {
+		if (res[c] != Outcome::Transformed) {
+			original->getFunction(CaseName(c))->eraseFromParent();
+			transformed->getFunction(CaseName(c))->eraseFromParent();
+		}
+	}
+	std::vector<std::string> errors(cases.size());
+	auto fail = [&](size_t c, const Twine& message) {
+		res[c] = Outcome::Error;
+		errors[c] = message.str();
+	};
+	auto failAll = [&](Error error) {
+		auto message = toString(std::move(error));
+		for (size_t c = 0; c < cases.size(); c++) {
+			if (res[c] == Outcome::Transformed) {
+				fail(c, message);
+			}
+		}
+		return std::make_pair(res, errors);
+	};
+
+	auto machine = JITTargetMachineBuilder::detectHost();
+	if (!machine) {
+		return failAll(machine.takeError());
+	}
+	machine->setCodeGenOptLevel(CodeGenOpt::None);
+	auto jit = LLJITBuilder().setJITTargetMachineBuilder(std::move(*machine)).create();
+	if (!jit) {
+		return failAll(jit.takeError());
+	}
+	auto originalLib = (*jit)->createJITDylib("original");
+	if (!originalLib) {
+		return failAll(originalLib.takeError());
+	}
+	auto transformedLib = (*jit)->createJITDylib("transformed");
+	if (!transformedLib) {
+		return failAll(transformedLib.takeError());
+	}
+	auto runtimeLib = (*jit)->createJITDylib("runtime");
+	if (!runtimeLib) {
+		return failAll(runtimeLib.takeError());
+	}
+	SymbolMap runtime;
+	auto define = [&](StringRef name, auto* function) {
+		runtime[(*jit)->mangleAndIntern(name)] = JITEvaluatedSymbol(pointerToJITTargetAddress(function),
+																	 JITSymbolFlags::Exported);
+	};
+	define("__polytope_nest_enter", &__polytope_nest_enter);
+	define("__polytope_nest_exit", &__polytope_nest_exit);
+	define("__polytope_variant_select", &__polytope_variant_select);
+	define("__polytope_variant_exit", &__polytope_variant_exit);
+	define("__polytope_skew_enter", &__polytope_skew_enter);
+	define("__polytope_rolling_enter", &__polytope_rolling_enter);
+	define("__polytope_skew_rows", &__polytope_skew_rows);
+	define("__polytope_skew_exit", &__polytope_skew_exit);
+	define("__polytope_ooc_alloc", &__polytope_ooc_alloc);
+	define("__polytope_ooc_free", &__polytope_ooc_free);
+	define("__polytope_ooc_advance", &__polytope_ooc_advance);
+	if (auto error = runtimeLib->define(absoluteSymbols(std::move(runtime)))) {
+		return failAll(std::move(error));
+	}
+	originalLib->addToLinkOrder(*runtimeLib);
+	transformedLib->addToLinkOrder(*runtimeLib);
+	ThreadSafeContext TSCtx(std::move(ctx));
+	if (auto error = (*jit)->addIRModule(*originalLib, ThreadSafeModule(std::move(original), TSCtx))) {
+		return failAll(std::move(error));
+	}
+	if (auto error = (*jit)->addIRModule(*transformedLib, ThreadSafeModule(std::move(transformed), TSCtx))) {
+		return failAll(std::move(error));
+	}
+
+	std::mt19937 rng(seed);
+	std::vector<int> input(Size * Size);
+	std::vector<int> expected(input.size());
+	std::vector<int> actual(input.size());
+	for (size_t c = 0; c < cases.size(); c++) {
+		if (res[c] != Outcome::Transformed) {
+			continue;
+		}
+		for (auto& x: input) {
+			x = (int) (rng() % 17);
+		}
+		/* Compiles the nest on the first lookup, so a failure to link it lands here */
+		auto originalSymbol = (*jit)->lookup(*originalLib, CaseName(c));
+		if (!originalSymbol) {
+			fail(c, toString(originalSymbol.takeError()));
+			continue;
+		}
+		auto transformedSymbol = (*jit)->lookup(*transformedLib, CaseName(c));
+		if (!transformedSymbol) {
+			fail(c, toString(transformedSymbol.takeError()));
+			continue;
+		}
+
+		/* The child exits with 0 when every run of the transformed nest matches the original and 1 otherwise */
+		using Kernel = void (*)(int*);
+		auto pid = fork();
+		if (pid < 0) {
+			fail(c, "fork failed");
+			continue;
+		}
+		if (pid == 0) {
+			/* A crash only needs to be reported by the parent, without the stack trace of the LLVM handlers */
+			for (auto signal: {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+				std::signal(signal, SIG_DFL);
+			}
+			alarm(Timeout);
+			expected = input;
+			((Kernel) originalSymbol->getAddress())(expected.data());
+			bool same = true;
+			for (unsigned r = 0; r < std::max(1u, Runs.getValue()) && same; r++) {
+				actual = input;
+				((Kernel) transformedSymbol->getAddress())(actual.data());
+				same = expected == actual;
+			}
+			_exit(same ? 0 : 1);
+		}
+		int status;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+		}
+		if (WIFSIGNALED(status)) {
+			auto signal = WTERMSIG(status);
+			fail(c, signal == SIGALRM ? "timed out" : Twine("killed by signal ") + strsignal(signal));
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			res[c] = Outcome::Mismatch;
+			errors[c] = violations[c];
+		} else if (!violations[c].empty()) {
+			res[c] = Outcome::Illegal;
+			errors[c] = violations[c];
+		}
+	}
+	return std::make_pair(res, errors);
+}
+
+static bool Fails(const Case& c, unsigned seed) {
+	auto outcome = RunBatch({c}, seed).first[0];
+	return outcome == Outcome::Mismatch || outcome == Outcome::Invalid || outcome == Outcome::Error ||
+		   outcome == Outcome::Illegal;
+}
+
+/* Candidate simplifications of a case, tried in order by Minimise */
+static std::vector<Case> Simplifications(const Case& c) {
+	std::vector<Case> res;
+	if (c.depth > 2) {
+		auto s = c;
+		s.depth--;
+		res.push_back(s);
+	}
+	if (c.upper > c.lower + 2) {
+		auto s = c;
+		s.upper--;
+		res.push_back(s);
+	}
+	for (size_t r = 0; c.reads.size() > 1 && r < c.reads.size(); r++) {
+		auto s = c;
+		s.reads.erase(s.reads.begin() + r);
+		res.push_back(s);
+	}
+	/* Move each coefficient and offset one step towards zero, keeping the indices inside the array */
+	auto shrink = [&](auto getAffine) {
+		for (int field = 0; field < 3; field++) {
+			auto s = c;
+			auto& a = getAffine(s);
+			int& x = field == 0 ? a.i : field == 1 ? a.j : a.c;
+			if (x == 0) {
+				continue;
+			}
+			x += x > 0 ? -1 : 1;
+			if (a.c < 0 && a.i == 0 && a.j == 0) {
+				continue;
+			}
+			res.push_back(s);
+		}
+	};
+	shrink([](Case& s) -> Affine& { return s.write.first; });
+	shrink([](Case& s) -> Affine& { return s.write.second; });
+	for (size_t r = 0; r < c.reads.size(); r++) {
+		shrink([r](Case& s) -> Affine& { return s.reads[r].first; });
+		shrink([r](Case& s) -> Affine& { return s.reads[r].second; });
+	}
+	return res;
+}
+
+/* Greedy shrinking: apply the first simplification that still fails until none does */
+static Case Minimise(Case c, unsigned seed) {
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		for (auto& candidate: Simplifications(c)) {
+			if (Fails(candidate, seed)) {
+				c = candidate;
+				progress = true;
+				break;
+			}
+		}
+	}
+	return c;
+}
+
+static std::string WriteReproducer(const Case& c, unsigned seed, size_t index) {
+	LLVMContext ctx;
+	auto M = BuildModule(ctx, {c});
+	sys::fs::create_directories(OutputDir);
+	std::string path = OutputDir + "/polytope-fuzz-" + std::to_string(seed) + "-" + std::to_string(index) + ".ll";
+	std::error_code EC;
+	raw_fd_ostream out(path, EC, sys::fs::OF_Text);
+	if (EC) {
+		errs() << "Could not open " << path << ": " << EC.message() << "\n";
+		return "";
+	}
+	out << "; polytope-fuzz reproducer (batch seed " << seed << ")\n";
+	out << "; " << CaseToString(c) << "\n";
+	out << "; run: opt -load-pass-plugin libpolytope-pass.so -passes polytope " << path << "\n";
+	M->print(out, nullptr);
+	return path;
+}
+
+int main(int argc, char** argv) {
+	InitLLVM X(argc, argv);
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	cl::ParseCommandLineOptions(argc, argv, "differential fuzzer for the polytope pass\n");
+	if (Size < 24) {
+		errs() << "-size must be at least 24\n";
+		return 1;
+	}
+
+	unsigned batches = (Cases + BatchSize - 1) / BatchSize;
+	unsigned threadCount = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+	std::atomic<unsigned> next = 0;
+	std::atomic<unsigned> run = 0;
+	std::atomic<unsigned> transformed = 0;
+	std::atomic<unsigned> failures = 0;
+	std::mutex outputLock;
+
+	auto start = std::chrono::steady_clock::now();
+	auto worker = [&]() {
+		unsigned b;
+		while ((b = next++) < batches) {
+			unsigned seed = Seed + b;
+			std::mt19937 rng(seed);
+			std::vector<Case> cases;
+			for (unsigned c = b * BatchSize; c < std::min(Cases.getValue(), (b + 1) * BatchSize); c++) {
+				cases.push_back(RandomCase(rng));
+			}
+			auto [outcomes, errors] = RunBatch(cases, seed);
+			for (size_t c = 0; c < cases.size(); c++) {
+				run++;
+				if (outcomes[c] == Outcome::Unchanged) {
+					continue;
+				}
+				transformed++;
+				if (outcomes[c] == Outcome::Transformed) {
+					continue;
+				}
+				failures++;
+				auto minimal = ShrinkFailures ? Minimise(cases[c], seed) : cases[c];
+				auto path = WriteReproducer(minimal, seed, c);
+				std::lock_guard<std::mutex> guard(outputLock);
+				errs() << OutcomeName(outcomes[c]) << ": " << CaseToString(minimal) << " -> " << path;
+				if (!errors[c].empty()) {
+					errs() << " (" << errors[c] << ")";
+				}
+				errs() << "\n";
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threadCount; t++) {
+		workers.emplace_back(worker);
+	}
+	for (auto& t: workers) {
+		t.join();
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	outs() << run << " nests, " << transformed << " transformed, " << failures << " failures in "
+		   << format("%.2f", seconds) << "s (" << format("%.0f", run / seconds) << " nests/s)\n";
+	return failures ? 1 : 0;
+}
@@ -1,3 +1,6 @@
+#ifndef LLVM_TRANSFORMS_POLYLOOP_INTEGERSOLVER_H
+#define LLVM_TRANSFORMS_POLYLOOP_INTEGERSOLVER_H
+
 #define MAX_INT 2147483647
 
 #include <optional>
@@ -104,12 +107,12 @@ public:
 				i++;
 				continue;
 			}
-			/* Choose smallest absolute element in row to act as pivot */
+			/* Choose smallest absolute element in the columns not yet reduced to act as pivot */
 			int pivot = MAX_INT;
 			int pivot_index = -1;
-			for (int j = 0; j < N; j++) {
+			for (int j = i; j < N; j++) {
 				int el = D[i][j];
-				if (abs(el) < pivot && el != 0) {
+				if (abs(el) < abs(pivot) && el != 0) {
 					pivot_index = j;
 					pivot = el;
 				}
@@ -240,7 +243,7 @@ public:
 		return res;
 	}
 
-	static int Det(std::vector<std::vector<int>>& A) {
+	static int Det(const std::vector<std::vector<int>>& A) {
 		if (A.size() != A[0].size()) {
 			throw std::invalid_argument("Determinant is only defined for square matrices.");
 		}
@@ -271,6 +274,39 @@ public:
 		return res;
 	}
 
+	/* Inverse of the transpose of a unimodular matrix, its cofactors times its determinant: if y = A x, the index
+	 * function f . x is InverseTranspose(A) f . y. Other matrices have no integer inverse, and give nothing. */
+	static std::optional<std::vector<std::vector<int>>> InverseTranspose(const std::vector<std::vector<int>>& A) {
+		auto det = Det(A);
+		if (det != 1 && det != -1) {
+			return {};
+		}
+
+		size_t n = A.size();
+		if (n == 1) {
+			return std::vector<std::vector<int>>{{det}};
+		}
+		std::vector<std::vector<int>> res(n, std::vector<int>(n));
+		for (size_t r = 0; r < n; r++) {
+			for (size_t c = 0; c < n; c++) {
+				std::vector<std::vector<int>> minor;
+				for (size_t i = 0; i < n; i++) {
+					if (i == r) {
+						continue;
+					}
+					minor.emplace_back();
+					for (size_t j = 0; j < n; j++) {
+						if (j != c) {
+							minor.back().push_back(A[i][j]);
+						}
+					}
+				}
+				res[r][c] = ((r + c) % 2 ? -det : det) * Det(minor);
+			}
+		}
+		return res;
+	}
+
 private:
 	/* Test if all but one entry in a row is zero - if not, returns the least element */
 	static std::optional<int> GetRowPivot(const std::vector<std::vector<int>>& A, int index) {
@@ -347,3 +383,4 @@ private:
 	}
 };
 
+#endif // LLVM_TRANSFORMS_POLYLOOP_INTEGERSOLVER_H
@@ -1,6 +1,10 @@
+#ifndef LLVM_TRANSFORMS_POLYLOOP_LOOPDEPENDENCIES_H
+#define LLVM_TRANSFORMS_POLYLOOP_LOOPDEPENDENCIES_H
+
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "modernize-use-nodiscard"
 
+#include <algorithm>
 #include <utility>
 #include <vector>
 #include <set>
@@ -15,15 +19,27 @@ struct EquationSystem {
 			: lhs(std::move(lhs)), rhs(std::move(rhs)) {};
 };
 
+/* Result of a dependence test, with the number of integer systems it solved and how many had a solution, for
+ * compile-time statistics */
+struct DependenceTest {
+	bool carried = false;
+	unsigned solverCalls = 0;
+	unsigned solverSolutions = 0;
+};
+
 /* Stores the affine functions used in an array assignment, ie. the array index written to,
  * and the list of array reads, and determine if it exhibits loop carrier dependencies. */
 class LoopDependencies {
 public:
 	std::vector<std::vector<std::vector<int>>> writes;
 	std::vector<std::vector<std::vector<int>>> reads;
+	/* Index functions of elements updated only by associative and commutative reductions, one row per index. Their
+	 * updates may run in any order, so they are kept out of writes and reads and carry no dependence. */
+	std::vector<std::vector<std::vector<int>>> reductions;
 
 	LoopDependencies(std::vector<std::vector<std::vector<int>>> writes_,
-					 std::vector<std::vector<std::vector<int>>> reads_) {
+					 std::vector<std::vector<std::vector<int>>> reads_,
+					 std::vector<std::vector<std::vector<int>>> reductions_ = {}) : reductions(std::move(reductions_)) {
 		/* Remove duplicates from reads & writes */
 		std::set<std::vector<std::vector<int>>> tmp1(writes_.begin(), writes_.end());
 		writes = std::vector<std::vector<std::vector<int>>>(tmp1.begin(), tmp1.end());
@@ -33,14 +49,36 @@ public:
 	};
 
 	bool HasLoopCarrierDependencies() const {
+		return TestLoopCarrierDependencies().carried;
+	}
+
+	DependenceTest TestLoopCarrierDependencies() const {
+		DependenceTest res;
 		auto equationSystems = ComputeEquations();
 		for (auto& eqs: equationSystems) {
-			auto res = IntegerSolver::SolveSystem(eqs.lhs, eqs.rhs);
-			if (res) {
-				return true;
+			res.solverCalls++;
+			if (IntegerSolver::SolveSystem(eqs.lhs, eqs.rhs)) {
+				res.solverSolutions++;
+				res.carried = true;
+				return res;
+			}
+		}
+		return res;
+	}
+
+	/* Constant offset between the element written and each element read, one vector per write/read pair */
+	std::vector<std::vector<int>> GetDependenceVectors() const {
+		std::vector<std::vector<int>> res;
+		for (auto& write: writes) {
+			for (auto& read: reads) {
+				std::vector<int> vec;
+				for (int i = 0; i < write.size(); i++) {
+					vec.push_back(write[i].back() - read[i].back());
+				}
+				res.push_back(vec);
 			}
 		}
-		return false;
+		return res;
 	}
 
 	bool HasCacheMisses() const {
@@ -109,4 +147,6 @@ private:
 	}
 };
 
-#pragma clang diagnostic pop
\ No newline at end of file
+#pragma clang diagnostic pop
+
+#endif // LLVM_TRANSFORMS_POLYLOOP_LOOPDEPENDENCIES_H
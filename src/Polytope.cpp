@@ -1,20 +1,376 @@
 #include "Polytope.h"
+#include "CacheSimulator.h"
+#include "ScheduleVerifier.h"
+#include "TransformCache.h"
 #include <iostream>
 
+#include <chrono>
+#include <functional>
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "polytope"
+
+STATISTIC(NumNestsSeen, "Number of loop nests considered");
+STATISTIC(NumNotPerfect, "Number of nests rejected as not perfect");
+STATISTIC(NumNonAffine, "Number of nests rejected for non-affine bounds or accesses");
+STATISTIC(NumNoDependencies, "Number of nests without loop-carried dependencies");
+STATISTIC(NumNoTransform, "Number of nests with no legal transform within the search budget");
+STATISTIC(NumIllegalSchedule, "Number of transforms rejected by the schedule self-check");
+STATISTIC(NumTransformed, "Number of nests transformed");
+STATISTIC(NumFoundDepth0, "Number of transforms found with no generator applications");
+STATISTIC(NumFoundDepth1, "Number of transforms found after 1 generator application");
+STATISTIC(NumFoundDepth2, "Number of transforms found after 2 generator applications");
+STATISTIC(NumFoundDepth3, "Number of transforms found after 3 generator applications");
+STATISTIC(NumFoundDepth4, "Number of transforms found after 4 generator applications");
+STATISTIC(NumFoundDepthMore, "Number of transforms found after 5 or more generator applications");
+STATISTIC(NumSearchNodes, "Number of candidate transforms tested by the search");
+STATISTIC(NumSolverCalls, "Number of integer systems solved for dependency testing");
+STATISTIC(NumSolverSolutions, "Number of integer systems with a solution (loop-carried dependency)");
+STATISTIC(NumReplayedTransforms, "Number of transforms of nests with non-uniform accesses checked by replaying them");
+STATISTIC(NumInterchangeTier, "Number of nests decided by the interchange pattern match");
+STATISTIC(NumDependenceTier, "Number of nests decided by the initial dependency test");
+STATISTIC(NumSearchTier, "Number of nests decided by the generator search");
+STATISTIC(NumReductionTier, "Number of nests whose only loop-carried dependencies are reductions");
+STATISTIC(NumReductions, "Number of associative reductions exempted from the dependence test");
+STATISTIC(NumPrivatisedReductions, "Number of reductions accumulated in a register across the inner loop");
+STATISTIC(NumDistributed, "Number of statements distributed out of imperfect nests");
+STATISTIC(NumSunk, "Number of values recomputed in the inner loop of imperfect nests");
+STATISTIC(NumFused, "Number of nests fused into the adjacent nest after them");
+STATISTIC(NumShiftedFusions, "Number of fused nests whose first nest runs rows ahead of the second");
+
+STATISTIC(NumRankedNests, "Number of nests whose transform was chosen by simulated cache misses");
+STATISTIC(NumRankChanged, "Number of ranked nests where the cheapest transform was not the first one found");
+
+STATISTIC(NumColdNests, "Number of nests left untransformed because the profile marks them cold");
+STATISTIC(NumShortTripCount, "Number of nests left untransformed because of short profiled trip counts");
+STATISTIC(NumHotNests, "Number of nests searched with the larger budget for hot nests");
+
+STATISTIC(NumSimdLoops, "Number of inner loops emitted as explicit vector loops");
+STATISTIC(NumPrefetches, "Number of software prefetches emitted for strided accesses");
+STATISTIC(NumUnrollJammed, "Number of transformed nests whose outer loop was unrolled and jammed");
+STATISTIC(NumForwardedLoads, "Number of loads of jammed copies replaced by a value an earlier copy accessed");
+STATISTIC(NumScalarReplaced, "Number of loads replaced by a value kept in a register from an earlier inner iteration");
+STATISTIC(NumTiled, "Number of transformed nests run tile by tile");
+STATISTIC(NumTileSkewed, "Number of tiled nests whose inner loop was skewed by the outer one to make the tiles legal");
+
+STATISTIC(NumSkewedLayouts, "Number of nests run on a skewed copy of their array");
+STATISTIC(NumCopyBackElided, "Number of skewed copies not copied back as the array is dead after the nest");
+STATISTIC(NumSkewNotProfitable, "Number of skewed layouts rejected by the estimated cost");
+STATISTIC(NumOutOfCore, "Number of nests whose array is backed by a file when too large for memory");
+STATISTIC(NumContracted, "Number of arrays replaced by a rolling buffer of the rows a nest still reads");
+
+STATISTIC(NumAutotuned, "Number of nests emitted as several variants selected at runtime");
+STATISTIC(NumVariants, "Number of transformed variants emitted for runtime selection");
+
+STATISTIC(NumCacheHits, "Number of nests whose decision was read from the transform cache");
+STATISTIC(NumCacheMisses, "Number of nests searched and added to the transform cache");
+
+static Statistic* FoundAtDepth[] = {&NumFoundDepth0, &NumFoundDepth1, &NumFoundDepth2,
+									&NumFoundDepth3, &NumFoundDepth4, &NumFoundDepthMore};
+
+static cl::opt<unsigned> SearchDepth("polytope-search-depth", cl::init(5), cl::Hidden,
+									 cl::desc("Maximum number of generator applications tried when searching for a "
+											  "legal transform"));
+
+static cl::opt<unsigned> HotSearchDepth("polytope-hot-search-depth", cl::init(7), cl::Hidden,
+										cl::desc("Search depth used instead of -polytope-search-depth for nests the "
+												 "profile marks hot"));
+
+static cl::opt<bool> SkipCold("polytope-skip-cold", cl::init(true),
+							  cl::desc("Leave nests the profile marks cold untransformed"));
+
+static cl::opt<unsigned> MinTripCount("polytope-min-trip-count", cl::init(4),
+									  cl::desc("Leave nests whose profiled inner trip count is below this "
+											   "untransformed, as skewing does not pay off on short loops"));
+
+static cl::opt<std::string> CacheDir("polytope-cache-dir", cl::init(""),
+									 cl::desc("Directory in which to cache transform decisions between compilations"));
+
+static cl::opt<unsigned> RankCandidates("polytope-rank-candidates", cl::init(0),
+										 cl::desc("Collect up to this many legal transforms and apply the one with the "
+												  "fewest simulated cache misses (0: apply the first found)"));
+
+static cl::opt<std::string> CacheHierarchy("polytope-cache-hierarchy", cl::init("32K:64:8,1M:64:16,32M:64:16"),
+										   cl::desc("Cache levels simulated when ranking transforms, as "
+													"size:line:ways,..."));
+
+static cl::opt<unsigned> SampleExtent("polytope-sample-extent", cl::init(64),
+									  cl::desc("Iterations per loop simulated when ranking transforms"));
+
+#ifndef NDEBUG
+static cl::opt<bool> VerifySchedule("polytope-verify-schedule", cl::init(false), cl::Hidden,
+									cl::desc("Check each transform by interpreting the nest over its constant "
+											 "iteration domain, and reject transforms that reverse a dependence"));
+#else
+static constexpr bool VerifySchedule = false;
+#endif
+
+static cl::opt<bool> Instrument("polytope-instrument", cl::init(false),
+								cl::desc("Wrap each transformed nest in calls to the polytope profiling runtime"));
+
+static cl::opt<bool> InstrumentControl("polytope-instrument-control", cl::init(false),
+									   cl::desc("Instrument the nests that would be transformed but leave them "
+												"untransformed, to profile a control build"));
+
+static cl::opt<bool> Autotune("polytope-autotune", cl::init(false),
+							  cl::desc("Emit the original nest and several legal transforms of it, and let the runtime "
+									   "time them and keep the fastest"));
+
+static cl::opt<unsigned> AutotuneVariants("polytope-autotune-variants", cl::init(4),
+										  cl::desc("Maximum number of transformed variants emitted per nest with "
+												   "-polytope-autotune"));
+
+static cl::opt<bool> Simd("polytope-simd", cl::init(false),
+						  cl::desc("Emit the parallel inner loop as an explicit vector loop with gathers and scatters, "
+								   "followed by a scalar epilogue"));
+
+static cl::opt<unsigned> SimdWidth("polytope-simd-width", cl::init(0),
+								   cl::desc("Lanes of the explicit vector loop (0: fill a vector register of the "
+											"target, if it supports gathers)"));
+
+static cl::opt<bool> SkewLayout("polytope-skew-layout", cl::init(false),
+								cl::desc("Run transformed nests on a copy of their array laid out along the transformed "
+										 "loops, when the simulated cache misses saved pay for the copies (needs "
+										 "polytope-runtime)"));
+
+static cl::opt<bool> Contract("polytope-contract", cl::init(false),
+							  cl::desc("Replace the array of a transformed nest by a rolling buffer of the rows of its "
+									   "skewed layout the nest still reads, when the rest of the array is not read "
+									   "after the nest (needs polytope-runtime)"));
+
+static cl::opt<bool> OutOfCore("polytope-out-of-core", cl::init(false),
+							   cl::desc("Back the arrays of transformed nests by memory-mapped files when they do not "
+										"fit in memory, prefetching and releasing pages band by band of the outer "
+										"loop (needs polytope-runtime)"));
+
+static cl::opt<unsigned> OutOfCoreBand("polytope-out-of-core-band", cl::init(1024),
+									   cl::desc("Outer iterations per band of a nest run out of core"));
+
+static cl::opt<unsigned> PrefetchDistance("polytope-prefetch-distance", cl::init(0),
+										  cl::desc("Inner iterations ahead to prefetch accesses that do not move with "
+												   "unit stride in the transformed nest (0: no prefetches)"));
+
+static cl::opt<unsigned> UnrollJam("polytope-unroll-jam", cl::init(0),
+								   cl::desc("Unroll the outer loop of transformed nests by up to this factor and jam the "
+											"copies into one inner loop, when the dependences allow it (0: no "
+											"unrolling)"));
+
+static cl::opt<unsigned> ScalarReplace("polytope-scalar-replace", cl::init(0),
+									   cl::desc("Keep array elements a transformed inner loop stored or loaded up to this "
+												"many iterations earlier in registers instead of reloading them (0: "
+												"none)"));
+
+static cl::opt<bool> Reductions("polytope-reductions", cl::init(false),
+								cl::desc("Recognise associative integer reductions into elements no other access "
+										 "touches, exempt them from the dependence test and accumulate them in "
+										 "registers, one per vector lane"));
+
+static cl::opt<bool> Distribute("polytope-distribute", cl::init(false),
+								cl::desc("Make imperfect nests perfect by moving the statements around the inner loop "
+										 "into loops of their own and recomputing the values it uses in it, when "
+										 "the dependences allow"));
+
+static cl::opt<bool> Fuse("polytope-fuse", cl::init(false),
+						  cl::desc("Fuse a nest into the adjacent nest after it when their domains have the same "
+								   "extents and the dependences allow, running it some rows ahead if needed"));
+
+static cl::list<unsigned> Tile("polytope-tile", cl::CommaSeparated,
+							   cl::desc("Run transformed nests in tiles of this many outer by inner iterations, eg. "
+										"16,256, skewing the inner loop by the outer one where the dependences need "
+										"it; one size gives square tiles (default: no tiling)"));
+
+/* Largest iteration domain over which the search replays a nest whose accesses are not uniform, to check the order of
+ * a transform; larger nests of that kind are not transformed */
+static const size_t MaxReplayedIterations = 1 << 16;
+
+/* Number of legal transforms the search collects before stopping */
+static unsigned CandidateLimit() {
+	return std::max((unsigned) RankCandidates, Autotune ? (unsigned) AutotuneVariants : 0u);
+}
+
+/* Distances d between the iterations x and x + d of every pair of a write W and another access A that touch one
+ * element, in the original iteration space. Distances are only known for uniform accesses, all with the same
+ * coefficients M, where M d = cW - cA; returns nothing for other nests. */
+static std::optional<std::vector<std::pair<long, long>>> UniformDependenceDistances(const LoopDependencies& assignment) {
+	if (assignment.writes.empty()) {
+		return {};
+	}
+	auto accesses = assignment.reads;
+	accesses.insert(accesses.end(), assignment.writes.begin(), assignment.writes.end());
+	auto& M = assignment.writes.front();
+	for (auto& access: accesses) {
+		if (access.size() != M.size()) {
+			return {};
+		}
+		for (size_t d = 0; d < M.size(); d++) {
+			if (M[d].size() != 3 || access[d].size() != 3 || access[d][0] != M[d][0] || access[d][1] != M[d][1]) {
+				return {};
+			}
+		}
+	}
+	/* Two dimensions that determine d */
+	std::optional<std::pair<size_t, size_t>> rows;
+	for (size_t r1 = 0; r1 < M.size() && !rows; r1++) {
+		for (size_t r2 = r1 + 1; r2 < M.size() && !rows; r2++) {
+			if ((long) M[r1][0] * M[r2][1] - (long) M[r1][1] * M[r2][0]) {
+				rows = {r1, r2};
+			}
+		}
+	}
+	if (!rows) {
+		return {};
+	}
+	auto [r1, r2] = *rows;
+	long det = (long) M[r1][0] * M[r2][1] - (long) M[r1][1] * M[r2][0];
+	std::vector<std::pair<long, long>> res;
+	for (auto& write: assignment.writes) {
+		for (auto& access: accesses) {
+			if (access == write) {
+				continue;
+			}
+			std::vector<long> c;
+			for (size_t d = 0; d < M.size(); d++) {
+				c.push_back((long) write[d].back() - access[d].back());
+			}
+			/* Cramer's rule on the two rows, checked against the others */
+			long n0 = c[r1] * M[r2][1] - M[r1][1] * c[r2];
+			long n1 = M[r1][0] * c[r2] - c[r1] * M[r2][0];
+			if (n0 % det || n1 % det) {
+				continue;
+			}
+			long x[2] = {n0 / det, n1 / det};
+			bool solution = true;
+			for (size_t d = 0; d < M.size(); d++) {
+				solution &= M[d][0] * x[0] + M[d][1] * x[1] == c[d];
+			}
+			if (solution) {
+				res.emplace_back(x[0], x[1]);
+			}
+		}
+	}
+	return res;
+}
+
+/* Whether a write touches the same element at every iteration of the inner loop GenerateTransformedNest emits for T,
+ * which moves the induction variables along e = (-T01, T00) at a fixed p. The dependence equations only pair different
+ * accesses, so they miss this dependence of a write on itself, or on a read with the same index functions. */
+static bool InnerLoopRepeatsElement(const LoopDependencies& assignment, const std::vector<std::vector<int>>& T) {
+	for (auto& write: assignment.writes) {
+		bool repeats = true;
+		for (auto& row: write) {
+			repeats = repeats && (long) row[0] * -T[0][1] + (long) row[1] * T[0][0] == 0;
+		}
+		if (repeats) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* A distance d transformed by T, (dp, dq) = T d, oriented from the iteration the transformed nest runs first */
+static std::pair<long, long> TransformedDistance(const std::vector<std::vector<int>>& T, std::pair<long, long> d) {
+	long dp = T[0][0] * d.first + T[0][1] * d.second;
+	long dq = T[1][0] * d.first + T[1][1] * d.second;
+	if (dp < 0 || (dp == 0 && dq < 0)) {
+		return {-dp, -dq};
+	}
+	return {dp, dq};
+}
+
+/* Largest factor up to factor by which the outer loop GenerateTransformedNest emits for T can be unrolled and its
+ * copies jammed, ie. run side by side at each q. The copies at p, p + 1, ... then run in order at each q, so a
+ * dependence whose source is at (p, q) and sink at (p + dp, q + dq) is reversed when 0 < dp < factor and dq < 0.
+ * Only unimodular T are handled, whose points are all integer, so the outer loop steps by one. */
+static unsigned LegalUnrollJamFactor(const LoopDependencies& assignment, const std::vector<std::vector<int>>& T,
+									 unsigned factor) {
+	if (T.size() != 2 || std::abs(IntegerSolver::Det(T)) != 1) {
+		return 0;
+	}
+	auto distances = UniformDependenceDistances(assignment);
+	if (!distances) {
+		return 0;
+	}
+	for (auto distance: *distances) {
+		auto [dp, dq] = TransformedDistance(T, distance);
+		if (dp > 0 && dq < 0) {
+			factor = std::min(factor, (unsigned) std::min<long>(dp, UINT_MAX));
+		}
+	}
+	return factor;
+}
+
+/* Skew k >= 0 of the inner transformed coordinate by the outer one, q' = q + k p, after which every dependence of
+ * the nest GenerateTransformedNest emits for T points into the same or a later tile in both coordinates, so that
+ * rectangular tiles of (p, q') can run one after another in lexicographic order. A
+ * legal T orders every dependence so that dp > 0 wherever dq < 0, and the smallest k is the largest -dq / dp rounded
+ * up. The skew keeps the outer coordinate, and so which dependences the inner loop carries. Only unimodular T with
+ * uniform accesses are handled. */
+static std::optional<int> TileSkew(const LoopDependencies& assignment, const std::vector<std::vector<int>>& T) {
+	if (T.size() != 2 || std::abs(IntegerSolver::Det(T)) != 1) {
+		return {};
+	}
+	auto distances = UniformDependenceDistances(assignment);
+	if (!distances) {
+		return {};
+	}
+	long skew = 0;
+	for (auto distance: *distances) {
+		auto [dp, dq] = TransformedDistance(T, distance);
+		if (dq < 0) {
+			skew = std::max(skew, (-dq + dp - 1) / dp);
+		}
+	}
+	/* Larger skews leave most tiles empty */
+	if (skew > 64) {
+		return {};
+	}
+	return (int) skew;
+}
+
+/* Runs f under a -ftime-trace scope, adding its wall-clock time in microseconds to elapsed */
+template<typename F>
+static auto TimePhase(StringRef name, long& elapsed, F f) {
+	TimeTraceScope scope(name);
+	auto start = std::chrono::steady_clock::now();
+	auto res = f();
+	elapsed += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return res;
+}
+
 bool PolytopePass::IsPerfectNest(Loop& L, LoopInfo& LI, ScalarEvolution& SE) {
 	PHINode* IV = L.getInductionVariable(SE);
 	if (!IV) {
@@ -34,141 +390,953 @@ bool PolytopePass::IsPerfectNest(Loop& L, LoopInfo& LI, ScalarEvolution& SE) {
 		// Second condition to test for any loop preheaders
 		if (L.getHeader()->getNextNode() == IL->getHeader() ||
 			L.getHeader()->getNextNode() == IL->getLoopPreheader()) {
+			/* Only the induction variable may be computed around the inner loop, which codegen replaces */
+			for (auto* BB: L.blocks()) {
+				if (IL->contains(BB)) {
+					continue;
+				}
+				for (auto& I: *BB) {
+					if (I.mayReadOrWriteMemory() || I.mayHaveSideEffects()) {
+						LLVM_DEBUG(dbgs() << "Statement " << I << " around the inner loop...\n\n");
+						return false;
+					}
+					if (!isa<PHINode>(I) && any_of(I.users(), [&](User* U) { return IL->contains(cast<Instruction>(U)); })) {
+						LLVM_DEBUG(dbgs() << "Inner loop uses " << I << " computed around it...\n\n");
+						return false;
+					}
+				}
+			}
+			/* Codegen replaces the iterations of the inner loop, so nothing after it may use a value computed in it */
+			for (auto* BB: IL->blocks()) {
+				for (auto& I: *BB) {
+					if (any_of(I.users(), [&](User* U) { return !IL->contains(cast<Instruction>(U)); })) {
+						LLVM_DEBUG(dbgs() << "Value " << I << " of the inner loop is used after it...\n\n");
+						return false;
+					}
+				}
+			}
 			return true;
 		}
-		dbgs() << "Preceded by other statements...\n\n";
+		LLVM_DEBUG(dbgs() << "Preceded by other statements...\n\n");
 		return false;
 	}
-	dbgs() << "Succeeded by other statements...\n\n";
+	LLVM_DEBUG(dbgs() << "Succeeded by other statements...\n\n");
 	return false;
 }
 
-/* Recursively test if a value is an affine function of induction variables */
-std::optional<std::vector<int>> PolytopePass::GetValueIfAffine(Value* V) {
-	if (isa<Constant>(V)) {
-		std::vector<int> res(IVList.size() + 1, 0);
-		auto k = dyn_cast<ConstantInt>(V);
-		res[IVList.size()] = k->getSExtValue();
+/* Blocks of the outer loop before the inner loop and after it, which have to be chains of unconditional branches from
+ * the header to the inner loop and from its exit to the latch */
+static bool AroundInnerLoop(Loop& L, Loop& IL, std::vector<BasicBlock*>& before, std::vector<BasicBlock*>& after) {
+	for (auto* BB = L.getHeader(); BB != IL.getHeader(); BB = BB->getSingleSuccessor()) {
+		if (!BB || !L.contains(BB) || before.size() >= L.getNumBlocks()) {
+			return false;
+		}
+		before.push_back(BB);
+	}
+	for (auto* BB = IL.getExitBlock(); BB != L.getLoopLatch(); BB = BB->getSingleSuccessor()) {
+		if (!BB || !L.contains(BB) || after.size() >= L.getNumBlocks()) {
+			return false;
+		}
+		after.push_back(BB);
+	}
+	after.push_back(L.getLoopLatch());
+	return before.size() + after.size() + IL.getNumBlocks() == L.getNumBlocks();
+}
+
+/* Whether accesses to the same array with index functions f at outer iteration i and g at iteration (i', j') can only
+ * address the same element when i = i', as some index is the same multiple of the outer induction variable plus the
+ * same constant in both */
+static bool SameOuterIteration(const std::vector<std::vector<int>>& f, const std::vector<std::vector<int>>& g) {
+	for (size_t d = 0; d < f.size(); d++) {
+		if (f[d][0] && !f[d][1] && f[d] == g[d]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Whether the accesses never address the same element, as f = g has no integer solution for some index */
+static bool NeverSameElement(const std::vector<std::vector<int>>& f, const std::vector<std::vector<int>>& g) {
+	for (size_t d = 0; d < f.size(); d++) {
+		int divisor = std::gcd(std::gcd(f[d][0], f[d][1]), std::gcd(g[d][0], g[d][1]));
+		int constant = g[d].back() - f[d].back();
+		if (divisor ? constant % divisor != 0 : constant != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Drops what scalar evolution knows about the loops of the nest L is in, once their blocks changed */
+static void ForgetOutermostLoop(Loop& L, ScalarEvolution& SE) {
+	auto* outermost = &L;
+	while (outermost->getParentLoop()) {
+		outermost = outermost->getParentLoop();
+	}
+	SE.forgetLoop(outermost);
+}
+
+/* Makes an imperfect nest perfect where the dependences allow. Values computed before the inner loop and used in it,
+ * loads of locations no store of the nest may alias included, are recomputed at the top of the inner loop. The stores
+ * before and after the inner loop move, with the loads that feed them, into loops of their own over the same outer
+ * iterations, run before and after the nest. Distribution only reorders two accesses to the same location when one of
+ * them moved and the other did not, or they moved to different loops, so each such pair including a store must not
+ * alias, address the same element only in the same outer iteration, where their order is kept, or never address the
+ * same element. Nothing changes when any of that fails. The changes are recorded so that the caller can keep them with
+ * CommitDistribution or take them back with UndoDistribution. */
+NestDistribution PolytopePass::DistributeNest(Loop& L, LoopStandardAnalysisResults& AR) {
+	NestDistribution res;
+	distributionChanges = {};
+	auto* IV = L.getInductionVariable(AR.SE);
+	auto* preheader = L.getLoopPreheader();
+	auto* latch = L.getLoopLatch();
+	auto* exit = L.getExitBlock();
+	auto* latchBranch = latch ? dyn_cast<BranchInst>(latch->getTerminator()) : nullptr;
+	auto* latchCmp = L.getLatchCmpInst();
+	if (!IV || !preheader || !exit || !latchBranch || !latchBranch->isConditional() || !latchCmp ||
+		L.getSubLoops().size() != 1 || !L.getSubLoops()[0]->getSubLoops().empty() || !L.hasDedicatedExits()) {
 		return res;
 	}
-	/* Test if the value is an induction variable */
-	auto it = std::find_if(IVList.begin(), IVList.end(), [V](IVInfo& info) { return info.IV == V; });
-	if (it != IVList.end()) {
-		std::vector<int> res(IVList.size() + 1, 0);
-		unsigned index = it - IVList.begin();
-		res[index] = 1;
+	auto* IL = L.getSubLoops()[0];
+	auto* increment = dyn_cast<Instruction>(IV->getIncomingValueForBlock(latch));
+	std::vector<BasicBlock*> blocks[2];
+	if (!increment || !IL->getLoopPreheader() || !IL->getExitBlock() || !IL->getInductionVariable(AR.SE) ||
+		!AroundInnerLoop(L, *IL, blocks[0], blocks[1])) {
 		return res;
 	}
-	if (isa<AddOperator>(V)) {
-		auto* addInstr = dyn_cast<AddOperator>(V);
-		auto fst = GetValueIfAffine(addInstr->getOperand(0));
-		auto snd = GetValueIfAffine(addInstr->getOperand(1));
-		if (fst && snd) {
-			std::transform(fst->begin(), fst->end(), snd->begin(), fst->begin(), std::plus<>());
-			return fst;
+	/* Index functions are taken in terms of the induction variables of this nest */
+	outerLoop = &L;
+	innerLoop = IL;
+	IVList = {};
+	IVList.push_back({IV});
+	IVList.push_back({IL->getInductionVariable(AR.SE)});
+	parentIV = L.getParentLoop() ? L.getParentLoop()->getInductionVariable(AR.SE) : nullptr;
+
+	std::vector<Instruction*> nestAccesses;
+	std::vector<Value*> stored;
+	for (auto* BB: IL->blocks()) {
+		for (auto& I: *BB) {
+			if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+				nestAccesses.push_back(&I);
+			} else if (I.mayReadOrWriteMemory()) {
+				return res;
+			}
+			if (isa<StoreInst>(I)) {
+				stored.push_back(getLoadStorePointerOperand(&I));
+			}
 		}
 	}
-	if (isa<SubOperator>(V)) {
-		auto* subInstr = dyn_cast<SubOperator>(V);
-		auto fst = GetValueIfAffine(subInstr->getOperand(0));
-		auto snd = GetValueIfAffine(subInstr->getOperand(1));
-		if (fst && snd) {
-			std::transform(fst->begin(), fst->end(), snd->begin(), fst->begin(), std::minus<>());
-			return fst;
+	/* Values before and after the inner loop may feed the inner loop and other statements around it, but nothing else,
+	 * so that once the inner loop recomputes them and the stores are gone they are dead */
+	DenseSet<BasicBlock*> part[2] = {DenseSet<BasicBlock*>(blocks[0].begin(), blocks[0].end()),
+									 DenseSet<BasicBlock*>(blocks[1].begin(), blocks[1].end())};
+	std::vector<Instruction*> sunk;
+	std::vector<StoreInst*> statements[2];
+	for (int p = 0; p < 2; p++) {
+		for (auto* BB: blocks[p]) {
+			for (auto& I: *BB) {
+				if (&I == IV || &I == latchCmp || I.isTerminator() || isa<DbgInfoIntrinsic>(I)) {
+					continue;
+				}
+				auto* load = dyn_cast<LoadInst>(&I);
+				auto* store = dyn_cast<StoreInst>(&I);
+				if (isa<PHINode>(I) || (load && !load->isSimple()) || (store && !store->isSimple()) ||
+					(!load && !store && (I.mayReadOrWriteMemory() || I.mayHaveSideEffects()))) {
+					LLVM_DEBUG(dbgs() << "Cannot move " << I << " out of the nest\n");
+					return res;
+				}
+				if (&I != increment && any_of(I.users(), [&](User* user) {
+					auto* use = cast<Instruction>(user);
+					return !IL->contains(use) && (!(part[0].count(use->getParent()) || part[1].count(use->getParent())) ||
+												  isa<PHINode>(use) || use->isTerminator() || use == latchCmp);
+				})) {
+					LLVM_DEBUG(dbgs() << "Value " << I << " is live beyond the statements around the inner loop\n");
+					return res;
+				}
+				if (any_of(I.users(), [&](User* user) { return IL->contains(cast<Instruction>(user)); })) {
+					sunk.push_back(&I);
+				}
+				if (store) {
+					statements[p].push_back(store);
+					stored.push_back(store->getPointerOperand());
+				}
+			}
 		}
 	}
-	if (isa<MulOperator>(V)) {
-		auto* mulInstr = dyn_cast<MulOperator>(V);
-		std::optional<std::vector<int>> res = {};
-		/* Ensure at least one of the two branches is a constant */
-		if (isa<Constant>(mulInstr->getOperand(0))) {
-			int scale = ValueToInt(mulInstr->getOperand(0));
-			res = GetValueIfAffine(mulInstr->getOperand(1));
-			std::transform(res->begin(), res->end(), res->begin(), [scale](int& x){ return x * scale; });
-		} else if (isa<Constant>(mulInstr->getOperand(1))) {
-			int scale = ValueToInt(mulInstr->getOperand(1));
-			res = GetValueIfAffine(mulInstr->getOperand(0));
-			std::transform(res->begin(), res->end(), res->begin(), [scale](int& x){ return x * scale; });
-		}
+	if (sunk.empty() && statements[0].empty() && statements[1].empty()) {
 		return res;
 	}
-	if (isa<ShlOperator>(V)) {
-		auto* shlInstr = dyn_cast<ShlOperator>(V);
-		if (isa<Constant>(shlInstr->getOperand(1))) {
-			int scale = 1 << ValueToInt(shlInstr->getOperand(1));
-			auto res = GetValueIfAffine(shlInstr->getOperand(0));
-			std::transform(res->begin(), res->end(), res->begin(), [scale](int& x){ return x * scale; });
+
+	/* Whether a value can be recomputed where the values of dest are: at the top of the inner loop for dest 2, in the
+	 * loops before or after the nest for 0 and 1, from the loads of the statements there */
+	std::function<bool(Value*, int, std::vector<LoadInst*>&)> recomputable =
+			[&](Value* V, int dest, std::vector<LoadInst*>& loads) {
+		auto* I = dyn_cast<Instruction>(V);
+		if (!I || !L.contains(I) || I == IV) {
+			return true;
+		}
+		if (IL->contains(I) || isa<PHINode>(I)) {
+			return false;
+		}
+		if (auto* load = dyn_cast<LoadInst>(I)) {
+			if (!part[dest == 2 ? 0 : dest].count(load->getParent()) ||
+				(dest == 2 && any_of(stored, [&](Value* pointer) {
+					return !AR.AA.isNoAlias(load->getPointerOperand(), pointer);
+				}))) {
+				return false;
+			}
+			loads.push_back(load);
+		}
+		return all_of(I->operands(), [&](Value* operand) { return recomputable(operand, dest, loads); });
+	};
+	std::vector<LoadInst*> sunkLoads;
+	for (auto* I: sunk) {
+		if (!recomputable(I, 2, sunkLoads)) {
+			LLVM_DEBUG(dbgs() << "Cannot recompute " << *I << " in the inner loop\n");
 			return res;
 		}
-		return {};
 	}
-	/* Exclusively for testing XOR */
-	if (isa<BinaryOperator>(V)) {
-		auto* binInstr = dyn_cast<BinaryOperator>(V);
-		/* The instruction %1 = xor k -1 simplifies to %1 = -k - 1 */
-		if (binInstr->getOpcode() == Instruction::Xor && ValueToInt(binInstr->getOperand(1)) == -1) {
-			auto res = GetValueIfAffine(binInstr->getOperand(0));
-			std::transform(res->begin(), res->end(), res->begin(), std::negate<>());
-			if (res) {
-				res.value().back() -= 1;
+	/* The dependence test only sees the last two indices of each access and not the array, so a sunk load that it
+	 * could match with a store of the nest would add a dependence that does not exist */
+	for (auto* load: sunkLoads) {
+		auto element = AnalysedElement(load->getPointerOperand());
+		if (!element || any_of(nestAccesses, [&](Instruction* access) {
+			auto written = isa<StoreInst>(access) ? AnalysedElement(getLoadStorePointerOperand(access)) : std::nullopt;
+			return isa<StoreInst>(access) && (!written || !NeverSameElement(*element, *written));
+		})) {
+			LLVM_DEBUG(dbgs() << "Sinking " << *load << " would add a dependence on the stores of the nest\n");
+			return res;
+		}
+	}
+	/* The accesses each distributed loop makes, in program order */
+	std::vector<Instruction*> moved[2];
+	for (int p = 0; p < 2; p++) {
+		std::vector<LoadInst*> loads;
+		for (auto* store: statements[p]) {
+			if (!recomputable(store->getValueOperand(), p, loads) ||
+				!recomputable(store->getPointerOperand(), p, loads)) {
+				LLVM_DEBUG(dbgs() << "Cannot distribute " << *store << "\n");
 				return res;
 			}
 		}
-		return {};
+		for (auto* BB: blocks[p]) {
+			for (auto& I: *BB) {
+				if (isa<StoreInst>(I) || is_contained(loads, &I)) {
+					moved[p].push_back(&I);
+				}
+			}
+		}
 	}
-	if (isa<CallInst>(V)) {
-		auto* funcInstr = dyn_cast<CallInst>(V);
-		if (funcInstr->getCalledFunction()->getName() == "llvm.smax.i32") {
-			auto fst = GetValueIfAffine(funcInstr->getArgOperand(0));
-			auto snd = GetValueIfAffine(funcInstr->getArgOperand(1));
-			if (fst && snd) {
-				std::transform(fst->begin(), fst->end(), snd->begin(), fst->begin(),
-							   [](int m, int n) { return m > n ? m : n; });
-				return fst;
+
+	auto conflicting = [&](Instruction* access, Instruction* other) {
+		auto* pointer = getLoadStorePointerOperand(access);
+		auto* otherPointer = getLoadStorePointerOperand(other);
+		if ((isa<LoadInst>(access) && isa<LoadInst>(other)) || AR.AA.isNoAlias(pointer, otherPointer)) {
+			return false;
+		}
+		auto element = GetElementIfAffine(pointer);
+		auto otherElement = GetElementIfAffine(otherPointer);
+		auto* GEP = dyn_cast<GetElementPtrInst>(pointer);
+		auto* otherGEP = dyn_cast<GetElementPtrInst>(otherPointer);
+		if (!element || !otherElement || element->empty() || element->size() != otherElement->size() || !GEP ||
+			!otherGEP || GEP->getPointerOperand() != otherGEP->getPointerOperand() ||
+			GEP->getSourceElementType() != otherGEP->getSourceElementType()) {
+			return true;
+		}
+		return !SameOuterIteration(*element, *otherElement) && !NeverSameElement(*element, *otherElement);
+	};
+	for (int p = 0; p < 2; p++) {
+		for (auto* access: moved[p]) {
+			auto others = nestAccesses;
+			if (p == 0) {
+				others.insert(others.end(), moved[1].begin(), moved[1].end());
+			}
+			if (any_of(others, [&](Instruction* other) { return conflicting(access, other); })) {
+				LLVM_DEBUG(dbgs() << "Distributing " << *access << " would reverse a dependence\n");
+				return res;
 			}
+		}
+	}
+
+	auto* F = L.getHeader()->getParent();
+	auto& context = F->getContext();
+	std::function<Value*(Value*, DenseMap<Value*, Value*>&, IRBuilderBase&, const Twine&)> clone =
+			[&](Value* V, DenseMap<Value*, Value*>& map, IRBuilderBase& builder, const Twine& suffix) -> Value* {
+		auto* I = dyn_cast<Instruction>(V);
+		if (!I || !L.contains(I)) {
+			return V;
+		}
+		if (auto it = map.find(V); it != map.end()) {
+			return it->second;
+		}
+		auto* copy = I->clone();
+		for (unsigned o = 0; o < I->getNumOperands(); o++) {
+			copy->setOperand(o, clone(I->getOperand(o), map, builder, suffix));
+		}
+		return map[V] = builder.Insert(copy, I->getType()->isVoidTy() ? Twine() : I->getName() + suffix);
+	};
+
+	IRBuilder builder(&*IL->getHeader()->getFirstInsertionPt());
+	DenseMap<Value*, Value*> sunkMap = {{IV, IV}};
+	for (auto* I: sunk) {
+		I->replaceUsesWithIf(clone(I, sunkMap, builder, ".sunk"),
+							 [&](Use& use) { return IL->contains(cast<Instruction>(use.getUser())); });
+	}
+	for (auto [original, copy]: sunkMap) {
+		if (original != copy) {
+			distributionChanges.sunk.emplace_back(cast<Instruction>(original), cast<Instruction>(copy));
+		}
+	}
+
+	/* Each distributed loop runs the same iterations as the nest, which is entered at least once */
+	auto* init = IV->getIncomingValueForBlock(preheader);
+	auto emitLoop = [&](BasicBlock* from, BasicBlock* to, int p, const Twine& name) {
+		auto* body = BasicBlock::Create(context, L.getHeader()->getName() + name, F, to);
+		from->getTerminator()->replaceSuccessorWith(to, body);
+		builder.SetInsertPoint(body);
+		auto* phi = builder.CreatePHI(IV->getType(), 2, IV->getName() + name);
+		DenseMap<Value*, Value*> map = {{IV, phi}};
+		for (auto* access: moved[p]) {
+			clone(access, map, builder, name);
+		}
+		phi->addIncoming(init, from);
+		phi->addIncoming(clone(increment, map, builder, name), body);
+		auto* condition = clone(latchCmp, map, builder, name);
+		bool backedgeFirst = latchBranch->getSuccessor(0) == L.getHeader();
+		builder.CreateCondBr(condition, backedgeFirst ? body : to, backedgeFirst ? to : body);
+		auto* loop = AR.LI.AllocateLoop();
+		if (auto* parent = L.getParentLoop()) {
+			parent->addChildLoop(loop);
 		} else {
-			return {};
+			AR.LI.addTopLevelLoop(loop);
 		}
+		loop->addBasicBlockToLoop(body, AR.LI);
+		distributionChanges.loops.push_back({loop, from, to});
+	};
+	/* The new loops are innermost, so the loop pass manager need not visit them */
+	if (!statements[0].empty()) {
+		auto* nestPreheader = SplitEdge(preheader, L.getHeader(), &AR.DT, &AR.LI);
+		emitLoop(preheader, nestPreheader, 0, ".before");
 	}
-	if (isa<CastInst>(V)) {
-		auto* castInstr = dyn_cast<CastInst>(V);
-		return GetValueIfAffine(castInstr->getOperand(0));
+	if (!statements[1].empty()) {
+		auto* rest = SplitBlock(exit, exit->getFirstNonPHI(), &AR.DT, &AR.LI);
+		emitLoop(exit, rest, 1, ".after");
 	}
-	if (V == parentIV) {
-		std::vector<int> res(IVList.size() + 1, 0);
-		return res;
+
+	/* The stores, and the values only they or other removed values use, are taken out of the blocks but kept, each
+	 * with the first instruction after it that stays, until the distribution is committed or undone */
+	SmallPtrSet<Instruction*, 16> removed;
+	for (int p = 0; p < 2; p++) {
+		removed.insert(statements[p].begin(), statements[p].end());
 	}
-	return {};
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (int p = 0; p < 2; p++) {
+			for (auto* BB: blocks[p]) {
+				for (auto& I: *BB) {
+					if (!removed.count(&I) && !I.isTerminator() && wouldInstructionBeTriviallyDead(&I) &&
+						all_of(I.users(), [&](User* user) { return removed.count(cast<Instruction>(user)); })) {
+						removed.insert(&I);
+						changed = true;
+					}
+				}
+			}
+		}
+	}
+	/* In program order, so that putting each back before its next instruction restores runs of them in order */
+	for (int p = 0; p < 2; p++) {
+		for (auto* BB: blocks[p]) {
+			for (auto& I: *BB) {
+				if (removed.count(&I)) {
+					auto* next = I.getNextNode();
+					while (removed.count(next)) {
+						next = next->getNextNode();
+					}
+					distributionChanges.removed.emplace_back(&I, next);
+				}
+			}
+		}
+	}
+	for (auto [I, next]: distributionChanges.removed) {
+		I->removeFromParent();
+	}
+	AR.DT.recalculate(*F);
+	ForgetOutermostLoop(L, AR.SE);
+
+	res.before = statements[0].size();
+	res.after = statements[1].size();
+	res.sunk = sunk.size();
+	return res;
 }
 
-/* Verifies that induction variables and array accesses are affine functions */
-bool PolytopePass::HasInvariantBounds() {
-	for (auto& IV: IVList) {
-		if (!(outerLoop->isLoopInvariant(IV.init) && outerLoop->isLoopInvariant(IV.final))) {
-			return false;
-		}
+/* Keeps the changes of the last DistributeNest, deleting the statements it took out of the nest */
+void PolytopePass::CommitDistribution(const NestDistribution& distribution) {
+	for (auto [I, next]: distributionChanges.removed) {
+		I->dropAllReferences();
 	}
-	return true;
+	for (auto [I, next]: distributionChanges.removed) {
+		I->deleteValue();
+	}
+	distributionChanges = {};
+	NumDistributed += distribution.before + distribution.after;
+	NumSunk += distribution.sunk;
 }
 
-std::optional<LoopDependencies> PolytopePass::RunAnalysis(Loop& L, LoopStandardAnalysisResults& AR) {
-	IVList = {};
-	maxDepth = std::max(L.getLoopDepth(), maxDepth);
-	if (!IsPerfectNest(L, AR.LI, AR.SE)) {
-		return {};
+/* Restores the nest the last DistributeNest changed: the statements go back where they were, the inner loop uses the
+ * values computed before it again, and the added loops are removed with the blocks they were split from */
+void PolytopePass::UndoDistribution(Loop& L, LoopStandardAnalysisResults& AR) {
+	for (auto [I, next]: distributionChanges.removed) {
+		I->insertBefore(next);
 	}
-	IVInfo outerIV;
-	IVInfo innerIV;
+	for (auto [original, copy]: distributionChanges.sunk) {
+		copy->replaceAllUsesWith(original);
+	}
+	for (auto [original, copy]: distributionChanges.sunk) {
+		copy->eraseFromParent();
+	}
+	for (auto& added: distributionChanges.loops) {
+		auto* body = added.loop->getHeader();
+		added.from->getTerminator()->replaceSuccessorWith(body, added.to);
+		AR.LI.erase(added.loop);
+		AR.LI.removeBlock(body);
+		body->dropAllReferences();
+		body->eraseFromParent();
+		MergeBlockIntoPredecessor(added.to, nullptr, &AR.LI);
+	}
+	distributionChanges = {};
+	AR.DT.recalculate(*L.getHeader()->getParent());
+	ForgetOutermostLoop(L, AR.SE);
+}
 
-	outerIV.loop = &L;
-	auto* IL = L.getSubLoops().at(0);
-	if (IL == nullptr) {
+/* Smallest number of rows k >= 0 a nest has to run ahead of the nest fused after it, so that every access with index
+ * functions f of the first comes before each access with g of the second to the same element. Both are in the
+ * induction variables of the second: the fused nest runs iteration x of the first along with iteration x - (k, 0) of
+ * the second, so for every distance d = x - y between iterations x and y that access the same element, d - (k, 0) has
+ * to be lexicographically non-positive. Only accesses with the same linear part, whose distances are a single vector or
+ * a single row, are bounded; none is returned otherwise. */
+static std::optional<int> FusionShift(const std::vector<std::vector<int>>& f, const std::vector<std::vector<int>>& g) {
+	if (f.size() != g.size()) {
 		return {};
 	}
-	innerIV.loop = IL;
-	outerLoop = &L;
-	innerLoop = IL;
-
+	if (NeverSameElement(f, g)) {
+		return 0;
+	}
+	for (size_t d = 0; d < f.size(); d++) {
+		if (f[d][0] != g[d][0] || f[d][1] != g[d][1]) {
+			return {};
+		}
+	}
+	/* The distances are the solutions of M d = r */
+	std::vector<int> r;
+	for (size_t d = 0; d < f.size(); d++) {
+		r.push_back(g[d].back() - f[d].back());
+	}
+	auto solves = [&](int d0, int d1) {
+		for (size_t d = 0; d < f.size(); d++) {
+			if (f[d][0] * d0 + f[d][1] * d1 != r[d]) {
+				return false;
+			}
+		}
+		return true;
+	};
+	for (size_t a = 0; a < f.size(); a++) {
+		for (size_t b = a + 1; b < f.size(); b++) {
+			int det = IntegerSolver::Det({{f[a][0], f[a][1]}, {f[b][0], f[b][1]}});
+			if (!det) {
+				continue;
+			}
+			int n0 = f[b][1] * r[a] - f[a][1] * r[b];
+			int n1 = f[a][0] * r[b] - f[b][0] * r[a];
+			if (n0 % det || n1 % det || !solves(n0 / det, n1 / det)) {
+				return 0;
+			}
+			return std::max(0, n1 / det <= 0 ? n0 / det : n0 / det + 1);
+		}
+	}
+	/* A single row of distances when only the outer induction variable appears, as its part of d is then fixed */
+	if (all_of(f, [](auto& index) { return index[1] == 0; }) && any_of(f, [](auto& index) { return index[0] != 0; })) {
+		auto row = find_if(f, [](auto& index) { return index[0] != 0; });
+		int d0 = r[row - f.begin()] / (*row)[0];
+		if (r[row - f.begin()] % (*row)[0] || !solves(d0, 0)) {
+			return 0;
+		}
+		return std::max(0, d0 + 1);
+	}
+	return {};
+}
+
+/* Fuses the nest into the nest right after it, when both are perfect with unit steps and the same extents, possibly
+ * starting elsewhere, and nothing runs between them. The inner loop of the second then runs the body of the first,
+ * ahead of its own, so that both touch an element while it is in the cache. When an access of the second touches an
+ * element the first only reaches in a later iteration, the first runs k rows ahead, with its first k rows left to run
+ * before the fused nest and a copy of the second running its last k after it. Fusion gives up when no such k exists.
+ * The first nest is kept and the changes are recorded, so that the caller can analyse the fused nest and then keep
+ * them with CommitFusion or take them back with UndoFusion. */
+NestFusion PolytopePass::FuseNest(Loop& L, LoopStandardAnalysisResults& AR) {
+	NestFusion res;
+	fusionChanges = {};
+	auto& SE = AR.SE;
+	if (!IsPerfectNest(L, AR.LI, SE) || !L.getExitBlock() || !L.getLoopPreheader()) {
+		return res;
+	}
+	/* The next nest, reached through blocks that only branch on, or compute values without touching memory */
+	Loop* next = nullptr;
+	for (auto* BB = L.getExitBlock(); BB && !next; BB = BB->getSingleSuccessor()) {
+		if (AR.LI.getLoopFor(BB) != L.getParentLoop() || isa<PHINode>(BB->front()) ||
+			any_of(*BB, [](Instruction& I) { return I.mayReadOrWriteMemory() || I.mayHaveSideEffects(); })) {
+			return res;
+		}
+		auto* successor = BB->getSingleSuccessor();
+		auto* loop = successor ? AR.LI.getLoopFor(successor) : nullptr;
+		if (loop && loop->getHeader() == successor) {
+			if (loop->getLoopPreheader() != BB || loop->getParentLoop() != L.getParentLoop()) {
+				return res;
+			}
+			next = loop;
+		}
+	}
+	if (!next || !IsPerfectNest(*next, AR.LI, SE) || !next->getExitBlock()) {
+		return res;
+	}
+	Loop* nests[2] = {&L, next};
+	Loop* inner[2] = {L.getSubLoops()[0], next->getSubLoops()[0]};
+	PHINode* IVs[2][2];
+	const SCEV* starts[2][2];
+	for (int n = 0; n < 2; n++) {
+		for (int d = 0; d < 2; d++) {
+			auto* loop = d ? inner[n] : nests[n];
+			IVs[n][d] = loop->getInductionVariable(SE);
+			auto* rec = IVs[n][d] ? dyn_cast<SCEVAddRecExpr>(SE.getSCEV(IVs[n][d])) : nullptr;
+			if (!rec || rec->getLoop() != loop || !rec->getStepRecurrence(SE)->isOne() ||
+				!SE.isLoopInvariant(rec->getStart(), nests[n]) || (d && loop->getNumBlocks() != 1)) {
+				return res;
+			}
+			starts[n][d] = rec->getStart();
+		}
+		/* Nothing computed in the nest is used after it */
+		for (auto* BB: nests[n]->blocks()) {
+			for (auto& I: *BB) {
+				if (any_of(I.users(), [&](User* user) { return !nests[n]->contains(cast<Instruction>(user)); })) {
+					return res;
+				}
+			}
+		}
+		for (auto& I: *inner[n]->getHeader()) {
+			auto* load = dyn_cast<LoadInst>(&I);
+			auto* store = dyn_cast<StoreInst>(&I);
+			if ((load && !load->isSimple()) || (store && !store->isSimple()) ||
+				(!load && !store && (I.mayReadOrWriteMemory() || I.mayHaveSideEffects())) ||
+				(isa<PHINode>(I) && &I != IVs[n][1])) {
+				return res;
+			}
+		}
+	}
+	/* The same extents, with the offset of each induction variable of the first from that of the second */
+	int offsets[2];
+	for (int d = 0; d < 2; d++) {
+		auto* count = SE.getBackedgeTakenCount(d ? inner[0] : nests[0]);
+		auto* offset = dyn_cast<SCEVConstant>(SE.getMinusSCEV(starts[0][d], starts[1][d]));
+		if (isa<SCEVCouldNotCompute>(count) || count != SE.getBackedgeTakenCount(d ? inner[1] : nests[1]) ||
+			!SE.isLoopInvariant(count, nests[0]) || !SE.isLoopInvariant(count, nests[1]) || !offset ||
+			IVs[0][d]->getType() != IVs[1][d]->getType() || offset->getAPInt().getMinSignedBits() > 32) {
+			return res;
+		}
+		offsets[d] = (int) offset->getAPInt().getSExtValue();
+	}
+
+	/* Index functions of the accesses of each nest, in its own induction variables */
+	auto* F = L.getHeader()->getParent();
+	std::vector<std::pair<Instruction*, std::optional<std::vector<std::vector<int>>>>> accesses[2];
+	for (int n = 0; n < 2; n++) {
+		outerLoop = nests[n];
+		innerLoop = inner[n];
+		IVList = {};
+		IVList.push_back({IVs[n][0]});
+		IVList.push_back({IVs[n][1]});
+		parentIV = L.getParentLoop() ? L.getParentLoop()->getInductionVariable(SE) : nullptr;
+		for (auto& I: *inner[n]->getHeader()) {
+			if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+				accesses[n].emplace_back(&I, GetElementIfAffine(getLoadStorePointerOperand(&I)));
+			}
+		}
+	}
+	int shift = 0;
+	for (auto& [access, element]: accesses[0]) {
+		auto* pointer = getLoadStorePointerOperand(access);
+		auto* GEP = dyn_cast<GetElementPtrInst>(pointer);
+		for (auto& [other, otherElement]: accesses[1]) {
+			auto* otherPointer = getLoadStorePointerOperand(other);
+			auto* otherGEP = dyn_cast<GetElementPtrInst>(otherPointer);
+			if ((isa<LoadInst>(access) && isa<LoadInst>(other)) || AR.AA.isNoAlias(pointer, otherPointer)) {
+				continue;
+			}
+			if (!element || !otherElement || !GEP || !otherGEP ||
+				GEP->getPointerOperand() != otherGEP->getPointerOperand() ||
+				GEP->getSourceElementType() != otherGEP->getSourceElementType()) {
+				LLVM_DEBUG(dbgs() << "Cannot fuse nests over " << *access << " and " << *other << "\n");
+				return res;
+			}
+			/* The first nest in the induction variables of the second */
+			auto shifted = *element;
+			for (auto& index: shifted) {
+				index.back() += index[0] * offsets[0] + index[1] * offsets[1];
+			}
+			auto k = FusionShift(shifted, *otherElement);
+			if (!k) {
+				LLVM_DEBUG(dbgs() << "Unbounded distance between " << *access << " and " << *other << "\n");
+				return res;
+			}
+			shift = std::max(shift, *k);
+		}
+	}
+	auto tripCount = SE.getSmallConstantTripCount(&L);
+	if (shift && (unsigned) shift >= tripCount) {
+		LLVM_DEBUG(dbgs() << "Fusing would shift the nests by " << shift << " of " << tripCount << " rows\n");
+		return res;
+	}
+	/* The iteration of the first each iteration of the fused nest runs, less that of the second */
+	int alignment[2] = {offsets[0] + shift, offsets[1]};
+	/* A second nest with loop-carried dependences is searched for a transform, which dependences added by fusion may
+	 * rule out, so it is only fused with a first nest whose accesses add no dependence vector to its own */
+	std::vector<std::vector<std::vector<int>>> writes;
+	std::vector<std::vector<std::vector<int>>> reads;
+	auto add = [&](Instruction* access, std::vector<std::vector<int>> element, const int* offset) {
+		if (element.size() < 2) {
+			return false;
+		}
+		element.erase(element.begin(), element.end() - 2);
+		for (auto& index: element) {
+			index.back() += index[0] * offset[0] + index[1] * offset[1];
+		}
+		(isa<StoreInst>(access) ? writes : reads).push_back(element);
+		return true;
+	};
+	const int none[2] = {0, 0};
+	if (all_of(accesses[1], [&](auto& access) { return access.second && add(access.first, *access.second, none); })) {
+		LoopDependencies second(writes, reads);
+		if (second.HasLoopCarrierDependencies()) {
+			for (auto& [access, element]: accesses[0]) {
+				if (!element || !add(access, *element, alignment)) {
+					return res;
+				}
+			}
+			auto vectors = second.GetDependenceVectors();
+			for (auto& vector: LoopDependencies(writes, reads).GetDependenceVectors()) {
+				if (!is_contained(vectors, vector)) {
+					LLVM_DEBUG(dbgs() << "Fusing would add dependence vectors to the nest after it\n");
+					return res;
+				}
+			}
+		}
+	}
+
+	/* Ends the outer loop of a nest after its iteration at last, with an inclusive test as codegen expects, taking out
+	 * the exit test it had */
+	auto endAfter = [&](Loop* nest, Value* last) {
+		auto* latch = nest->getLoopLatch();
+		auto* branch = cast<BranchInst>(latch->getTerminator());
+		auto* increment = nest->getInductionVariable(SE)->getIncomingValueForBlock(latch);
+		IRBuilder builder(branch);
+		auto* condition = cast<Instruction>(branch->getCondition());
+		auto name = condition->getName() + ".end";
+		branch->setCondition(branch->getSuccessor(0) == nest->getHeader()
+							 ? builder.CreateICmpSLE(increment, last, name)
+							 : builder.CreateICmpSGT(increment, last, name));
+		condition->removeFromParent();
+		fusionChanges.conditions.emplace_back(branch, condition);
+	};
+	auto* type = IVs[0][0]->getType();
+	if (shift) {
+		/* The second nest runs its last rows in a copy of its own after the fused nest */
+		IRBuilder builder(next->getLoopPreheader()->getTerminator());
+		auto* start = IVs[1][0]->getIncomingValueForBlock(next->getLoopPreheader());
+		auto* rest = builder.CreateAdd(start, ConstantInt::get(type, tripCount - shift), IVs[1][0]->getName() + ".rest");
+		auto* exit = next->getExitBlock();
+		auto* after = SplitBlock(exit, &*exit->getFirstInsertionPt(), &AR.DT, &AR.LI);
+		ValueToValueMapTy VMap;
+		SmallVector<BasicBlock*, 8> blocks;
+		auto* copy = cloneLoopWithPreheader(after, exit, next, VMap, ".rest", &AR.LI, &AR.DT, blocks);
+		remapInstructionsInBlocks(blocks, VMap);
+		exit->getTerminator()->replaceSuccessorWith(after, copy->getLoopPreheader());
+		copy->getLoopLatch()->getTerminator()->replaceSuccessorWith(exit, after);
+		auto* copyIV = cast<PHINode>(VMap[IVs[1][0]]);
+		copyIV->setIncomingValueForBlock(copy->getLoopPreheader(), rest);
+		fusionChanges.rest = AddedLoop{copy, exit, after};
+		endAfter(next, builder.CreateSub(rest, ConstantInt::get(type, 1), IVs[1][0]->getName() + ".last"));
+		/* The first keeps its first rows */
+		builder.SetInsertPoint(L.getLoopPreheader()->getTerminator());
+		endAfter(&L, builder.CreateAdd(IVs[0][0]->getIncomingValueForBlock(L.getLoopPreheader()),
+									   ConstantInt::get(type, shift - 1), IVs[0][0]->getName() + ".ahead"));
+	}
+
+	/* The body of the first at the top of the inner loop of the second */
+	auto* header = inner[1]->getHeader();
+	IRBuilder builder(&*header->getFirstInsertionPt());
+	ValueToValueMapTy map;
+	for (int d = 0; d < 2; d++) {
+		map[IVs[0][d]] = IVs[1][d];
+		if (alignment[d]) {
+			auto* aligned = cast<Instruction>(builder.CreateAdd(IVs[1][d], ConstantInt::get(type, alignment[d]),
+																IVs[0][d]->getName() + ".fused"));
+			fusionChanges.added.push_back(aligned);
+			map[IVs[0][d]] = aligned;
+		}
+	}
+	std::vector<Instruction*> copies;
+	for (auto& I: *inner[0]->getHeader()) {
+		if (isa<PHINode>(I) || I.isTerminator()) {
+			continue;
+		}
+		auto* copy = I.clone();
+		RemapInstruction(copy, map, RF_IgnoreMissingLocals | RF_NoModuleLevelChanges);
+		builder.Insert(copy, I.hasName() ? I.getName() + ".fused" : Twine());
+		map[&I] = copy;
+		copies.push_back(copy);
+	}
+	/* The exit test of the first */
+	for (auto* copy: reverse(copies)) {
+		if (isInstructionTriviallyDead(copy)) {
+			copy->eraseFromParent();
+		} else {
+			fusionChanges.added.push_back(copy);
+		}
+	}
+
+	SE.forgetLoop(next);
+	SE.forgetLoop(&L);
+	AR.DT.recalculate(*F);
+	res.fused = true;
+	res.shift = shift;
+	res.nest = next;
+	return res;
+}
+
+/* Keeps the changes of the last FuseNest. The first nest is deleted, unless it still runs the rows it is ahead by,
+ * and the fused nest is marked so that the loop pass manager does not transform it again. */
+void PolytopePass::CommitFusion(Loop& L, const NestFusion& fusion, LoopStandardAnalysisResults& AR, LPMUpdater& U) {
+	auto* F = L.getHeader()->getParent();
+	OptimizationRemarkEmitter ORE(F);
+	ORE.emit([&]() {
+		OptimizationRemark remark(DEBUG_TYPE, "Fused", L.getStartLoc(), L.getHeader());
+		remark << "fused nest into the nest at " << ore::NV("Location", NestLocation(*fusion.nest));
+		if (fusion.shift) {
+			remark << ", running " << ore::NV("Shift", fusion.shift) << " rows ahead of it";
+		}
+		return remark;
+	});
+	for (auto [branch, condition]: fusionChanges.conditions) {
+		condition->insertBefore(branch);
+		RecursivelyDeleteTriviallyDeadInstructions(condition);
+	}
+	fusionChanges = {};
+	addStringMetadataToLoop(fusion.nest, "polytope.transformed", 1);
+	if (!fusion.shift) {
+		auto name = L.getName();
+		AR.SE.forgetLoop(&L);
+		deleteDeadLoop(&L, &AR.DT, &AR.SE, &AR.LI);
+		U.markLoopAsDeleted(L, name);
+	} else {
+		NumShiftedFusions++;
+	}
+	AR.DT.recalculate(*F);
+	NumFused++;
+}
+
+/* Restores the nests the last FuseNest changed: the inner loop of the second loses the body of the first, the copy
+ * running the last rows of the second is removed with the block it was split from, and both nests get their exit
+ * tests back */
+void PolytopePass::UndoFusion(Loop& L, const NestFusion& fusion, LoopStandardAnalysisResults& AR) {
+	auto* F = L.getHeader()->getParent();
+	for (auto* I: reverse(fusionChanges.added)) {
+		I->eraseFromParent();
+	}
+	if (auto& rest = fusionChanges.rest) {
+		auto* preheader = rest->loop->getLoopPreheader();
+		deleteDeadLoop(rest->loop, &AR.DT, &AR.SE, &AR.LI);
+		rest->from->getTerminator()->replaceSuccessorWith(preheader, rest->to);
+		AR.LI.removeBlock(preheader);
+		preheader->eraseFromParent();
+		MergeBlockIntoPredecessor(rest->to, nullptr, &AR.LI);
+	}
+	for (auto [branch, condition]: fusionChanges.conditions) {
+		auto* fused = branch->getCondition();
+		condition->insertBefore(branch);
+		branch->setCondition(condition);
+		RecursivelyDeleteTriviallyDeadInstructions(fused);
+	}
+	fusionChanges = {};
+	AR.DT.recalculate(*F);
+	AR.SE.forgetLoop(fusion.nest);
+	AR.SE.forgetLoop(&L);
+}
+
+/* Apply op to each pair of coefficients in 64 bits, giving nothing when a result does not fit in int */
+template <typename Op>
+static std::optional<std::vector<int>> CombineCoefficients(const std::vector<int>& fst, const std::vector<int>& snd,
+														   Op op) {
+	std::vector<int> res(fst.size());
+	for (size_t i = 0; i < fst.size(); i++) {
+		int64_t n = op((int64_t) fst[i], (int64_t) snd[i]);
+		if (!isInt<32>(n)) {
+			return {};
+		}
+		res[i] = (int) n;
+	}
+	return res;
+}
+
+/* Recursively test if a value is an affine function of induction variables. Constants and coefficients that do not
+ * fit in int make the value non-affine. */
+std::optional<std::vector<int>> PolytopePass::GetValueIfAffine(Value* V) {
+	if (isa<Constant>(V)) {
+		auto k = ValueToInt(V);
+		if (!k) {
+			return {};
+		}
+		std::vector<int> res(IVList.size() + 1, 0);
+		res[IVList.size()] = *k;
+		return res;
+	}
+	/* Test if the value is an induction variable */
+	auto it = std::find_if(IVList.begin(), IVList.end(), [V](IVInfo& info) { return info.IV == V; });
+	if (it != IVList.end()) {
+		std::vector<int> res(IVList.size() + 1, 0);
+		unsigned index = it - IVList.begin();
+		res[index] = 1;
+		return res;
+	}
+	if (isa<AddOperator>(V)) {
+		auto* addInstr = dyn_cast<AddOperator>(V);
+		auto fst = GetValueIfAffine(addInstr->getOperand(0));
+		auto snd = GetValueIfAffine(addInstr->getOperand(1));
+		if (fst && snd) {
+			return CombineCoefficients(*fst, *snd, std::plus<>());
+		}
+	}
+	if (isa<SubOperator>(V)) {
+		auto* subInstr = dyn_cast<SubOperator>(V);
+		auto fst = GetValueIfAffine(subInstr->getOperand(0));
+		auto snd = GetValueIfAffine(subInstr->getOperand(1));
+		if (fst && snd) {
+			return CombineCoefficients(*fst, *snd, std::minus<>());
+		}
+	}
+	if (isa<MulOperator>(V)) {
+		auto* mulInstr = dyn_cast<MulOperator>(V);
+		/* Ensure at least one of the two branches is a constant */
+		bool first = isa<Constant>(mulInstr->getOperand(0));
+		if (!first && !isa<Constant>(mulInstr->getOperand(1))) {
+			return {};
+		}
+		auto scale = ValueToInt(mulInstr->getOperand(first ? 0 : 1));
+		auto res = GetValueIfAffine(mulInstr->getOperand(first ? 1 : 0));
+		if (!scale || !res) {
+			return {};
+		}
+		return CombineCoefficients(*res, std::vector<int>(res->size(), *scale), std::multiplies<>());
+	}
+	if (isa<ShlOperator>(V)) {
+		auto* shlInstr = dyn_cast<ShlOperator>(V);
+		auto shift = ValueToInt(shlInstr->getOperand(1));
+		auto res = GetValueIfAffine(shlInstr->getOperand(0));
+		if (!shift || *shift < 0 || *shift > 30 || !res) {
+			return {};
+		}
+		return CombineCoefficients(*res, std::vector<int>(res->size(), 1 << *shift), std::multiplies<>());
+	}
+	/* Exclusively for testing XOR */
+	if (isa<BinaryOperator>(V)) {
+		auto* binInstr = dyn_cast<BinaryOperator>(V);
+		/* The instruction %1 = xor k -1 simplifies to %1 = -k - 1 */
+		if (binInstr->getOpcode() == Instruction::Xor && ValueToInt(binInstr->getOperand(1)) == -1) {
+			auto res = GetValueIfAffine(binInstr->getOperand(0));
+			if (res) {
+				std::vector<int> one(res->size(), 0);
+				one.back() = 1;
+				return CombineCoefficients(*res, one, [](int64_t m, int64_t n) { return -m - n; });
+			}
+		}
+		return {};
+	}
+	if (isa<CallInst>(V)) {
+		auto* funcInstr = dyn_cast<CallInst>(V);
+		auto* intrinsic = dyn_cast<IntrinsicInst>(funcInstr);
+		if (intrinsic && intrinsic->getIntrinsicID() == Intrinsic::smax) {
+			auto fst = GetValueIfAffine(funcInstr->getArgOperand(0));
+			auto snd = GetValueIfAffine(funcInstr->getArgOperand(1));
+			if (fst && snd) {
+				std::transform(fst->begin(), fst->end(), snd->begin(), fst->begin(),
+							   [](int m, int n) { return m > n ? m : n; });
+				return fst;
+			}
+		} else {
+			return {};
+		}
+	}
+	if (isa<CastInst>(V)) {
+		auto* castInstr = dyn_cast<CastInst>(V);
+		return GetValueIfAffine(castInstr->getOperand(0));
+	}
+	if (V == parentIV) {
+		std::vector<int> res(IVList.size() + 1, 0);
+		return res;
+	}
+	return {};
+}
+
+/* Verifies that induction variables and array accesses are affine functions */
+bool PolytopePass::HasInvariantBounds() {
+	for (auto& IV: IVList) {
+		if (!(outerLoop->isLoopInvariant(IV.init) && outerLoop->isLoopInvariant(IV.final))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Whether the final value of a loop is one past its last value, as for i < n, rather than the last value, and none
+ * when the loop exits some other way */
+static std::optional<bool> ExclusiveFinalValue(const Loop::LoopBounds& bounds) {
+	auto* step = dyn_cast<ConstantInt>(bounds.getStepValue());
+	switch (bounds.getCanonicalPredicate()) {
+		case ICmpInst::ICMP_SLE:
+		case ICmpInst::ICMP_ULE:
+			return false;
+		case ICmpInst::ICMP_SLT:
+		case ICmpInst::ICMP_ULT:
+			return true;
+		case ICmpInst::ICMP_NE:
+			if (step && step->isOne()) {
+				return true;
+			}
+			return {};
+		default:
+			return {};
+	}
+}
+
+std::optional<LoopDependencies> PolytopePass::RunAnalysis(Loop& L, LoopStandardAnalysisResults& AR) {
+	IVList = {};
+	layout = {};
+	reductions = {};
+	maxDepth = std::max(L.getLoopDepth(), maxDepth);
+	/* Innermost loops are not nests, so they are not reported as missed */
+	rejection = L.getSubLoops().empty() ? Rejection::None : Rejection::NotPerfect;
+	if (!IsPerfectNest(L, AR.LI, AR.SE)) {
+		return {};
+	}
+	IVInfo outerIV;
+	IVInfo innerIV;
+
+	outerIV.loop = &L;
+	auto* IL = L.getSubLoops().at(0);
+	if (IL == nullptr) {
+		return {};
+	}
+	innerIV.loop = IL;
+	outerLoop = &L;
+	innerLoop = IL;
+
 	outerIV.IV = outerIV.loop->getInductionVariable(AR.SE);
 	innerIV.IV = innerIV.loop->getInductionVariable(AR.SE);
 
@@ -181,7 +1349,10 @@ std::optional<LoopDependencies> PolytopePass::RunAnalysis(Loop& L, LoopStandardA
 	auto innerBounds = innerIV.loop->getBounds(AR.SE);
 	auto outerBounds = outerIV.loop->getBounds(AR.SE);
 
-	if (!innerBounds.hasValue() || !outerBounds.hasValue()) {
+	rejection = Rejection::NonAffine;
+	/* Codegen rebuilds both loops with inclusive upper bounds, so loops that exit otherwise are left alone */
+	if (!innerBounds.hasValue() || !outerBounds.hasValue() || !ExclusiveFinalValue(*innerBounds) ||
+		!ExclusiveFinalValue(*outerBounds)) {
 		return {};
 	}
 
@@ -189,19 +1360,27 @@ std::optional<LoopDependencies> PolytopePass::RunAnalysis(Loop& L, LoopStandardA
 	outerIV.init = &outerBounds->getInitialIVValue();
 	innerIV.final = &innerBounds->getFinalIVValue();
 	outerIV.final = &outerBounds->getFinalIVValue();
+	innerIV.exclusive = *ExclusiveFinalValue(*innerBounds);
+	outerIV.exclusive = *ExclusiveFinalValue(*outerBounds);
+	innerIV.step = innerBounds->getStepValue();
+	outerIV.step = outerBounds->getStepValue();
 
 	IVList.push_back(outerIV);
 	IVList.push_back(innerIV);
 
+	if (Reductions) {
+		reductions = FindReductions(AR);
+	}
 	auto dependencies = GetArrayAccessesIfAffine();
 
 	if (!HasInvariantBounds()) {
-		dbgs() << "Not affine\n";
+		LLVM_DEBUG(dbgs() << "Not affine\n");
 		return {};
 	} else if (!dependencies) {
-		dbgs() << "No dependencies\n";
+		LLVM_DEBUG(dbgs() << "No dependencies\n");
 		return {};
 	}
+	rejection = Rejection::None;
 	return dependencies;
 }
 
@@ -210,21 +1389,29 @@ std::optional<LoopDependencies> PolytopePass::GetArrayAccessesIfAffine() {
 	std::vector<std::vector<std::vector<int>>> writes;
 	for (auto& instr: *(innerLoop->getHeader())) {
 		/* Extract array access index functions for all array read/writes */
-		if (isa<StoreInst>(instr) || isa<LoadInst>(instr)) {
+		if ((isa<StoreInst>(instr) || isa<LoadInst>(instr)) && !IsReductionAccess(&instr)) {
 			bool isWrite = isa<StoreInst>(instr);
 			std::vector<int> T(IVList.size() + 1, 0);
 			auto I = instr.getOperand(isWrite ? 1 : 0);
 			if (isa<GetElementPtrInst>(I)) {
 				auto GEPInstr = dyn_cast<GetElementPtrInst>(I);
-				auto size = GEPInstr->getNumOperands();
-				auto v1 = GetValueIfAffine(GEPInstr->getOperand(size-2));
-				auto v2 = GetValueIfAffine(GEPInstr->getOperand(size-1));
-				if (v1 && v2) {
-					if (isWrite) {
-						writes.push_back({v1.value(), v2.value()});
-					} else {
-						reads.push_back({v1.value(), v2.value()});
-					}
+				/* The type indexed by the last operand gives the row length and element size */
+				SmallVector<Value*, 4> indices(GEPInstr->idx_begin(), GEPInstr->idx_end() - 1);
+				auto* row = GetElementPtrInst::getIndexedType(GEPInstr->getSourceElementType(), indices);
+				if (auto* rowTy = dyn_cast_or_null<ArrayType>(row)) {
+					auto& DL = GEPInstr->getModule()->getDataLayout();
+					layout = {(long) rowTy->getNumElements(),
+							  (unsigned) DL.getTypeAllocSize(rowTy->getElementType()).getFixedSize()};
+				}
+				/* An index the dependence test cannot see, such as a constant wider than int, hides the access */
+				auto element = AnalysedElement(GEPInstr);
+				if (!element) {
+					return {};
+				}
+				if (isWrite) {
+					writes.push_back(*element);
+				} else {
+					reads.push_back(*element);
 				}
 			} else {
 				return {};
@@ -232,381 +1419,2798 @@ std::optional<LoopDependencies> PolytopePass::GetArrayAccessesIfAffine() {
 		}
 	}
 
-	if ((reads.empty() && writes.size() < 2) || writes.empty()) {
+	std::vector<std::vector<std::vector<int>>> elements;
+	for (auto& reduction: reductions) {
+		elements.push_back(reduction.element);
+	}
+	if (elements.empty() && ((reads.empty() && writes.size() < 2) || writes.empty())) {
+		rejection = Rejection::NoDependencies;
 		return {};
 	}
 
-	return LoopDependencies(writes, reads);
+	return LoopDependencies(writes, reads, elements);
 }
 
-LoopDependencies
-PolytopePass::TransformAssignment(const LoopDependencies& assignment, const std::vector<std::vector<int>>& transform) {
-	std::vector<std::vector<std::vector<int>>> writeVectors;
-	std::vector<std::vector<std::vector<int>>> readVectors;
-
-	std::vector<std::vector<int>> transform1;
-	for (auto& row: transform) {
-		auto v = row;
-		v.push_back(0);
-		transform1.push_back(v);
+/* Index functions of the last two indices of the GEP a pointer comes from, which is all the dependence test sees of an
+ * access: it tells neither arrays nor leading indices apart */
+std::optional<std::vector<std::vector<int>>> PolytopePass::AnalysedElement(Value* pointer) {
+	auto* GEP = dyn_cast<GetElementPtrInst>(pointer);
+	if (!GEP) {
+		return {};
 	}
-	transform1.emplace_back(transform1.at(0).size(), 0);
-	transform1.back().back() = 1;
+	auto size = GEP->getNumOperands();
+	auto v1 = GetValueIfAffine(GEP->getOperand(size - 2));
+	auto v2 = GetValueIfAffine(GEP->getOperand(size - 1));
+	if (!v1 || !v2) {
+		return {};
+	}
+	return std::vector<std::vector<int>>{*v1, *v2};
+}
 
-	for (auto& write: assignment.writes) {
-		std::vector<std::vector<int>> v;
-		v.reserve(write.size());
-		for (auto& writeIndex: write) {
-			v.push_back(IntegerSolver::LinearTransform(transform1, writeIndex));
+/* Index functions of the element a pointer addresses, one row per index of its GEP, when its base is invariant in the
+ * nest and every index is affine; a pointer invariant in the nest addresses a single element and has no rows */
+std::optional<std::vector<std::vector<int>>> PolytopePass::GetElementIfAffine(Value* pointer) {
+	if (outerLoop->isLoopInvariant(pointer)) {
+		return std::vector<std::vector<int>>{};
+	}
+	auto* GEP = dyn_cast<GetElementPtrInst>(pointer);
+	if (!GEP || !outerLoop->isLoopInvariant(GEP->getPointerOperand())) {
+		return {};
+	}
+	std::vector<std::vector<int>> res;
+	for (auto& index: GEP->indices()) {
+		auto row = isa<Constant>(index) && !isa<ConstantInt>(index) ? std::nullopt : GetValueIfAffine(index);
+		if (!row) {
+			return {};
 		}
-		writeVectors.push_back(v);
+		res.push_back(*row);
 	}
+	return res;
+}
 
-	/* Can this be done with a single matrix multiplication? */
-	for (auto& readVector: assignment.reads) {
-		std::vector<std::vector<int>> v;
-		v.reserve(readVector.size());
-		for (auto& readIndex: readVector) {
-			v.push_back(IntegerSolver::LinearTransform(transform1, readIndex));
+static RecurKind ReductionKind(const Instruction* update) {
+	if (auto* minMax = dyn_cast<MinMaxIntrinsic>(update)) {
+		switch (minMax->getIntrinsicID()) {
+			case Intrinsic::smin:
+				return RecurKind::SMin;
+			case Intrinsic::smax:
+				return RecurKind::SMax;
+			case Intrinsic::umin:
+				return RecurKind::UMin;
+			default:
+				return RecurKind::UMax;
 		}
-		readVectors.push_back(v);
 	}
+	switch (update->getOpcode()) {
+		case Instruction::Add:
+			return RecurKind::Add;
+		case Instruction::And:
+			return RecurKind::And;
+		case Instruction::Or:
+			return RecurKind::Or;
+		case Instruction::Xor:
+			return RecurKind::Xor;
+		default:
+			return RecurKind::None;
+	}
+}
 
-	return {writeVectors, readVectors};
+/* Value that leaves any other unchanged under the operation of a reduction */
+static Constant* ReductionIdentity(RecurKind kind, Type* Ty) {
+	auto bits = Ty->getIntegerBitWidth();
+	switch (kind) {
+		case RecurKind::And:
+		case RecurKind::UMin:
+			return ConstantInt::get(Ty, APInt::getAllOnes(bits));
+		case RecurKind::SMin:
+			return ConstantInt::get(Ty, APInt::getSignedMaxValue(bits));
+		case RecurKind::SMax:
+			return ConstantInt::get(Ty, APInt::getSignedMinValue(bits));
+		default:
+			return ConstantInt::get(Ty, 0);
+	}
 }
 
-std::optional<std::vector<std::vector<int>>>
-PolytopePass::ComputeAffineTransformationInner(const LoopDependencies& assignment,
-											   const std::vector<std::vector<int>>& genA,
-											   const std::vector<std::vector<int>>& genB,
-											   const std::vector<std::vector<int>>& transform,
-											   int depth) {
-	auto transformedAssignment = TransformAssignment(assignment, transform);
-	if (!transformedAssignment.HasLoopCarrierDependencies()) {
-		auto preservesDependencies = true;
-		std::vector<std::vector<int>> depVectors;
-		for (auto write : assignment.writes) {
-			for (auto read : assignment.reads) {
-				std::vector<int> vec = {write[0].back() - read[0].back(),
-										write[1].back() - read[1].back()};
-				auto transformedVec = IntegerSolver::LinearTransform(transform, vec);
-				for (int i = 0; i < vec.size(); i++) {
-					if ((vec[i]<0) != (transformedVec[i]<0)) {
-						preservesDependencies = false;
-					}
-				}
-				if (!preservesDependencies) {
-					break;
-				}
+/* Finds the stores of the inner loop body that update an element with add, and, or, xor, smin, smax, umin or umax of
+ * its old value, loaded from the same address in the same iteration and used for nothing else. The element must be
+ * affine in the induction variables, and alias analysis must show that every other access of the nest is to a
+ * different object, so that the order of the updates is the only thing a transform can change. Nests that call
+ * anything touching memory have none. */
+std::vector<PolytopePass::Reduction> PolytopePass::FindReductions(LoopStandardAnalysisResults& AR) {
+	std::vector<Instruction*> accesses;
+	for (auto* BB: innerLoop->blocks()) {
+		for (auto& I: *BB) {
+			if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+				accesses.push_back(&I);
+			} else if (I.mayReadOrWriteMemory()) {
+				return {};
 			}
 		}
+	}
+	std::vector<Reduction> res;
+	for (auto& I: *innerLoop->getHeader()) {
+		auto* store = dyn_cast<StoreInst>(&I);
+		auto* update = store ? dyn_cast<Instruction>(store->getValueOperand()) : nullptr;
+		if (!update || !store->isSimple() || !update->hasOneUse() || !update->getType()->isIntegerTy() ||
+			update->getParent() != store->getParent()) {
+			continue;
+		}
+		auto kind = ReductionKind(update);
+		LoadInst* load = nullptr;
+		for (auto& operand: update->operands()) {
+			auto* old = dyn_cast<LoadInst>(operand.get());
+			if (old && old->isSimple() && old->hasOneUse() && old->getParent() == store->getParent() &&
+				AR.SE.getSCEV(old->getPointerOperand()) == AR.SE.getSCEV(store->getPointerOperand())) {
+				load = old;
+			}
+		}
+		auto element = GetElementIfAffine(store->getPointerOperand());
+		if (kind == RecurKind::None || !load || !element) {
+			continue;
+		}
+		if (!std::all_of(accesses.begin(), accesses.end(), [&](Instruction* access) {
+			return access == load || access == store ||
+				   AR.AA.isNoAlias(getLoadStorePointerOperand(access), store->getPointerOperand());
+		})) {
+			LLVM_DEBUG(dbgs() << "Reduction " << *store << " may alias another access\n");
+			continue;
+		}
+		res.push_back({store, load, update, kind, *element});
+	}
+	NumReductions += res.size();
+	return res;
+}
+
+bool PolytopePass::IsReductionAccess(const Instruction* I) const {
+	return std::any_of(reductions.begin(), reductions.end(), [&](auto& reduction) {
+		return reduction.store == I || reduction.load == I;
+	});
+}
+
+/* Describes everything the search depends on - access functions, the shape of the bounds and the pass options - so
+ * that nests with equal descriptions receive the same decision */
+std::string PolytopePass::CanonicalNest(const LoopDependencies& assignment) {
+	std::string res;
+	raw_string_ostream os(res);
+	auto printAccesses = [&os](StringRef name, const std::vector<std::vector<std::vector<int>>>& accesses) {
+		os << name << ":";
+		for (auto& access: accesses) {
+			os << "[" << MatrixToString(access) << "]";
+		}
+		os << ";";
+	};
+	printAccesses("writes", assignment.writes);
+	printAccesses("reads", assignment.reads);
+	if (!assignment.reductions.empty()) {
+		printAccesses("reductions", assignment.reductions);
+	}
+
+	os << "bounds:";
+	for (auto& IV: IVList) {
+		os << "(" << IV.IV->getType()->getIntegerBitWidth() << (isa<ConstantInt>(IV.init) ? " c" : " v")
+		   << (isa<ConstantInt>(IV.final) ? " c" : " v") << (IV.exclusive ? "< " : " ");
+		if (auto* step = dyn_cast_or_null<ConstantInt>(IV.step)) {
+			os << step->getSExtValue();
+		} else {
+			os << "v";
+		}
+		os << ")";
+	}
+	/* The legality of transforms of other accesses depends on the domain they are replayed over */
+	if (!UniformDependenceDistances(assignment)) {
+		if (auto bounds = GetConstantBounds()) {
+			for (auto [lower, upper]: *bounds) {
+				os << "[" << lower << "," << upper << "]";
+			}
+		}
+	}
+	os << ";options:depth=" << searchDepth << ";";
+	if (RankCandidates > 1) {
+		os << "rank=" << RankCandidates << "," << CacheHierarchy << "," << SampleExtent << ",";
+		if (layout) {
+			os << layout->rowLength << "x" << layout->elementSize;
+		}
+		if (auto bounds = GetConstantBounds()) {
+			for (auto [lower, upper]: *bounds) {
+				os << "[" << lower << "," << upper << "]";
+			}
+		} else {
+			for (auto tripCount: profile.tripCounts) {
+				os << "[" << tripCount.value_or(0) << "]";
+			}
+		}
+		os << ";";
+	}
+	return os.str();
+}
+
+/* Codegen runs y = T x, so an index function f of x is T^-T f of y, and the equations then ask whether the inner loop
+ * of the generated nest carries a dependence. Returns nothing when T is not unimodular. */
+std::optional<LoopDependencies>
+PolytopePass::TransformAssignment(const LoopDependencies& assignment, const std::vector<std::vector<int>>& transform) {
+	std::vector<std::vector<std::vector<int>>> writeVectors;
+	std::vector<std::vector<std::vector<int>>> readVectors;
+
+	auto inverse = IntegerSolver::InverseTranspose(transform);
+	if (!inverse) {
+		return {};
+	}
+	std::vector<std::vector<int>> transform1;
+	for (auto& row: *inverse) {
+		auto v = row;
+		v.push_back(0);
+		transform1.push_back(v);
+	}
+	transform1.emplace_back(transform1.at(0).size(), 0);
+	transform1.back().back() = 1;
+
+	for (auto& write: assignment.writes) {
+		std::vector<std::vector<int>> v;
+		v.reserve(write.size());
+		for (auto& writeIndex: write) {
+			v.push_back(IntegerSolver::LinearTransform(transform1, writeIndex));
+		}
+		writeVectors.push_back(v);
+	}
+
+	/* Can this be done with a single matrix multiplication? */
+	for (auto& readVector: assignment.reads) {
+		std::vector<std::vector<int>> v;
+		v.reserve(readVector.size());
+		for (auto& readIndex: readVector) {
+			v.push_back(IntegerSolver::LinearTransform(transform1, readIndex));
+		}
+		readVectors.push_back(v);
+	}
+
+	return LoopDependencies(writeVectors, readVectors);
+}
+
+/* A transform is legal when the generated nest runs the source of every dependence before its sink, and, as codegen
+ * marks the inner loop parallel, in an earlier iteration of the outer loop: every distance d, taken from the iteration
+ * the original nest runs first, is lexicographically positive once transformed, and T d > 0 in its first component.
+ * The transformed equations check that no two different accesses meet within an iteration of p, and
+ * InnerLoopRepeatsElement that no write touches one element throughout it. The order is then checked on the
+ * distances of uniform accesses, or, for other accesses, by replaying a nest with constant bounds of at most
+ * MaxReplayedIterations; any other nest has no legal transform. */
+bool PolytopePass::IsLegalTransform(const LoopDependencies& assignment, const std::vector<std::vector<int>>& transform) {
+	auto transformed = TransformAssignment(assignment, transform);
+	if (!transformed) {
+		return false;
+	}
+	auto test = transformed->TestLoopCarrierDependencies();
+	NumSolverCalls += test.solverCalls;
+	NumSolverSolutions += test.solverSolutions;
+	if (test.carried || InnerLoopRepeatsElement(assignment, transform)) {
+		return false;
+	}
+	if (auto distances = UniformDependenceDistances(assignment)) {
+		for (auto [d0, d1]: *distances) {
+			if (d0 < 0 || (d0 == 0 && d1 < 0)) {
+				d0 = -d0;
+				d1 = -d1;
+			}
+			long dp = transform[0][0] * d0 + transform[0][1] * d1;
+			long dq = transform[1][0] * d0 + transform[1][1] * d1;
+			if ((d0 || d1) && (dp < 0 || (dp == 0 && dq <= 0))) {
+				return false;
+			}
+		}
+		return true;
+	}
+	auto bounds = GetConstantBounds();
+	if (!bounds) {
+		return false;
+	}
+	ScheduleVerifier verifier(assignment, *bounds);
+	if (verifier.Iterations() > MaxReplayedIterations) {
+		return false;
+	}
+	NumReplayedTransforms++;
+	return !verifier.Verify(transform);
+}
+
+std::optional<std::vector<std::vector<int>>>
+PolytopePass::ComputeAffineTransformationInner(const LoopDependencies& assignment,
+											   const std::vector<std::vector<int>>& genA,
+											   const std::vector<std::vector<int>>& genB,
+											   const std::vector<std::vector<int>>& transform,
+											   int depth) {
+	NumSearchNodes++;
+	if (IsLegalTransform(assignment, transform)) {
+		auto applications = searchDepth - depth;
+		(*FoundAtDepth[std::min(applications, 5u)])++;
+		if (CandidateLimit() <= 1) {
+			return transform;
+		}
+		/* Keep searching until enough candidates are collected for ranking or autotuning */
+		if (std::find(candidates.begin(), candidates.end(), transform) == candidates.end()) {
+			candidates.push_back(transform);
+		}
+		if (candidates.size() >= CandidateLimit()) {
+			return transform;
+		}
+	}
+	if (depth == 0) {
+		return {};
+	}
+	depth--;
+
+	auto transform1 = ComputeAffineTransformationInner(assignment, genA, genB, IntegerSolver::Multiply(genA, transform),
+													   depth);
+	if (transform1) {
+		return transform1;
+	}
+
+	auto transform2 = ComputeAffineTransformationInner(assignment, genA, genB, IntegerSolver::Multiply(genB, transform),
+													   depth);
+	return transform2;
+}
+
+std::optional<std::vector<std::vector<int>>>
+PolytopePass::ComputeAffineTransformation(const LoopDependencies& assignment) {
+	unsigned dim = IVList.size();
+
+	if (assignment.HasCacheMisses() && IsLegalTransform(assignment, IntegerSolver::GetInitialTransform(dim))) {
+		NumInterchangeTier++;
+		return IntegerSolver::GetInitialTransform(dim);
+	}
+
+	auto test = assignment.TestLoopCarrierDependencies();
+	NumSolverCalls += test.solverCalls;
+	NumSolverSolutions += test.solverSolutions;
+	if (!test.carried && !assignment.reductions.empty()) {
+		/* Only the reductions carry dependences, so the nest keeps its order and just accumulates in registers */
+		NumReductionTier++;
+		return IntegerSolver::IdentityMatrix(dim);
+	}
+	if (!test.carried) {
+		NumDependenceTier++;
+		rejection = Rejection::NoDependencies;
+		return {};
+	}
+	NumSearchTier++;
+
+	auto T = IntegerSolver::GetInitialTransform(dim);
+	auto generators = IntegerSolver::GetGenerators(dim);
+	candidateAssignment = &assignment;
+	auto transform = ComputeAffineTransformationInner(assignment, generators.first, generators.second,
+													  T, (int) searchDepth);
+	if (!candidates.empty()) {
+		transform = RankCandidates > 1 ? RankByCacheMisses() : candidates.front();
+	}
+	if (Autotune) {
+		alternatives = candidates;
+	}
+	candidates.clear();
+	if (!transform) {
+		rejection = Rejection::NoTransformInBudget;
+	}
+	return transform;
+}
+
+/* Simulates each collected candidate on a sample of the iteration domain and returns the cheapest, keeping the first
+ * found on ties */
+std::optional<std::vector<std::vector<int>>> PolytopePass::RankByCacheMisses() {
+	auto levels = CacheSimulator::ParseHierarchy(CacheHierarchy).value_or(CacheSimulator::DefaultHierarchy());
+	std::vector<std::pair<int, int>> bounds;
+	if (auto constant = GetConstantBounds()) {
+		bounds = CacheSimulator::SampleDomain(*constant, (int) SampleExtent);
+	} else {
+		/* Symbolic bounds: simulate the profiled trip counts where known */
+		for (size_t d = 0; d < IVList.size(); d++) {
+			auto tripCount = d < profile.tripCounts.size() ? profile.tripCounts[d] : std::nullopt;
+			auto extent = std::min(tripCount.value_or(SampleExtent), (unsigned) SampleExtent);
+			bounds.emplace_back(0, (int) std::max(extent, 1u) - 1);
+		}
+	}
+	auto arrayLayout = layout.value_or(ArrayLayout{1024, 4});
+
+	NumRankedNests++;
+	std::optional<std::vector<std::vector<int>>> best;
+	double bestCost = 0;
+	double bestReuse = 0;
+	for (auto& candidate: candidates) {
+		auto stats = CacheSimulator::SimulateNest(*candidateAssignment, bounds, candidate, arrayLayout, levels);
+		LLVM_DEBUG(dbgs() << "Candidate " << MatrixToString(candidate) << ": cost " << stats.Cost()
+						  << ", mean reuse distance " << stats.meanReuseDistance << "\n");
+		ranking.push_back({candidate, stats});
+		/* Ties, eg. when the sample fits in cache, go to the shorter mean reuse distance */
+		if (!best || stats.Cost() < bestCost ||
+			(stats.Cost() == bestCost && stats.meanReuseDistance < bestReuse)) {
+			best = candidate;
+			bestCost = stats.Cost();
+			bestReuse = stats.meanReuseDistance;
+		}
+	}
+	if (*best != candidates.front()) {
+		NumRankChanged++;
+	}
+	return best;
+}
+
+NestReport PolytopePass::AnalyzeNest(Loop& L, LoopStandardAnalysisResults& AR, ProfileInfo profileInfo) {
+	NestReport report;
+	report.assignment = TimePhase("PolytopeAnalysis", report.times.analysis, [&]() { return RunAnalysis(L, AR); });
+	if (!L.getSubLoops().empty()) {
+		NumNestsSeen++;
+	}
+	if (!report.assignment) {
+		CountRejection();
+		report.rejection = rejection;
+		return report;
+	}
+
+	profile = GetNestProfile(profileInfo);
+	report.profile = profile;
+	auto innerTripCount = profile.tripCounts.empty() ? std::nullopt : profile.tripCounts.back();
+	if ((SkipCold && profile.cold) || (innerTripCount && *innerTripCount < MinTripCount)) {
+		rejection = profile.cold && SkipCold ? Rejection::ColdNest : Rejection::ShortTripCount;
+		LLVM_DEBUG(dbgs() << "Skipping nest: " << RejectionReason(rejection) << "\n");
+		CountRejection();
+		report.rejection = rejection;
+		return report;
+	}
+	searchDepth = SearchDepth;
+	if (profile.hot && HotSearchDepth > SearchDepth) {
+		NumHotNests++;
+		searchDepth = HotSearchDepth;
+	}
+
+	std::string cacheKey;
+	std::optional<CachedDecision> cached;
+	if (!CacheDir.empty()) {
+		cacheKey = TransformCache::Key(CanonicalNest(*report.assignment));
+		cached = TransformCache(CacheDir).Lookup(cacheKey);
+	}
+
+	if (cached) {
+		NumCacheHits++;
+		report.transform = cached->transform;
+		rejection = cached->rejection;
+	} else {
+		ranking.clear();
+		alternatives.clear();
+		report.transform = TimePhase("PolytopeSearch", report.times.search,
+									 [&]() { return ComputeAffineTransformation(*report.assignment); });
+		report.ranking = std::move(ranking);
+		report.alternatives = std::move(alternatives);
+		ranking.clear();
+		alternatives.clear();
+		if (!CacheDir.empty()) {
+			NumCacheMisses++;
+			TransformCache(CacheDir).Store(cacheKey, {report.transform, rejection});
+		}
+	}
+	report.bounds = GetConstantBounds();
+	if (VerifySchedule && report.transform && report.bounds) {
+		ScheduleVerifier verifier(*report.assignment, *report.bounds);
+		if (auto violation = verifier.Verify(*report.transform)) {
+			LLVM_DEBUG(dbgs() << "Transform " << MatrixToString(*report.transform) << " reverses " << violation->kind
+							  << " dependence from " << MatrixToString({violation->source}) << " to "
+							  << MatrixToString({violation->sink}) << "\n");
+			report.transform = {};
+			rejection = Rejection::IllegalSchedule;
+		}
+	}
+	/* A nest whose inner loop carries no dependence keeps its order, but may still run in tiles */
+	if (!report.transform && rejection == Rejection::NoDependencies && !Tile.empty() && !Autotune &&
+		!InstrumentControl) {
+		report.transform = IntegerSolver::IdentityMatrix(2);
+		report.tiles = ChooseTiles(report);
+		if (report.tiles.empty()) {
+			report.transform = {};
+		} else {
+			rejection = Rejection::None;
+		}
+	}
+	if (!report.transform) {
+		LLVM_DEBUG(dbgs() << "No transformation found\n");
+		CountRejection();
+	}
+	report.rejection = rejection;
+	return report;
+}
+
+/* Reads the hotness and execution count of the inner loop body from the profile, and the average trip count of each
+ * loop from the branch weights on its latch */
+NestProfile PolytopePass::GetNestProfile(ProfileInfo profileInfo) {
+	NestProfile res;
+	auto* body = innerLoop->getHeader();
+	if (profileInfo.BFI) {
+		if (auto count = profileInfo.BFI->getBlockProfileCount(body)) {
+			res.count = *count;
+		}
+		if (profileInfo.PSI && profileInfo.PSI->hasProfileSummary()) {
+			res.hot = profileInfo.PSI->isHotBlock(body, profileInfo.BFI);
+			res.cold = profileInfo.PSI->isColdBlock(body, profileInfo.BFI);
+		}
+	}
+	for (auto& IV: IVList) {
+		auto tripCount = getLoopEstimatedTripCount(IV.loop);
+		res.tripCounts.push_back(tripCount ? std::optional<unsigned>(*tripCount) : std::nullopt);
+	}
+	return res;
+}
+
+std::optional<std::vector<std::pair<int, int>>> PolytopePass::GetConstantBounds() {
+	std::vector<std::pair<int, int>> bounds;
+	for (auto& IV: IVList) {
+		auto* init = dyn_cast_or_null<ConstantInt>(IV.init);
+		auto* final = dyn_cast_or_null<ConstantInt>(IV.final);
+		auto* step = dyn_cast_or_null<ConstantInt>(IV.step);
+		/* Bounds of 64-bit induction variables beyond int are left to the symbolic paths */
+		if (!init || !final || !step || !step->isOne() || !isInt<32>(init->getSExtValue()) ||
+			!isInt<32>(final->getSExtValue() - IV.exclusive)) {
+			return {};
+		}
+		bounds.emplace_back(init->getSExtValue(), final->getSExtValue() - IV.exclusive);
+	}
+	return bounds;
+}
+
+PreservedAnalyses PolytopePass::run(Loop& L, LoopAnalysisManager& AM, LoopStandardAnalysisResults& AR, LPMUpdater& U) {
+	/* A nest generated by this pass comes back once the loops added inside it have been visited */
+	if (getBooleanLoopAttribute(&L, "polytope.transformed")) {
+		return PreservedAnalyses::all();
+	}
+	/* Block frequencies are only available when the loop adaptor computes them, as with the function pass form of
+	 * polytope, and the profile summary when an earlier require<profile-summary> has computed it */
+	ProfileInfo profileInfo;
+	auto& F = *L.getHeader()->getParent();
+	auto& FAMProxy = AM.getResult<FunctionAnalysisManagerLoopProxy>(L, AR);
+	profileInfo.BFI = AR.BFI;
+	if (auto* MAMProxy = FAMProxy.getCachedResult<ModuleAnalysisManagerFunctionProxy>(F)) {
+		profileInfo.PSI = MAMProxy->getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+	}
+	NestDistribution distribution;
+	if (Distribute) {
+		distribution = DistributeNest(L, AR);
+	}
+	/* A fused nest is transformed here in place of this one, and like a distributed nest it is only kept when it is
+	 * transformed; otherwise this nest is analysed on its own */
+	NestFusion fusion;
+	if (Fuse) {
+		fusion = FuseNest(L, AR);
+	}
+	NestReport report;
+	if (fusion.fused) {
+		report = AnalyzeNest(*fusion.nest, AR, profileInfo);
+		if (!report.transform) {
+			UndoFusion(L, fusion, AR);
+			fusion = {};
+		}
+	}
+	if (!fusion.fused) {
+		report = AnalyzeNest(L, AR, profileInfo);
+	}
+	/* A distributed nest that is not transformed would only run slower, so it gets its statements back */
+	if (!report.transform) {
+		UndoDistribution(L, AR);
+		EmitRemarks(L, report);
+		return PreservedAnalyses::all();
+	}
+	CommitDistribution(distribution);
+	report.distribution = distribution;
+	/* Fusion may delete this nest, so only the one transformed is used from here on */
+	Loop& nest = fusion.fused ? *fusion.nest : L;
+	if (fusion.fused) {
+		CommitFusion(L, fusion, AR, U);
+	}
+	if (InstrumentControl) {
+		InstrumentNest(nest, report, "control");
+		return PreservedAnalyses::none();
+	}
+
+	if (Autotune) {
+		if (Instrument) {
+			InstrumentNest(nest, report, "autotuned");
+		}
+		vectorWidth = 0;
+		if (TimePhase("PolytopeCodegen", report.times.codegen, [&]() { return EmitVariants(nest, report, AR, U); })) {
+			report.vectorWidth = vectorWidth;
+			report.privatisedReductions = privatisedReductions;
+			NumAutotuned++;
+			NumTransformed++;
+			EmitRemarks(nest, report);
+			return PreservedAnalyses::none();
+		}
+		LLVM_DEBUG(dbgs() << "Nest cannot be cloned for autotuning, transforming it in place\n");
+	}
+
+	/* Skews the transform when the tiles need it, so it is chosen before codegen */
+	if (!Tile.empty() && report.tiles.empty()) {
+		report.tiles = ChooseTiles(report);
+	}
+	vectorWidth = 0;
+	vectorLoop = nullptr;
+	TimePhase("PolytopeCodegen", report.times.codegen, [&]() {
+		/* Rewrites the accesses before codegen, so that the vector loop widens the rewritten ones */
+		outerIVArguments.clear();
+		if (SkewLayout || Contract) {
+			report.skewedLayout = EmitSkewedLayout(nest, report, AR);
+		}
+		/* A nest running on a skewed copy no longer touches the array */
+		if (OutOfCore && !(report.skewedLayout && report.skewedLayout->applied)) {
+			report.outOfCoreBand = EmitOutOfCore(nest, report, AR);
+		}
+		/* Taken before codegen rewrites the indices, and only for accesses still on the original array */
+		std::vector<AccessFunction> accesses;
+		if ((PrefetchDistance || UnrollJam > 1 || ScalarReplace) &&
+			!(report.skewedLayout && report.skewedLayout->applied)) {
+			accesses = AccessFunctions();
+		}
+		GenerateTransformedNest(*report.transform, *report.assignment, AR, report.tiles);
+		report.privatisedReductions = privatisedReductions;
+		/* The scalar loop only runs the last iterations of a vector loop */
+		if (!vectorWidth && PrefetchDistance) {
+			report.prefetches = EmitPrefetches(AccessStrides(accesses, *report.transform), AR);
+		}
+		/* After the prefetches, so that every copy prefetches its own streams. The copies of a tiled nest would run
+		 * past the rows of their tile. */
+		if (!vectorWidth && UnrollJam > 1 && report.tiles.empty()) {
+			report.unrollJam = EmitUnrollAndJam(report, accesses, report.forwardedLoads, AR);
+		}
+		/* Unroll and jam already forwards the reuse between the copies it jams, and its guarded copies leave no single
+		 * block body to rotate values through */
+		if (!vectorWidth && ScalarReplace && report.unrollJam < 2) {
+			report.scalarReplaced = EmitScalarReplacement(*report.transform, accesses, AR);
+		}
+		for (auto [call, operand, offset]: outerIVArguments) {
+			IRBuilder builder(call);
+			call->setArgOperand(operand, builder.CreateAdd(builder.CreateSExt(outerPhi, builder.getInt64Ty()),
+														   builder.getInt64(offset)));
+		}
+		return true;
+	});
+	report.vectorWidth = vectorWidth;
+	/* The loop pass manager only takes new loops inside the loop it runs on */
+	if (vectorLoop && &nest == &L) {
+		U.addChildLoops({vectorLoop});
+	}
+	NumTransformed++;
+	if (Instrument && !Autotune) {
+		InstrumentNest(nest, report, "transformed");
+	}
+
+	LLVM_DEBUG({
+		dbgs() << "================================\n";
+		if (*report.transform == IntegerSolver::GetInitialTransform(IVList.size())) {
+			dbgs() << "Performed loop interchange\n";
+		} else {
+			dbgs() << "Performed polytope optimisation\n";
+			PrintTransform(*report.transform);
+		}
+		dbgs() << "================================\n";
+	});
+	EmitRemarks(nest, report);
+
+	return PreservedAnalyses::none();
+}
+
+void PolytopePass::GenerateTransformedNest(const std::vector<std::vector<int>>& T, const LoopDependencies& assignment,
+										   LoopStandardAnalysisResults& AR, const std::vector<int>& tiles) {
+	auto H = IntegerSolver::HermiteNormal(T);
+	auto det = IntegerSolver::Det(T);
+
+	auto outerBounds = outerLoop->getBounds(AR.SE).getValue();
+	auto innerBounds = innerLoop->getBounds(AR.SE).getValue();
+
+	Module* M = outerLoop->getHeader()->getModule();
+	/* Bounds and constants take the type of the induction variables, which may be wider than int */
+	auto IVTy = cast<IntegerType>(outerLoop->getInductionVariable(AR.SE)->getType());
+	ivType = IVTy;
+	/* Reuse the intrinsic declarations if an earlier nest in the module already created them */
+	Function* minFunc = Intrinsic::getDeclaration(M, Intrinsic::smin, {IVTy});
+	Function* maxFunc = Intrinsic::getDeclaration(M, Intrinsic::smax, {IVTy});
+	/* Bounds that leave the other operand of the smax or smin as it is */
+	auto* minValue = ConstantInt::get(IVTy, APInt::getSignedMinValue(IVTy->getBitWidth()));
+	auto* maxValue = ConstantInt::get(IVTy, APInt::getSignedMaxValue(IVTy->getBitWidth()));
+
+	/* Extract redundant IV instructions */
+	auto oldOuterIV = outerLoop->getInductionVariable(AR.SE);
+	auto oldInnerIV = innerLoop->getInductionVariable(AR.SE);
+	auto oldOuterComparison = outerLoop->getLatchCmpInst();
+	auto oldInnerComparison = innerLoop->getLatchCmpInst();
+	/* Retrieve increment instructions by analysing comparison */
+	auto oldOuterIncrement = cast<Instruction>(oldOuterIV->getIncomingValueForBlock(outerLoop->getLoopLatch()));
+	auto oldInnerIncrement = cast<Instruction>(oldInnerIV->getIncomingValueForBlock(innerLoop->getLoopLatch()));
+	auto oldOuterBranch = FindInstr(Instruction::Br, outerLoop->getLoopLatch()).value();
+	auto oldInnerBranch = FindInstr(Instruction::Br, innerLoop->getLoopLatch()).value();
+
+	/* The bounds of p are invariant, and computed in the preheader so that the whole nest can use them, from the last
+	 * value of each induction variable */
+	IRBuilder builder(outerLoop->getLoopPreheader()->getTerminator());
+	auto last = [&](const Loop::LoopBounds& bounds, const Twine& name) {
+		auto* final = &bounds.getFinalIVValue();
+		return *ExclusiveFinalValue(bounds) ? builder.CreateSub(final, ConstantInt::get(final->getType(), 1), name)
+											: final;
+	};
+	auto* outerLast = last(outerBounds, "i.last");
+	auto* innerLast = last(innerBounds, "j.last");
+	auto LL = std::make_tuple<>(&outerBounds.getInitialIVValue(), &innerBounds.getInitialIVValue());
+	auto LR = std::make_tuple<>(outerLast, &innerBounds.getInitialIVValue());
+	auto UL = std::make_tuple<>(&outerBounds.getInitialIVValue(), innerLast);
+	auto UR = std::make_tuple<>(outerLast, innerLast);
+
+	std::tuple<Value*, Value*> outerLBPoint;
+	std::tuple<Value*, Value*> outerUBPoint;
+	std::tuple<Value*, Value*> innerLBPoint;
+	std::tuple<Value*, Value*> innerUBPoint;
+	if (T[0][0] > 0 && T[0][1] > 0) {
+		outerLBPoint = LL;
+		outerUBPoint = UR;
+		if (det > 0) {
+			innerLBPoint = LR;
+			innerUBPoint = UL;
+		} else {
+			innerLBPoint = UL;
+			innerUBPoint = LR;
+		}
+	} else if (T[0][0] <= 0 && T[0][1] > 0) {
+		outerLBPoint = LR;
+		outerUBPoint = UL;
+		if (det > 0) {
+			innerLBPoint = UR;
+			innerUBPoint = LL;
+		} else {
+			innerLBPoint = LL;
+			innerUBPoint = UR;
+		}
+	} else if (T[0][0] > 0 && T[0][1] <= 0) {
+		outerLBPoint = UL;
+		outerUBPoint = LR;
+		if (det > 0) {
+			innerLBPoint = LL;
+			innerUBPoint = UR;
+		} else {
+			innerLBPoint = UR;
+			innerUBPoint = LL;
+		}
+	} else {
+		outerLBPoint = UR;
+		outerUBPoint = LL;
+		if (det > 0) {
+			innerLBPoint = UL;
+			innerUBPoint = LR;
+		} else {
+			innerLBPoint = LR;
+			innerUBPoint = UL;
+		}
+	}
+
+	auto outerLowerBound = builder.CreateAdd(
+			builder.CreateMul(IntToValue(T[0][0]), std::get<0>(outerLBPoint)),
+			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(outerLBPoint)), "p.lower");
+	auto outerUpperBound = builder.CreateAdd(
+			builder.CreateMul(IntToValue(T[0][0]), std::get<0>(outerUBPoint)),
+			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(outerUBPoint)), "p.upper");
+	outerUpper = outerUpperBound;
+
+	/* Update outer loop header */
+	builder.SetInsertPoint(outerLoop->getHeader()->getFirstNonPHI());
+	auto outerIV = builder.CreatePHI(IVTy, 2, "p");
+	outerPhi = outerIV;
+
+	/* Update outer loop latch */
+	builder.SetInsertPoint(outerLoop->getLoopLatch()->getTerminator());
+	auto outerIncrement = builder.CreateAdd(outerIV, IntToValue(H[0][0]), "p.inc");
+	outerIV->addIncoming(outerLowerBound, outerLoop->getLoopPreheader());
+	outerIV->addIncoming(outerIncrement, outerLoop->getLoopLatch());
+	auto outerComp = builder.CreateCmp(CmpInst::ICMP_SLE, outerIncrement, outerUpperBound);
+	auto outerBranch = builder.CreateCondBr(outerComp, outerLoop->getHeader(), outerLoop->getExitBlock());
+
+	/* Determine values for inner loop bounds */
+	builder.SetInsertPoint(innerLoop->getLoopPreheader()->getTerminator());
+
+	auto l1 = builder.CreateSub(
+			builder.CreateSub(outerIV, builder.CreateMul(IntToValue(T[0][0]), std::get<0>(innerLBPoint))),
+			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(innerLBPoint)), "l1");
+
+	/* Division by a non-zero constant rounded down or up; sdiv truncates towards zero, which rounds negative
+	 * quotients the wrong way */
+	auto floorDiv = [&](Value* n, int d) -> Value* {
+		if (d < 0) {
+			n = builder.CreateNeg(n);
+			d = -d;
+		}
+		auto remainder = builder.CreateSRem(n, IntToValue(d));
+		return builder.CreateSub(builder.CreateSDiv(n, IntToValue(d)),
+								 builder.CreateZExt(builder.CreateICmpSLT(remainder, IntToValue(0)), IVTy));
+	};
+	auto ceilDiv = [&](Value* n, int d) -> Value* {
+		if (d < 0) {
+			n = builder.CreateNeg(n);
+			d = -d;
+		}
+		auto remainder = builder.CreateSRem(n, IntToValue(d));
+		return builder.CreateAdd(builder.CreateSDiv(n, IntToValue(d)),
+								 builder.CreateZExt(builder.CreateICmpSGT(remainder, IntToValue(0)), IVTy));
+	};
+
+	// TODO: Change the check for zero to remove the zero division entirely
+	auto l1Ceil = builder.CreateAdd(
+		builder.CreateCall(maxFunc, {
+			(T[0][0] == 0) ? minValue : ceilDiv(builder.CreateMul(IntToValue(T[1][0]), l1), T[0][0]),
+			(T[0][1] == 0) ? minValue : ceilDiv(builder.CreateMul(IntToValue(T[1][1]), l1), T[0][1])
+		}),
+		builder.CreateAdd(
+			builder.CreateMul(IntToValue(T[1][0]), std::get<0>(innerLBPoint)),
+			builder.CreateMul(IntToValue(T[1][1]), std::get<1>(innerLBPoint))
+		),
+		"l1.ceil"
+	);
+
+	auto l3 = builder.CreateSub(
+			builder.CreateSub(outerIV, builder.CreateMul(IntToValue(T[0][0]), std::get<0>(innerUBPoint))),
+			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(innerUBPoint)), "l3");
+
+	/* Upper bound for inner loop */
+	// TODO: Change the check for zero to remove the zero division entirely
+	auto innerUpperBound = builder.CreateAdd(
+			builder.CreateCall(minFunc, {
+				(T[0][0] == 0) ? maxValue : floorDiv(builder.CreateMul(IntToValue(T[1][0]), l3), T[0][0]),
+				(T[0][1] == 0) ? maxValue : floorDiv(builder.CreateMul(IntToValue(T[1][1]), l3), T[0][1])
+			}),
+			builder.CreateAdd(
+				builder.CreateMul(IntToValue(T[1][0]), std::get<0>(innerUBPoint)),
+				builder.CreateMul(IntToValue(T[1][1]), std::get<1>(innerUBPoint))
+			),
+		"q.upper"
+	);
+
+	/* Distance from the lower bound to the next q on the lattice of transformed points, which must not be negative */
+	auto offset = builder.CreateSub(
+		builder.CreateMul(
+			IntToValue(H[1][0]),
+			builder.CreateSDiv(outerIV, IntToValue(H[0][0]))
+		),
+		l1Ceil
+	);
+	offset = builder.CreateSub(offset, builder.CreateMul(floorDiv(offset, H[1][1]), IntToValue(H[1][1])), "offset");
+
+	/* Update inner loop header */
+	builder.SetInsertPoint(innerLoop->getLoopPreheader()->getTerminator());
+	auto innerLowerBound = builder.CreateAdd(l1Ceil, offset, "q.lower");
+	builder.SetInsertPoint(innerLoop->getHeader()->getFirstNonPHI());
+	auto innerIV = builder.CreatePHI(IVTy, 2, "q");
+	innerPhi = innerIV;
+	innerLower = innerLowerBound;
+	innerUpper = innerUpperBound;
+	innerGuard = nullptr;
+	auto iNew = builder.CreateSDiv(
+				builder.CreateSub(
+					builder.CreateMul(
+						IntToValue(T[1][1]),
+						outerIV
+					),
+					builder.CreateMul(
+						IntToValue(T[0][1]),
+						innerIV
+					)
+				),
+				IntToValue(T[0][0] * T[1][1] - T[0][1] * T[1][0]),
+				"i.new"
+		   );
+	auto jNew = builder.CreateSDiv(
+					builder.CreateSub(
+						builder.CreateMul(
+							IntToValue(T[0][0]),
+							innerIV
+						),
+						builder.CreateMul(
+							IntToValue(T[1][0]),
+							outerIV
+						)
+					),
+				   	IntToValue(T[0][0] * T[1][1] - T[0][1] * T[1][0]),
+				   	"j.new"
+			   );
+
+	/* Update inner loop latch */
+	builder.SetInsertPoint(innerLoop->getLoopLatch()->getTerminator());
+	auto innerIncrement = builder.CreateAdd(innerIV, IntToValue(H[1][1]), "q.inc");
+	innerIV->addIncoming(innerLowerBound, innerLoop->getLoopPreheader());
+	innerIV->addIncoming(innerIncrement, innerLoop->getLoopLatch());
+
+	auto innerComp = builder.CreateCmp(CmpInst::ICMP_SLE, innerIncrement, innerUpperBound);
+	auto innerBranch = builder.CreateCondBr(innerComp, innerLoop->getHeader(), innerLoop->getExitBlock());
+
+
+	/* Clean up old induction variables */
+	oldOuterIV->replaceAllUsesWith(iNew);
+	oldInnerIV->replaceAllUsesWith(jNew);
+
+	oldOuterIV->eraseFromParent();
+	oldOuterIncrement->eraseFromParent();
+	oldOuterBranch->eraseFromParent();
+	oldOuterComparison->eraseFromParent();
+
+	oldInnerIV->eraseFromParent();
+	oldInnerIncrement->eraseFromParent();
+	oldInnerBranch->eraseFromParent();
+	oldInnerComparison->eraseFromParent();
+
+	if (!tiles.empty()) {
+		/* The range of q over the whole domain, from the corners that minimise and maximise each term of T1 x */
+		builder.SetInsertPoint(outerLoop->getLoopPreheader()->getTerminator());
+		auto* i0 = &outerBounds.getInitialIVValue();
+		auto* i1 = outerLast;
+		auto* j0 = &innerBounds.getInitialIVValue();
+		auto* j1 = innerLast;
+		auto qMin = builder.CreateAdd(builder.CreateMul(IntToValue(T[1][0]), T[1][0] >= 0 ? i0 : i1),
+									  builder.CreateMul(IntToValue(T[1][1]), T[1][1] >= 0 ? j0 : j1), "q.min");
+		auto qMax = builder.CreateAdd(builder.CreateMul(IntToValue(T[1][0]), T[1][0] >= 0 ? i1 : i0),
+									  builder.CreateMul(IntToValue(T[1][1]), T[1][1] >= 0 ? j1 : j0), "q.max");
+		auto* tileColumn = EmitTileLoops(tiles, outerLowerBound, outerUpperBound, qMin, qMax,
+										 cast<Instruction>(outerComp), AR);
+		/* Only the points of the current tile; tiles are only made for unimodular T, whose q step by one */
+		builder.SetInsertPoint(innerLoop->getLoopPreheader()->getTerminator());
+		auto* lower = builder.CreateCall(maxFunc, {innerLowerBound, tileColumn}, "q.lower.tile");
+		auto* upper = builder.CreateCall(
+				minFunc, {innerUpperBound, builder.CreateAdd(tileColumn, IntToValue(tiles[1] - 1))}, "q.upper.tile");
+		innerIV->setIncomingValueForBlock(innerLoop->getLoopPreheader(), lower);
+		cast<Instruction>(innerComp)->replaceUsesOfWith(innerUpperBound, upper);
+		innerLowerBound = lower;
+		innerUpperBound = upper;
+		innerLower = lower;
+		innerUpper = upper;
+	}
+
+	/* Marks the nest as generated, so that it is not analysed again when the loop pass manager revisits it */
+	addStringMetadataToLoop(outerLoop, "polytope.transformed", 1);
+	addStringMetadataToLoop(innerLoop, "llvm.loop.parallel_accesses");
+	addStringMetadataToLoop(innerLoop, "llvm.mem.parallel_loop_access");
+	addStringMetadataToLoop(innerLoop, "llvm.loop.vectorize.enable");
+
+	/* The inner loop is bottom-tested, but when the rows of T are not unit vectors some values of p have no
+	 * points inside the domain, so skip the inner loop when its bounds are empty. IsPerfectNest leaves the exit no
+	 * phis of values computed in the inner loop, so the ones it has take the same value on the guard edge. The exit
+	 * then gets a block of its own, to keep the exit of the inner loop dedicated. */
+	auto* guard = innerLoop->getLoopPreheader();
+	auto* innerExit = innerLoop->getExitBlock();
+	auto* exiting = innerLoop->getExitingBlock();
+	if (guard && innerExit && exiting) {
+		SplitEdge(guard, innerLoop->getHeader(), &AR.DT, &AR.LI);
+		auto* newPreheader = guard->getTerminator()->getSuccessor(0);
+		builder.SetInsertPoint(guard->getTerminator());
+		innerGuard = builder.CreateCondBr(builder.CreateICmpSLE(innerLowerBound, innerUpperBound, "q.nonempty"),
+										  newPreheader, innerExit);
+		guard->getTerminator()->eraseFromParent();
+		for (auto& phi: innerExit->phis()) {
+			phi.addIncoming(phi.getIncomingValueForBlock(exiting), guard);
+		}
+		AR.DT.changeImmediateDominator(innerExit, guard);
+		formDedicatedExitBlocks(innerLoop, &AR.DT, &AR.LI, nullptr, true);
+	}
+	/* The vector loop widens the accumulators into one partial result per lane; a reduction updating the same element
+	 * from every lane in memory would lose updates */
+	bool privatised = true;
+	privatisedReductions = PrivatiseReductions(T, privatised, AR);
+	/* Searched transforms never leave a dependence on the inner loop, but the interchange and the identity of
+	 * reductions and tiles are not searched */
+	auto transformed = TransformAssignment(assignment, T);
+	if (innerGuard && Simd && privatised && transformed && !transformed->HasLoopCarrierDependencies()) {
+		vectorWidth = EmitVectorInnerLoop(innerIV, innerLowerBound, innerUpperBound, H[1][1], AR);
+	}
+}
+
+/* Wraps the outer loop of the nest being generated in a loop over rows of tiles, each tiles[0] values of p starting
+ * at PT, and inside it a loop over the tiles of the row, each tiles[1] values of q starting at QT. The tiles are aligned
+ * on multiples of their sizes, as ScheduleVerifier::ExecutionOrder numbers them, from the tile holding the first p and
+ * the smallest q of the domain; p then runs over the rows of its tile, and the caller clamps q to its columns. Tiles
+ * outside the domain are left to the guard of the inner loop, which skips each of their rows. Returns QT. */
+PHINode* PolytopePass::EmitTileLoops(const std::vector<int>& tiles, Value* pLower, Value* pUpper, Value* qMin,
+									 Value* qMax, Instruction* outerComparison, LoopStandardAnalysisResults& AR) {
+	auto& LI = AR.LI;
+	auto* preheader = outerLoop->getLoopPreheader();
+	auto* header = outerLoop->getHeader();
+	auto* latch = outerLoop->getLoopLatch();
+	auto* exit = outerLoop->getExitBlock();
+	auto* F = header->getParent();
+	auto& C = header->getContext();
+	auto* Ty = outerPhi->getType();
+	Function* minFunc = Intrinsic::getDeclaration(F->getParent(), Intrinsic::smin, {Ty});
+	Function* maxFunc = Intrinsic::getDeclaration(F->getParent(), Intrinsic::smax, {Ty});
+
+	/* The multiple of size at or below n */
+	IRBuilder builder(preheader->getTerminator());
+	auto align = [&](Value* n, int size, const Twine& name) {
+		auto* remainder = builder.CreateSRem(n, IntToValue(size));
+		remainder = builder.CreateSelect(builder.CreateICmpSLT(remainder, IntToValue(0)),
+										 builder.CreateAdd(remainder, IntToValue(size)), remainder);
+		return builder.CreateSub(n, remainder, name);
+	};
+	auto* firstRow = align(pLower, tiles[0], "p.tile.first");
+	auto* firstColumn = align(qMin, tiles[1], "q.tile.first");
+
+	auto* rowHeader = BasicBlock::Create(C, "p.tile", F, header);
+	auto* columnHeader = BasicBlock::Create(C, "q.tile", F, header);
+	auto* columnLatch = BasicBlock::Create(C, "q.tile.latch", F, exit);
+	auto* rowLatch = BasicBlock::Create(C, "p.tile.latch", F, exit);
+	preheader->getTerminator()->replaceSuccessorWith(header, rowHeader);
+	header->replacePhiUsesWith(preheader, columnHeader);
+	latch->getTerminator()->replaceSuccessorWith(exit, columnLatch);
+
+	builder.SetInsertPoint(rowHeader);
+	auto* row = builder.CreatePHI(Ty, 2, "p.tile");
+	auto* lastP = builder.CreateCall(minFunc, {pUpper, builder.CreateAdd(row, IntToValue(tiles[0] - 1))}, "p.last");
+	builder.CreateBr(columnHeader);
+
+	builder.SetInsertPoint(columnHeader);
+	auto* column = builder.CreatePHI(Ty, 2, "q.tile");
+	auto* firstP = builder.CreateCall(maxFunc, {pLower, row}, "p.first");
+	builder.CreateBr(header);
+	outerPhi->setIncomingValueForBlock(columnHeader, firstP);
+	outerComparison->replaceUsesOfWith(pUpper, lastP);
+
+	builder.SetInsertPoint(columnLatch);
+	auto* nextColumn = builder.CreateAdd(column, IntToValue(tiles[1]), "q.tile.next");
+	builder.CreateCondBr(builder.CreateICmpSLE(nextColumn, qMax), columnHeader, rowLatch);
+
+	builder.SetInsertPoint(rowLatch);
+	auto* nextRow = builder.CreateAdd(row, IntToValue(tiles[0]), "p.tile.next");
+	builder.CreateCondBr(builder.CreateICmpSLE(nextRow, pUpper), rowHeader, exit);
+
+	row->addIncoming(firstRow, preheader);
+	row->addIncoming(nextRow, rowLatch);
+	column->addIncoming(firstColumn, rowHeader);
+	column->addIncoming(nextColumn, columnLatch);
+
+	/* The tile loops take the place of the outer loop in its parent, headers first */
+	auto* rowLoop = LI.AllocateLoop();
+	auto* columnLoop = LI.AllocateLoop();
+	if (auto* parent = outerLoop->getParentLoop()) {
+		parent->replaceChildLoopWith(outerLoop, rowLoop);
+	} else {
+		LI.changeTopLevelLoop(outerLoop, rowLoop);
+	}
+	rowLoop->addChildLoop(columnLoop);
+	columnLoop->addChildLoop(outerLoop);
+	rowLoop->addBasicBlockToLoop(rowHeader, LI);
+	columnLoop->addBasicBlockToLoop(columnHeader, LI);
+	for (auto* BB: outerLoop->blocks()) {
+		columnLoop->addBlockEntry(BB);
+		rowLoop->addBlockEntry(BB);
+	}
+	columnLoop->addBasicBlockToLoop(columnLatch, LI);
+	rowLoop->addBasicBlockToLoop(rowLatch, LI);
+	AR.DT.recalculate(*F);
+	AR.SE.forgetLoop(rowLoop);
+	NumTiled++;
+	return column;
+}
+
+/* Tiles for the transformed nest with -polytope-tile, skewing the transform of report by the outer coordinate if the
+ * tiles need it */
+std::vector<int> PolytopePass::ChooseTiles(NestReport& report) {
+	auto T = *report.transform;
+	int skew = 0;
+	auto tiles = TileTransform(*report.assignment, report.bounds, T, skew);
+	if (!tiles.empty()) {
+		report.transform = T;
+		report.tileSkew = skew;
+	}
+	return tiles;
+}
+
+/* Tiles of -polytope-tile for the nest GenerateTransformedNest emits for T, skewing T by the outer coordinate when the
+ * tiles need it, or none when the nest cannot be tiled. Skewed layouts and out-of-core arrays assume whole rows of p,
+ * and the guard that skips empty tile rows needs exits without live-out values. */
+std::vector<int> PolytopePass::TileTransform(const LoopDependencies& assignment,
+											 const std::optional<std::vector<std::pair<int, int>>>& bounds,
+											 std::vector<std::vector<int>>& T, int& skew) {
+	std::vector<int> tiles(Tile.begin(), Tile.end());
+	if (tiles.size() == 1) {
+		tiles.push_back(tiles.front());
+	}
+	auto* outerExit = outerLoop->getExitBlock();
+	auto* innerExit = innerLoop->getExitBlock();
+	if (tiles.size() != 2 || !tiles[0] || !tiles[1] || SkewLayout || Contract || OutOfCore || !outerExit ||
+		!outerExit->phis().empty() || !innerExit || !innerExit->phis().empty()) {
+		LLVM_DEBUG(dbgs() << "Nest cannot be tiled\n");
+		return {};
+	}
+	auto tileSkew = TileSkew(assignment, T);
+	if (!tileSkew) {
+		LLVM_DEBUG(dbgs() << "No skew makes the tiles of " << MatrixToString(T) << " legal\n");
+		return {};
+	}
+	auto skewed = T;
+	skewed[1][0] += *tileSkew * T[0][0];
+	skewed[1][1] += *tileSkew * T[0][1];
+	if (VerifySchedule && bounds) {
+		ScheduleVerifier verifier(assignment, *bounds);
+		if (auto violation = verifier.Verify(skewed, tiles)) {
+			LLVM_DEBUG(dbgs() << "Tiles of " << MatrixToString(skewed) << " reverse " << violation->kind
+							  << " dependence from " << MatrixToString({violation->source}) << " to "
+							  << MatrixToString({violation->sink}) << "\n");
+			return {};
+		}
+	}
+	T = skewed;
+	skew = *tileSkew;
+	if (skew) {
+		NumTileSkewed++;
+	}
+	return tiles;
+}
+
+/* Keeps the element of each reduction the generated inner loop updates at every iteration, the ones whose index
+ * functions do not move along the inner direction e = (-T01, T00) / gcd(T00, T01), in an accumulator phi: the element
+ * is loaded in the preheader, which the guard only enters when the loop runs, and stored back on the exit edge.
+ * Reductions whose element moves update a different element at each q and are left in memory. Every update loses
+ * its overflow flags, as the transform may add the values in another order. Returns the number of reductions kept in
+ * registers, and clears complete when one that should have been could not be. */
+unsigned PolytopePass::PrivatiseReductions(const std::vector<std::vector<int>>& T, bool& complete,
+										   LoopStandardAnalysisResults& AR) {
+	complete = true;
+	auto* header = innerLoop->getHeader();
+	auto* preheader = innerLoop->getLoopPreheader();
+	auto* exit = innerLoop->getExitBlock();
+	int g = std::gcd(T[0][0], T[0][1]);
+	long e[2] = {-T[0][1] / g, T[0][0] / g};
+	BasicBlock* reduce = nullptr;
+	unsigned res = 0;
+	for (auto& reduction: reductions) {
+		reduction.update->dropPoisonGeneratingFlags();
+		if (!std::all_of(reduction.element.begin(), reduction.element.end(),
+						 [&](auto& row) { return row[0] * e[0] + row[1] * e[1] == 0; })) {
+			continue;
+		}
+		if (!preheader || !exit || !innerGuard || innerLoop->getNumBlocks() != 1) {
+			complete = false;
+			continue;
+		}
+		IRBuilder builder(preheader->getTerminator());
+		DenseMap<Value*, Value*> map;
+		auto* pointer = CloneAtIteration(reduction.store->getPointerOperand(), innerLower, builder, map, ".red");
+		if (!pointer) {
+			complete = false;
+			continue;
+		}
+		auto* load = reduction.load;
+		auto* Ty = load->getType();
+		auto* initial = builder.CreateAlignedLoad(Ty, pointer, load->getAlign(), load->getName() + ".red.init");
+		auto* accumulator = PHINode::Create(Ty, 2, reduction.update->getName() + ".red", &header->front());
+		accumulator->addIncoming(initial, preheader);
+		accumulator->addIncoming(reduction.update, header);
+		load->replaceAllUsesWith(accumulator);
+		load->eraseFromParent();
+
+		if (!reduce) {
+			reduce = SplitEdge(header, exit, &AR.DT, &AR.LI, nullptr, "q.reduce");
+		}
+		auto* final = PHINode::Create(Ty, 1, reduction.update->getName() + ".red.final", &reduce->front());
+		final->addIncoming(reduction.update, header);
+		builder.SetInsertPoint(reduce->getTerminator());
+		builder.CreateAlignedStore(final, pointer, reduction.store->getAlign());
+		reduction.store->eraseFromParent();
+		reduction.load = nullptr;
+		reduction.store = nullptr;
+		reduction.accumulator = accumulator;
+		res++;
+	}
+	if (res) {
+		AR.SE.forgetLoop(outerLoop);
+	}
+	NumPrivatisedReductions += res;
+	return res;
+}
+
+/* Byte address of each memory access of the nest as an affine function of the induction variables: the base pointer
+ * of its GEP, the bytes it moves by per unit of each induction variable and its constant offset from the base. Each
+ * GEP index is scaled by the size of the type it indexes. Accesses whose indices are not affine in the induction
+ * variables, and the loads and stores of reductions, are left out. */
+std::vector<PolytopePass::AccessFunction> PolytopePass::AccessFunctions() {
+	std::vector<AccessFunction> res;
+	for (auto* BB: innerLoop->blocks()) {
+		for (auto& I: *BB) {
+			auto* GEP = (isa<LoadInst>(I) || isa<StoreInst>(I)) && !IsReductionAccess(&I)
+						? dyn_cast<GetElementPtrInst>(getLoadStorePointerOperand(&I)) : nullptr;
+			if (!GEP) {
+				continue;
+			}
+			auto& DL = GEP->getModule()->getDataLayout();
+			std::vector<long> coefficients(2, 0);
+			long offset = 0;
+			bool affine = true;
+			for (auto it = gep_type_begin(GEP); it != gep_type_end(GEP) && affine; ++it) {
+				auto index = GetValueIfAffine(it.getOperand());
+				if (!index || it.isStruct()) {
+					affine = index && isa<ConstantInt>(it.getOperand());
+					if (affine) {
+						auto field = cast<ConstantInt>(it.getOperand())->getZExtValue();
+						offset += (long) DL.getStructLayout(it.getStructType())->getElementOffset(field);
+					}
+					continue;
+				}
+				long size = (long) DL.getTypeAllocSize(it.getIndexedType()).getFixedSize();
+				coefficients[0] += (*index)[0] * size;
+				coefficients[1] += (*index)[1] * size;
+				offset += index->back() * size;
+			}
+			if (affine) {
+				res.push_back({&I, GEP->getPointerOperand(), coefficients, offset});
+			}
+		}
+	}
+	return res;
+}
+
+/* Byte distance each memory access of the nest moves by between consecutive iterations of the inner loop that
+ * GenerateTransformedNest emits for T. An access with index functions R over the induction variables x becomes R T^-1
+ * over the transformed ones (p, q), and the inner loop steps q by H11 = |det T| / gcd(T00, T01), so the access moves
+ * by R e with e = sign(det T) (-T01, T00) / gcd(T00, T01). Returns the access, its stride and its constant offset from
+ * the base. */
+std::vector<PolytopePass::AccessStride>
+PolytopePass::AccessStrides(const std::vector<AccessFunction>& accesses, const std::vector<std::vector<int>>& T) {
+	std::vector<AccessStride> res;
+	auto det = IntegerSolver::Det(T);
+	int g = std::gcd(T[0][0], T[0][1]);
+	std::vector<long> e = {-T[0][1] / g, T[0][0] / g};
+	if (det < 0) {
+		e = {-e[0], -e[1]};
+	}
+	for (auto& access: accesses) {
+		res.push_back({access.access, access.coefficients[0] * e[0] + access.coefficients[1] * e[1], access.offset});
+	}
+	return res;
+}
+
+/* Prefetches the address each strided access of the inner loop will touch -polytope-prefetch-distance iterations
+ * later. Hardware prefetchers follow unit strides but lose track of the row-sized jumps a skewed inner loop makes.
+ * Accesses with the same stride whose addresses fall in one cache line share a prefetch. Returns the number of
+ * prefetches emitted. */
+unsigned PolytopePass::EmitPrefetches(const std::vector<AccessStride>& strides, LoopStandardAnalysisResults& AR) {
+	auto* M = innerLoop->getHeader()->getModule();
+	auto& DL = M->getDataLayout();
+	auto* PtrTy = Type::getInt8PtrTy(M->getContext());
+	auto* prefetch = Intrinsic::getDeclaration(M, Intrinsic::prefetch, {PtrTy});
+	long line = AR.TTI.getCacheLineSize() ? AR.TTI.getCacheLineSize() : 64;
+	std::vector<std::pair<long, long>> emitted;
+	unsigned res = 0;
+	for (auto [I, stride, offset]: strides) {
+		auto size = (long) DL.getTypeStoreSize(getLoadStoreType(I)).getFixedSize();
+		if (std::abs(stride) <= size) {
+			continue;
+		}
+		if (std::any_of(emitted.begin(), emitted.end(), [&, stride = stride, offset = offset](auto& e) {
+			return e.first == stride && std::abs(e.second - offset) < line;
+		})) {
+			continue;
+		}
+		emitted.emplace_back(stride, offset);
+		IRBuilder builder(I);
+		auto* pointer = builder.CreateBitCast(getLoadStorePointerOperand(I), PtrTy);
+		auto* ahead = builder.CreateGEP(builder.getInt8Ty(), pointer, builder.getInt64(stride * PrefetchDistance),
+										"prefetch.address");
+		builder.CreateCall(prefetch, {ahead, builder.getInt32(isa<StoreInst>(I)), builder.getInt32(3),
+									  builder.getInt32(1)});
+		res++;
+	}
+	NumPrefetches += res;
+	return res;
+}
+
+/* Recomputes a value of the inner loop body at iteration q of the generated inner loop, cloning the instructions it
+ * depends on at the insertion point of builder. Returns null when it depends on a phi other than q or on memory. */
+Value* PolytopePass::CloneAtIteration(Value* V, Value* q, IRBuilderBase& builder, DenseMap<Value*, Value*>& map,
+									  const Twine& suffix) {
+	if (V == innerPhi) {
+		return q;
+	}
+	auto* I = dyn_cast<Instruction>(V);
+	if (!I || !innerLoop->contains(I)) {
+		return V;
+	}
+	if (auto it = map.find(V); it != map.end()) {
+		return it->second;
+	}
+	if (isa<PHINode>(I) || I->mayReadOrWriteMemory()) {
+		return nullptr;
+	}
+	auto* clone = I->clone();
+	for (unsigned o = 0; o < I->getNumOperands(); o++) {
+		auto* operand = CloneAtIteration(I->getOperand(o), q, builder, map, suffix);
+		if (!operand) {
+			clone->deleteValue();
+			return nullptr;
+		}
+		clone->setOperand(o, operand);
+	}
+	return map[V] = builder.Insert(clone, I->getName() + suffix);
+}
+
+/* Replaces loads of the inner loop that read an element the loop stored or loaded at most -polytope-scalar-replace
+ * iterations earlier by rotating registers: phis r1, ..., rd in the header, where r1 takes the value of the earlier
+ * access and each rm the value of rm-1 at the end of an iteration, so that rd holds it d iterations later. Accesses
+ * with the same base and coefficients move by the same stride s from one iteration to the next, so the access A at
+ * iteration q - d touches the element a read R touches at q when offset(A) - offset(R) = d s. R takes the latest such
+ * access, and is left alone when that is in the same iteration or when a store that may alias lies in between. The
+ * first d iterations read elements the loop has not touched yet, which the preheader loads into the registers; an
+ * inner loop shorter than d loads the element of its last iteration instead, so no address outside the original
+ * accesses is read. Returns the number of loads replaced. */
+unsigned PolytopePass::EmitScalarReplacement(const std::vector<std::vector<int>>& T,
+											 const std::vector<AccessFunction>& accesses,
+											 LoopStandardAnalysisResults& AR) {
+	auto* header = innerLoop->getHeader();
+	auto* preheader = innerLoop->getLoopPreheader();
+	if (!preheader || innerLoop->getNumBlocks() != 1 || !innerPhi || !innerLower || !innerUpper) {
+		return 0;
+	}
+	auto strides = AccessStrides(accesses, T);
+	DenseMap<Instruction*, size_t> functions;
+	for (size_t a = 0; a < accesses.size(); a++) {
+		functions[accesses[a].access] = a;
+	}
+	/* Position of each memory access in the body; any store not described by an access function may alias */
+	std::vector<std::pair<Instruction*, size_t>> order;
+	for (auto& I: *header) {
+		auto* intrinsic = dyn_cast<IntrinsicInst>(&I);
+		bool writes = I.mayWriteToMemory() && !(intrinsic && intrinsic->getIntrinsicID() == Intrinsic::prefetch);
+		auto it = functions.find(&I);
+		if (it == functions.end()) {
+			if (writes) {
+				LLVM_DEBUG(dbgs() << "No scalar replacement across " << I << "\n");
+				return 0;
+			}
+			continue;
+		}
+		if (writes && !cast<StoreInst>(I).isSimple()) {
+			return 0;
+		}
+		order.emplace_back(&I, it->second);
+	}
+	long step = IntegerSolver::HermiteNormal(T)[1][1];
+
+	IRBuilder builder(preheader->getTerminator());
+	auto* minFunc = Intrinsic::getDeclaration(header->getModule(), Intrinsic::smin, {innerPhi->getType()});
+	DenseMap<Value*, Value*> replaced;
+	std::vector<LoadInst*> dead;
+	unsigned res = 0;
+	for (size_t r = 0; r < order.size(); r++) {
+		auto* load = dyn_cast<LoadInst>(order[r].first);
+		auto& f = accesses[order[r].second];
+		long stride = strides[order[r].second].stride;
+		if (!load || !load->isSimple() || !stride) {
+			continue;
+		}
+		/* The latest access to the element of the load before it, as iterations back and position in the body */
+		std::optional<std::pair<long, size_t>> latest;
+		bool aliased = false;
+		for (size_t a = 0; a < order.size() && !aliased; a++) {
+			auto& g = accesses[order[a].second];
+			if (a == r) {
+				continue;
+			}
+			if (g.base != f.base || g.coefficients != f.coefficients) {
+				aliased = isa<StoreInst>(order[a].first);
+				continue;
+			}
+			long difference = g.offset - f.offset;
+			long distance = difference / stride;
+			if (difference % stride || distance < 0 || distance > (long) ScalarReplace || (distance == 0 && a > r)) {
+				continue;
+			}
+			if (!latest || distance < latest->first || (distance == latest->first && a > latest->second)) {
+				latest = {distance, a};
+			}
+		}
+		/* Within one iteration the load is left to GVN */
+		if (aliased || !latest || latest->first == 0) {
+			continue;
+		}
+		auto [d, a] = *latest;
+		auto* from = order[a].first;
+		Value* value = isa<StoreInst>(from) ? cast<StoreInst>(from)->getValueOperand() : from;
+		if (auto* replacement = replaced.lookup(value)) {
+			value = replacement;
+		}
+		if (value->getType() != load->getType()) {
+			continue;
+		}
+		/* rm starts with the element the load reads at iteration d - m */
+		std::vector<Value*> initial;
+		for (long m = 1; m <= d; m++) {
+			auto* next = builder.CreateAdd(innerLower, ConstantInt::get(innerPhi->getType(), (d - m) * step));
+			auto* q = builder.CreateCall(minFunc, {next, innerUpper});
+			DenseMap<Value*, Value*> map;
+			auto* pointer = CloneAtIteration(load->getPointerOperand(), q, builder, map, ".sr");
+			if (!pointer) {
+				break;
+			}
+			initial.push_back(builder.CreateAlignedLoad(load->getType(), pointer, load->getAlign(),
+														load->getName() + ".sr.init"));
+		}
+		if ((long) initial.size() != d) {
+			continue;
+		}
+		std::vector<PHINode*> registers;
+		for (long m = 1; m <= d; m++) {
+			registers.push_back(PHINode::Create(load->getType(), 2, load->getName() + ".sr", &header->front()));
+			registers.back()->addIncoming(initial[m - 1], preheader);
+		}
+		registers.front()->addIncoming(value, header);
+		for (long m = 1; m < d; m++) {
+			registers[m]->addIncoming(registers[m - 1], header);
+		}
+		load->replaceAllUsesWith(registers.back());
+		replaced[load] = registers.back();
+		dead.push_back(load);
+		res++;
+	}
+	for (auto* load: dead) {
+		load->eraseFromParent();
+	}
+	if (res) {
+		AR.SE.forgetLoop(outerLoop);
+	}
+	NumScalarReplaced += res;
+	return res;
+}
+
+/* Unrolls the outer loop of the generated nest by the largest legal factor up to -polytope-unroll-jam and jams the
+ * copies: the inner loop runs q over the union of the ranges of the copies, and at each q runs the body for p, p + 1,
+ * ..., each copy guarded by its own range, as the ranges of a skewed nest differ from one p to the next. The copies
+ * beyond the upper bound of p have empty ranges.
+ *
+ * A load of a copy whose address an earlier copy stored to or loaded from at the same q, with no store that may alias
+ * it in between, takes the value of the earlier copy instead. The earlier copy may not have run at this q, at the
+ * edges of the domain, so the load is kept on that path. The addresses are compared through the access functions
+ * taken before codegen: the copy k iterations further has x moved by k T^-1 (1, 0). Returns the factor, or 0 when the
+ * nest was left alone, and sets forwarded to the number of loads replaced. */
+unsigned PolytopePass::EmitUnrollAndJam(const NestReport& report, const std::vector<AccessFunction>& accesses,
+										unsigned& forwarded, LoopStandardAnalysisResults& AR) {
+	forwarded = 0;
+	auto& T = *report.transform;
+	auto* header = innerLoop->getHeader();
+	auto* branch = dyn_cast<BranchInst>(header->getTerminator());
+	/* Calls the runtime makes at every outer iteration expect to see every p */
+	if (!innerGuard || !outerUpper || !innerLoop->getLoopPreheader() || innerLoop->getLoopLatch() != header ||
+		!branch || !branch->isConditional() || !outerIVArguments.empty()) {
+		return 0;
+	}
+	auto* increment = dyn_cast<Instruction>(innerPhi->getIncomingValueForBlock(header));
+	auto* condition = dyn_cast<ICmpInst>(branch->getCondition());
+	auto* outerIncrement = dyn_cast<BinaryOperator>(outerPhi->getIncomingValueForBlock(outerLoop->getLoopLatch()));
+	auto* guardCondition = dyn_cast<ICmpInst>(innerGuard->getCondition());
+	if (!increment || !condition || condition->getOperand(1) != innerUpper || !outerIncrement ||
+		outerIncrement->getOperand(0) != outerPhi || !isa<ConstantInt>(outerIncrement->getOperand(1)) ||
+		!guardCondition || header->getFirstNonPHI() == increment ||
+		std::distance(header->phis().begin(), header->phis().end()) != 1) {
+		return 0;
+	}
+	auto factor = LegalUnrollJamFactor(*report.assignment, T, UnrollJam);
+	if (factor < 2) {
+		LLVM_DEBUG(dbgs() << "Dependences do not allow unrolling and jamming " << MatrixToString(T) << "\n");
+		return 0;
+	}
+	auto step = (int) cast<ConstantInt>(outerIncrement->getOperand(1))->getSExtValue();
+	auto* F = header->getParent();
+	auto& context = F->getContext();
+	auto* IVTy = outerPhi->getType();
+	auto* minFunc = Intrinsic::getDeclaration(F->getParent(), Intrinsic::smin, {IVTy});
+	auto* maxFunc = Intrinsic::getDeclaration(F->getParent(), Intrinsic::smax, {IVTy});
+
+	/* Values of the outer loop computed from p, recomputed from p + k before the guard for copy k */
+	IRBuilder builder(guardCondition);
+	std::vector<DenseMap<Value*, Value*>> outerValues(factor);
+	std::function<Value*(Value*, unsigned)> atCopy = [&](Value* V, unsigned k) -> Value* {
+		auto it = outerValues[k].find(V);
+		if (it != outerValues[k].end()) {
+			return it->second;
+		}
+		auto* I = dyn_cast<Instruction>(V);
+		if (!k || !I || isa<PHINode>(I) || !outerLoop->contains(I) || innerLoop->contains(I)) {
+			return V;
+		}
+		std::vector<Value*> operands;
+		bool changed = false;
+		for (auto& operand: I->operands()) {
+			operands.push_back(atCopy(operand.get(), k));
+			changed |= operands.back() != operand.get();
+		}
+		Value* res = I;
+		if (changed) {
+			auto* clone = I->clone();
+			for (size_t o = 0; o < operands.size(); o++) {
+				clone->setOperand(o, operands[o]);
+			}
+			res = builder.Insert(clone, I->getName() + ".jam");
+		}
+		outerValues[k][V] = res;
+		return res;
+	};
+	std::vector<Value*> lowers = {innerLower};
+	std::vector<Value*> uppers = {innerUpper};
+	auto* groupLower = innerLower;
+	auto* groupUpper = innerUpper;
+	for (unsigned k = 1; k < factor; k++) {
+		auto* p = builder.CreateAdd(outerPhi, ConstantInt::get(IVTy, (long) k * step), "p.jam");
+		outerValues[k][outerPhi] = p;
+		auto* valid = builder.CreateICmpSLE(p, outerUpper);
+		lowers.push_back(builder.CreateSelect(valid, atCopy(innerLower, k),
+											  ConstantInt::get(IVTy, APInt::getSignedMaxValue(IVTy->getIntegerBitWidth())),
+											  "q.lower.jam"));
+		uppers.push_back(builder.CreateSelect(valid, atCopy(innerUpper, k),
+											  ConstantInt::get(IVTy, APInt::getSignedMinValue(IVTy->getIntegerBitWidth())),
+											  "q.upper.jam"));
+		groupLower = builder.CreateCall(minFunc, {groupLower, lowers.back()}, "q.lower.group");
+		groupUpper = builder.CreateCall(maxFunc, {groupUpper, uppers.back()}, "q.upper.group");
+	}
+	guardCondition->setOperand(0, groupLower);
+	guardCondition->setOperand(1, groupUpper);
+	innerPhi->setIncomingValue(innerPhi->getBasicBlockIndex(innerLoop->getLoopPreheader()), groupLower);
+	condition->setOperand(1, groupUpper);
+	outerIncrement->setOperand(1, ConstantInt::get(IVTy, (long) factor * step));
+
+	/* header: q, then copy 0 in body[0] and copy k in body[k] behind check[k], and the increment in the latch */
+	std::vector<Instruction*> original;
+	for (auto* I = header->getFirstNonPHI(); I != increment; I = I->getNextNode()) {
+		original.push_back(I);
+	}
+	auto* latch = SplitBlock(header, increment, &AR.DT, &AR.LI, nullptr, "q.latch");
+	auto* firstBody = SplitBlock(header, original.front(), &AR.DT, &AR.LI, nullptr, "q.jam");
+	std::vector<BasicBlock*> checks = {header};
+	std::vector<BasicBlock*> bodies = {firstBody};
+	std::vector<std::vector<Instruction*>> copies = {original};
+	std::vector<Value*> active;
+	for (unsigned k = 1; k < factor; k++) {
+		ValueToValueMapTy map;
+		for (auto* I: original) {
+			for (auto& operand: I->operands()) {
+				if (auto* V = dyn_cast<Instruction>(operand.get()); V && !innerLoop->contains(V)) {
+					map[V] = atCopy(V, k);
+				}
+			}
+		}
+		map[outerPhi] = outerValues[k][outerPhi];
+		checks.push_back(BasicBlock::Create(context, "q.jam.check", F, latch));
+		bodies.push_back(CloneBasicBlock(firstBody, map, ".jam" + std::to_string(k), F));
+		bodies.back()->moveBefore(latch);
+		SmallVector<BasicBlock*, 1> cloned = {bodies.back()};
+		remapInstructionsInBlocks(cloned, map);
+		std::vector<Instruction*> copy;
+		for (auto* I: original) {
+			copy.push_back(cast<Instruction>(map[I]));
+		}
+		copies.push_back(copy);
+		innerLoop->addBasicBlockToLoop(checks.back(), AR.LI);
+		innerLoop->addBasicBlockToLoop(bodies.back(), AR.LI);
+	}
+	for (unsigned k = 0; k < factor; k++) {
+		auto* next = k + 1 < factor ? checks[k + 1] : latch;
+		if (auto* terminator = checks[k]->getTerminator()) {
+			terminator->eraseFromParent();
+		}
+		builder.SetInsertPoint(checks[k]);
+		active.push_back(builder.CreateAnd(builder.CreateICmpSGE(innerPhi, lowers[k]),
+										   builder.CreateICmpSLE(innerPhi, uppers[k]), "q.jam.active"));
+		builder.CreateCondBr(active.back(), bodies[k], next);
+		bodies[k]->getTerminator()->setSuccessor(0, next);
+	}
+
+	/* Forward values between copies */
+	DenseMap<Instruction*, const AccessFunction*> functions;
+	for (auto& access: accesses) {
+		functions[access.access] = &access;
+	}
+	long shift[2] = {T[1][1] / IntegerSolver::Det(T), -T[1][0] / IntegerSolver::Det(T)};
+	auto address = [&](const AccessFunction* f, unsigned k) {
+		return f->offset + (long) k * step * (f->coefficients[0] * shift[0] + f->coefficients[1] * shift[1]);
+	};
+	DenseMap<Instruction*, PHINode*> merged;
+	DenseMap<Value*, Value*> replaced;
+	auto* MDUnlikely = MDBuilder(context).createBranchWeights(1, 1000);
+	for (unsigned k = 1; k < factor; k++) {
+		for (size_t n = 0; n < original.size(); n++) {
+			auto* load = dyn_cast<LoadInst>(copies[k][n]);
+			auto* f = functions.lookup(original[n]);
+			if (!load || !load->isSimple() || !f) {
+				continue;
+			}
+			/* The latest earlier access to the same address, scanning back over stores that provably miss it */
+			std::optional<std::pair<unsigned, size_t>> source;
+			bool blocked = false;
+			for (long c = k, m = (long) n - 1; c >= 0 && !source && !blocked; m--) {
+				if (m < 0) {
+					c--;
+					m = (long) original.size();
+					continue;
+				}
+				auto* I = copies[c][m];
+				auto* g = functions.lookup(original[m]);
+				auto* intrinsic = dyn_cast<IntrinsicInst>(I);
+				bool writes = I->mayWriteToMemory() && !(intrinsic && intrinsic->getIntrinsicID() == Intrinsic::prefetch);
+				if (!writes && !isa<LoadInst>(I)) {
+					continue;
+				}
+				bool comparable = g && g->base == f->base && g->coefficients == f->coefficients &&
+								  (!isa<StoreInst>(I) || cast<StoreInst>(I)->isSimple());
+				bool same = comparable && address(g, c) == address(f, k);
+				if (same && c < (long) k && getLoadStoreType(I) == load->getType()) {
+					source = {c, m};
+				} else if (writes && (!comparable || same)) {
+					blocked = true;
+				}
+			}
+			if (!source) {
+				continue;
+			}
+			auto [c, m] = *source;
+			auto* from = copies[c][m];
+			Value* value = isa<StoreInst>(from) ? cast<StoreInst>(from)->getValueOperand() : from;
+			if (auto* replacement = replaced.lookup(value)) {
+				value = replacement;
+			}
+			/* Merged after the guard of copy c, undefined when it did not run */
+			auto*& fwd = merged[from];
+			if (!fwd) {
+				auto* merge = checks[c + 1];
+				fwd = PHINode::Create(load->getType(), 2, value->getName() + ".fwd", &merge->front());
+				for (auto* pred: predecessors(merge)) {
+					fwd->addIncoming(pred == checks[c] ? (Value*) PoisonValue::get(load->getType()) : value, pred);
+				}
+			}
+			/* Reloaded only where copy c did not run */
+			builder.SetInsertPoint(load);
+			auto* reload = SplitBlockAndInsertIfThen(builder.CreateNot(active[c]), load, false, MDUnlikely,
+													 (DominatorTree*) nullptr, &AR.LI);
+			auto* head = reload->getParent()->getSinglePredecessor();
+			auto* tail = load->getParent();
+			load->moveBefore(reload);
+			auto* res = PHINode::Create(load->getType(), 2, load->getName() + ".jam", &tail->front());
+			load->replaceAllUsesWith(res);
+			res->addIncoming(load, reload->getParent());
+			res->addIncoming(fwd, head);
+			replaced[load] = res;
+			forwarded++;
+		}
+	}
+	AR.DT.recalculate(*F);
+	AR.SE.forgetLoop(outerLoop);
+	NumUnrollJammed++;
+	NumForwardedLoads += forwarded;
+	return factor;
+}
+
+/* Runs the inner loop as a vector loop over consecutive values of q, leaving the scalar loop as epilogue for the
+ * remaining iterations. Every instruction of the body is widened; array reads become gathers and writes scatters, as
+ * the accesses of a skewed nest are strided. The caller checks that the inner loop carries no dependence. Scatters
+ * are not required to be legal on the target (AVX2 has none), the backend splits them into scalar stores. The
+ * accumulator of a privatised reduction becomes a vector of partial results, one per lane, that starts from the
+ * identity of the operation with the incoming value in lane 0 and is reduced across lanes after the vector loop,
+ * before the scalar loop continues from it. The new loop is left in vectorLoop for the caller to report to the loop
+ * pass manager. Returns the number of lanes, or 0 when the body cannot be widened. */
+unsigned PolytopePass::EmitVectorInnerLoop(PHINode* IV, Value* lower, Value* upper, int step,
+										   LoopStandardAnalysisResults& AR) {
+	auto* header = innerLoop->getHeader();
+	auto* preheader = innerLoop->getLoopPreheader();
+	auto* exit = innerLoop->getExitBlock();
+	auto* branch = dyn_cast<BranchInst>(header->getTerminator());
+	if (!preheader || !exit || innerLoop->getLoopLatch() != header || !branch || !branch->isConditional()) {
+		return 0;
+	}
+	/* Besides q the header only has accumulators, whose final values the exit block alone uses */
+	std::vector<const Reduction*> accumulated;
+	for (auto& phi: header->phis()) {
+		auto it = std::find_if(reductions.begin(), reductions.end(),
+							   [&](auto& reduction) { return reduction.accumulator == &phi; });
+		if (&phi != IV && it == reductions.end()) {
+			return 0;
+		}
+		if (&phi != IV) {
+			accumulated.push_back(&*it);
+		}
+	}
+	for (auto& phi: exit->phis()) {
+		if (std::none_of(accumulated.begin(), accumulated.end(), [&](auto* reduction) {
+			return phi.getNumIncomingValues() == 1 && phi.getIncomingValue(0) == reduction->update;
+		})) {
+			return 0;
+		}
+	}
+	auto* increment = IV->getIncomingValueForBlock(header);
+	auto* condition = branch->getCondition();
+	if (!condition->hasOneUse() || std::any_of(increment->user_begin(), increment->user_end(),
+											   [&](User* U) { return U != IV && U != condition; })) {
+		return 0;
+	}
+
+	auto& DL = header->getModule()->getDataLayout();
+	unsigned elementBits = 0;
+	std::vector<Instruction*> body;
+	for (auto& I: *header) {
+		if (isa<PHINode>(I) || &I == increment || &I == condition || &I == branch || isa<DbgInfoIntrinsic>(I)) {
+			continue;
+		}
+		if (!isa<BinaryOperator>(I) && !isa<CastInst>(I) && !isa<CmpInst>(I) && !isa<SelectInst>(I) &&
+			!isa<MinMaxIntrinsic>(I) && !isa<GetElementPtrInst>(I) && !isa<LoadInst>(I) && !isa<StoreInst>(I)) {
+			LLVM_DEBUG(dbgs() << "Cannot widen " << I << "\n");
+			return 0;
+		}
+		if (auto* load = dyn_cast<LoadInst>(&I)) {
+			if (!load->isSimple()) {
+				return 0;
+			}
+			elementBits = std::max(elementBits, (unsigned) DL.getTypeSizeInBits(load->getType()));
+		}
+		if (auto* store = dyn_cast<StoreInst>(&I)) {
+			if (!store->isSimple()) {
+				return 0;
+			}
+			elementBits = std::max(elementBits,
+								   (unsigned) DL.getTypeSizeInBits(store->getValueOperand()->getType()));
+		}
+		body.push_back(&I);
+	}
+
+	unsigned width = SimdWidth;
+	if (!width) {
+		auto registerBits = AR.TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize();
+		width = elementBits ? (unsigned) registerBits / elementBits : 0;
+		for (auto* I: body) {
+			auto* load = dyn_cast<LoadInst>(I);
+			if (load && width > 1 &&
+				!AR.TTI.isLegalMaskedGather(FixedVectorType::get(load->getType(), width), load->getAlign())) {
+				width = 0;
+			}
+		}
+	}
+	if (width < 2) {
+		return 0;
+	}
+
+	auto* F = header->getParent();
+	auto& context = F->getContext();
+	auto* IVTy = IV->getType();
+	auto* vectorHeader = BasicBlock::Create(context, "q.vector", F, header);
+	auto* middle = BasicBlock::Create(context, "q.middle", F, header);
+	auto* scalarPreheader = BasicBlock::Create(context, "q.scalar.ph", F, header);
+
+	/* Enter the vector loop when at least one full vector of iterations remains */
+	IRBuilder builder(preheader->getTerminator());
+	builder.SetCurrentDebugLocation(branch->getDebugLoc());
+	std::vector<Value*> starts;
+	for (auto* reduction: accumulated) {
+		auto* Ty = reduction->accumulator->getType();
+		starts.push_back(builder.CreateInsertElement(
+				ConstantVector::getSplat(ElementCount::getFixed(width), ReductionIdentity(reduction->kind, Ty)),
+				reduction->accumulator->getIncomingValueForBlock(preheader), (uint64_t) 0,
+				reduction->accumulator->getName() + ".start"));
+	}
+	auto* vectorEnd = builder.CreateSub(upper, ConstantInt::get(IVTy, (width - 1) * step), "q.vector.end");
+	builder.CreateCondBr(builder.CreateICmpSLE(lower, vectorEnd), vectorHeader, middle);
+	preheader->getTerminator()->eraseFromParent();
+
+	builder.SetInsertPoint(vectorHeader);
+	auto* q = builder.CreatePHI(IVTy, 2, "q.vector.iv");
+	std::vector<Constant*> lanes;
+	for (unsigned lane = 0; lane < width; lane++) {
+		lanes.push_back(ConstantInt::get(IVTy, lane * step));
+	}
+	DenseMap<Value*, Value*> widened;
+	std::vector<PHINode*> partials;
+	for (size_t r = 0; r < accumulated.size(); r++) {
+		partials.push_back(builder.CreatePHI(starts[r]->getType(), 2, accumulated[r]->accumulator->getName() + ".vector"));
+		partials.back()->addIncoming(starts[r], preheader);
+		widened[accumulated[r]->accumulator] = partials.back();
+	}
+	widened[IV] = builder.CreateAdd(builder.CreateVectorSplat(width, q), ConstantVector::get(lanes), "q.lanes");
+	/* Values defined outside the loop are the same in every lane */
+	auto widen = [&](Value* V) {
+		auto it = widened.find(V);
+		return it != widened.end() ? it->second : builder.CreateVectorSplat(width, V);
+	};
+	auto* mask = Constant::getAllOnesValue(FixedVectorType::get(builder.getInt1Ty(), width));
+	for (auto* I: body) {
+		Value* res = nullptr;
+		if (auto* binary = dyn_cast<BinaryOperator>(I)) {
+			res = builder.CreateBinOp(binary->getOpcode(), widen(binary->getOperand(0)), widen(binary->getOperand(1)),
+									  binary->getName());
+			if (auto* inst = dyn_cast<Instruction>(res)) {
+				inst->copyIRFlags(binary);
+			}
+		} else if (auto* cast = dyn_cast<CastInst>(I)) {
+			res = builder.CreateCast(cast->getOpcode(), widen(cast->getOperand(0)),
+									 FixedVectorType::get(cast->getDestTy(), width), cast->getName());
+		} else if (auto* cmp = dyn_cast<CmpInst>(I)) {
+			res = builder.CreateCmp(cmp->getPredicate(), widen(cmp->getOperand(0)), widen(cmp->getOperand(1)),
+									cmp->getName());
+		} else if (auto* select = dyn_cast<SelectInst>(I)) {
+			res = builder.CreateSelect(widen(select->getCondition()), widen(select->getTrueValue()),
+									   widen(select->getFalseValue()), select->getName());
+		} else if (auto* minMax = dyn_cast<MinMaxIntrinsic>(I)) {
+			res = builder.CreateBinaryIntrinsic(minMax->getIntrinsicID(), widen(minMax->getLHS()),
+												widen(minMax->getRHS()), nullptr, minMax->getName());
+		} else if (auto* gep = dyn_cast<GetElementPtrInst>(I)) {
+			/* Constant indices stay scalar, as struct field indices must; a scalar base with a vector index already
+			 * gives a vector of pointers */
+			std::vector<Value*> indices;
+			bool vectorIndex = false;
+			for (auto& index: gep->indices()) {
+				vectorIndex |= !isa<Constant>(index);
+				indices.push_back(isa<Constant>(index) ? index.get() : widen(index));
+			}
+			auto* base = gep->getPointerOperand();
+			if (widened.count(base) || !vectorIndex) {
+				base = widen(base);
+			}
+			res = builder.CreateGEP(gep->getSourceElementType(), base, indices, gep->getName());
+			if (auto* inst = dyn_cast<GetElementPtrInst>(res)) {
+				inst->setIsInBounds(gep->isInBounds());
+			}
+		} else if (auto* load = dyn_cast<LoadInst>(I)) {
+			res = builder.CreateMaskedGather(FixedVectorType::get(load->getType(), width),
+											 widen(load->getPointerOperand()), load->getAlign(), mask, nullptr,
+											 load->getName());
+		} else if (auto* store = dyn_cast<StoreInst>(I)) {
+			builder.CreateMaskedScatter(widen(store->getValueOperand()), widen(store->getPointerOperand()),
+										store->getAlign(), mask);
+		}
+		if (res) {
+			widened[I] = res;
+		}
+	}
+	auto* next = builder.CreateAdd(q, ConstantInt::get(IVTy, width * step), "q.vector.next");
+	q->addIncoming(lower, preheader);
+	q->addIncoming(next, vectorHeader);
+	for (size_t r = 0; r < accumulated.size(); r++) {
+		partials[r]->addIncoming(widened[accumulated[r]->update], vectorHeader);
+	}
+	builder.CreateCondBr(builder.CreateICmpSLE(next, vectorEnd), vectorHeader, middle);
+
+	/* The scalar loop finishes the iterations left over */
+	builder.SetInsertPoint(middle);
+	auto* resume = builder.CreatePHI(IVTy, 2, "q.resume");
+	resume->addIncoming(lower, preheader);
+	resume->addIncoming(next, vectorHeader);
+	std::vector<PHINode*> resumePartials;
+	for (size_t r = 0; r < accumulated.size(); r++) {
+		resumePartials.push_back(builder.CreatePHI(partials[r]->getType(), 2, partials[r]->getName() + ".resume"));
+		resumePartials.back()->addIncoming(starts[r], preheader);
+		resumePartials.back()->addIncoming(widened[accumulated[r]->update], vectorHeader);
+	}
+	std::vector<Value*> resumeValues;
+	for (size_t r = 0; r < accumulated.size(); r++) {
+		resumeValues.push_back(createSimpleTargetReduction(builder, &AR.TTI, resumePartials[r], accumulated[r]->kind));
+	}
+	builder.CreateCondBr(builder.CreateICmpSLE(resume, upper), scalarPreheader, exit);
+	builder.SetInsertPoint(scalarPreheader);
+	builder.CreateBr(header);
+	auto incoming = IV->getBasicBlockIndex(preheader);
+	IV->setIncomingBlock(incoming, scalarPreheader);
+	IV->setIncomingValue(incoming, resume);
+	for (size_t r = 0; r < accumulated.size(); r++) {
+		auto* accumulator = accumulated[r]->accumulator;
+		incoming = accumulator->getBasicBlockIndex(preheader);
+		accumulator->setIncomingBlock(incoming, scalarPreheader);
+		accumulator->setIncomingValue(incoming, resumeValues[r]);
+		for (auto& phi: exit->phis()) {
+			if (phi.getIncomingValue(0) == accumulated[r]->update) {
+				phi.addIncoming(resumeValues[r], middle);
+			}
+		}
+	}
+
+	vectorLoop = AR.LI.AllocateLoop();
+	outerLoop->addChildLoop(vectorLoop);
+	vectorLoop->addBasicBlockToLoop(vectorHeader, AR.LI);
+	outerLoop->addBasicBlockToLoop(middle, AR.LI);
+	outerLoop->addBasicBlockToLoop(scalarPreheader, AR.LI);
+	AR.DT.recalculate(*F);
+	/* Both loops leave through a block the other also branches to, and the vector loop is entered from the guard; give
+	 * them the preheader and dedicated exits later loop passes expect */
+	InsertPreheaderForLoop(vectorLoop, &AR.DT, &AR.LI, nullptr, true);
+	formDedicatedExitBlocks(vectorLoop, &AR.DT, &AR.LI, nullptr, true);
+	formDedicatedExitBlocks(innerLoop, &AR.DT, &AR.LI, nullptr, true);
+	AR.SE.forgetLoop(outerLoop);
+	/* Neither loop should be vectorised again */
+	addStringMetadataToLoop(vectorLoop, "llvm.loop.isvectorized", 1);
+	addStringMetadataToLoop(innerLoop, "llvm.loop.isvectorized", 1);
+	NumSimdLoops++;
+	return width;
+}
+
+/* Calls __polytope_nest_enter in the preheader and __polytope_nest_exit in the dedicated exit block, so every
+ * execution of the nest is measured once. The runtime (PolytopeRuntime.c) keys its totals by the location string. */
+void PolytopePass::InstrumentNest(Loop& L, const NestReport& report, StringRef kind) {
+	auto* preheader = L.getLoopPreheader();
+	auto* exit = L.getExitBlock();
+	if (!preheader || !exit) {
+		return;
+	}
+	auto* F = L.getHeader()->getParent();
+	auto* M = F->getParent();
+	auto& context = M->getContext();
+	auto* PtrTy = Type::getInt8PtrTy(context);
+	auto* VoidTy = Type::getVoidTy(context);
+	auto enter = M->getOrInsertFunction("__polytope_nest_enter", VoidTy, PtrTy->getPointerTo(), PtrTy, PtrTy, PtrTy,
+										 PtrTy);
+	auto exitFunc = M->getOrInsertFunction("__polytope_nest_exit", VoidTy, PtrTy->getPointerTo());
+
+	/* Filled in by the runtime with its record for this nest on the first call */
+	auto* handle = new GlobalVariable(*M, PtrTy, false, GlobalValue::PrivateLinkage, ConstantPointerNull::get(PtrTy),
+									  "polytope.nest");
+	IRBuilder builder(preheader->getTerminator());
+	builder.SetCurrentDebugLocation(L.getStartLoc());
+	builder.CreateCall(enter, {handle,
+							   builder.CreateGlobalStringPtr(NestLocation(L), "polytope.loc"),
+							   builder.CreateGlobalStringPtr(F->getName(), "polytope.func"),
+							   builder.CreateGlobalStringPtr(kind, "polytope.kind"),
+							   builder.CreateGlobalStringPtr(MatrixToString(*report.transform), "polytope.transform")});
+	builder.SetInsertPoint(&*exit->getFirstInsertionPt());
+	builder.CreateCall(exitFunc, {handle});
+}
+
+/* Elements of the array read after the nest, as (row, column), when all such reads are of constant elements of a
+ * local allocation that does not escape, and none when it is certainly not read again. Reads go through GEPs shaped
+ * like the given access of the nest. Uses outside the nest that cannot run after it, and frees, are ignored. */
+static std::optional<std::vector<std::pair<long, long>>>
+ElementsReadAfterNest(Value* array, const GetElementPtrInst* shape, Loop& L, LoopStandardAnalysisResults& AR) {
+	auto* object = getUnderlyingObject(array);
+	if (!isa<AllocaInst>(object) && !isNoAliasCall(object) && !isAllocLikeFn(object, &AR.TLI)) {
+		return {};
+	}
+	auto* exit = L.getExitBlock();
+	std::vector<std::pair<long, long>> res;
+	SmallVector<Value*, 8> pointers = {object};
+	while (!pointers.empty()) {
+		auto* pointer = pointers.pop_back_val();
+		for (auto* U: pointer->users()) {
+			auto* I = dyn_cast<Instruction>(U);
+			if (!I) {
+				return {};
+			}
+			if (L.contains(I) || isFreeCall(I, &AR.TLI) || I->isLifetimeStartOrEnd()) {
+				continue;
+			}
+			if (isa<BitCastInst>(I) || isa<GetElementPtrInst>(I)) {
+				pointers.push_back(I);
+				continue;
+			}
+			/* Stored or passed on, it may be read through another pointer */
+			if (!isa<LoadInst>(I) && !(isa<StoreInst>(I) && cast<StoreInst>(I)->getValueOperand() != pointer)) {
+				return {};
+			}
+			if (isa<StoreInst>(I) || !isPotentiallyReachable(exit, I->getParent(), nullptr, &AR.DT, &AR.LI)) {
+				continue;
+			}
+			auto* GEP = dyn_cast<GetElementPtrInst>(pointer);
+			if (!GEP || GEP->getPointerOperand() != array || GEP->getSourceElementType() != shape->getSourceElementType() ||
+				GEP->getNumIndices() != shape->getNumIndices() ||
+				!std::equal(GEP->idx_begin(), GEP->idx_end() - 2, shape->idx_begin()) ||
+				!std::all_of(GEP->idx_begin(), GEP->idx_end(), [](auto& index) { return isa<ConstantInt>(index); })) {
+				return {};
+			}
+			res.emplace_back(cast<ConstantInt>(GEP->getOperand(GEP->getNumOperands() - 2))->getSExtValue(),
+							 cast<ConstantInt>(GEP->getOperand(GEP->getNumOperands() - 1))->getSExtValue());
+		}
+	}
+	return res;
+}
+
+/* Rows of the skewed layout a transformed nest touches, as offsets from its outer induction variable p, when every
+ * access is A[x + c] and so lies on row p + T0 c */
+static std::optional<std::pair<int, int>> RowWindow(const LoopDependencies& assignment,
+													const std::vector<std::vector<int>>& T) {
+	std::optional<std::pair<int, int>> res;
+	auto accesses = assignment.reads;
+	accesses.insert(accesses.end(), assignment.writes.begin(), assignment.writes.end());
+	for (auto& access: accesses) {
+		if (access.size() != 2 || access[0].size() != 3 || access[0][0] != 1 || access[0][1] != 0 ||
+			access[1][0] != 0 || access[1][1] != 1) {
+			return {};
+		}
+		int offset = T[0][0] * access[0][2] + T[0][1] * access[1][2];
+		res = res ? std::pair{std::min(res->first, offset), std::max(res->second, offset)} : std::pair{offset, offset};
+	}
+	return res;
+}
+
+/* Addresses of the memory accesses of the nest, when every one goes through a GEP on the same array defined outside
+ * the nest, with the same constant leading indices and two varying ones */
+static std::optional<std::vector<GetElementPtrInst*>> ArrayAccesses(Loop& L) {
+	std::vector<GetElementPtrInst*> accesses;
+	for (auto* BB: L.blocks()) {
+		for (auto& I: *BB) {
+			if (!I.mayReadOrWriteMemory()) {
+				continue;
+			}
+			auto* pointer = isa<LoadInst>(I) || isa<StoreInst>(I) ? getLoadStorePointerOperand(&I) : nullptr;
+			auto* GEP = dyn_cast_or_null<GetElementPtrInst>(pointer);
+			if (!GEP || GEP->getNumIndices() < 2 || GEP->getPointerAddressSpace() != 0 ||
+				(isa<StoreInst>(I) && cast<StoreInst>(I).getValueOperand() == GEP)) {
+				return {};
+			}
+			if (std::find(accesses.begin(), accesses.end(), GEP) == accesses.end()) {
+				accesses.push_back(GEP);
+			}
+		}
+	}
+	if (accesses.empty()) {
+		return {};
+	}
+	auto* first = accesses.front();
+	auto* array = first->getPointerOperand();
+	for (auto* GEP: accesses) {
+		if (GEP->getPointerOperand() != array || GEP->getSourceElementType() != first->getSourceElementType() ||
+			GEP->getNumIndices() != first->getNumIndices() ||
+			!std::equal(GEP->idx_begin(), GEP->idx_end() - 2, first->idx_begin()) ||
+			!std::all_of(GEP->idx_begin(), GEP->idx_end() - 2, [](auto& index) { return isa<Constant>(index); })) {
+			return {};
+		}
+	}
+	if (auto* I = dyn_cast<Instruction>(array); I && L.contains(I)) {
+		return {};
+	}
+	return accesses;
+}
+
+/* Keeps element x of the array at row T0 x and column T1 x of a buffer, less the origin, so that the inner loop of the
+ * transformed nest, along which T0 x is fixed, walks a row of the buffer with unit stride. The runtime
+ * (PolytopeLayout.c) allocates the buffer and copies the accessed box of the array into it before the nest, and back
+ * after it unless the array is dead, and every access of the nest is rewritten to the buffer. Applied only when the
+ * estimated cost of the nest in the skewed layout, copies included, is below that in the original layout. */
+std::optional<SkewedLayout> PolytopePass::EmitSkewedLayout(Loop& L, const NestReport& report,
+														   LoopStandardAnalysisResults& AR) {
+	auto& T = *report.transform;
+	auto& assignment = *report.assignment;
+	auto* preheader = L.getLoopPreheader();
+	auto* exit = L.getExitBlock();
+	if (!preheader || !exit || !report.bounds || !layout || T.size() != 2) {
+		return {};
+	}
+
+	auto accesses = ArrayAccesses(L);
+	if (!accesses) {
+		return {};
+	}
+	auto* first = accesses->front();
+	auto* array = first->getPointerOperand();
+
+	/* Accessed box of the array over a domain, and the origin and extent of its image under T */
+	struct Geometry {
+		std::vector<std::pair<int, int>> box;
+		std::vector<int> origin;
+		std::vector<long> extent;
+	};
+	auto geometry = [&](const std::vector<std::pair<int, int>>& domain) {
+		Geometry res;
+		for (auto [lower, upper]: ScheduleVerifier::AccessedBox(assignment, domain)) {
+			res.box.emplace_back((int) lower, (int) upper);
+		}
+		for (auto& row: T) {
+			long lower = 0;
+			long upper = 0;
+			for (size_t d = 0; d < 2; d++) {
+				long a = (long) row[d] * res.box[d].first;
+				long b = (long) row[d] * res.box[d].second;
+				lower += std::min(a, b);
+				upper += std::max(a, b);
+			}
+			res.origin.push_back((int) lower);
+			res.extent.push_back(upper - lower + 1);
+		}
+		return res;
+	};
+	SkewedLayout res;
+	auto readAfter = ElementsReadAfterNest(array, first, L, AR);
+	res.copyBack = !readAfter || !readAfter->empty();
+	auto full = geometry(*report.bounds);
+	res.rows = full.extent[0];
+	res.columns = full.extent[1];
+
+	/* The nest touches rows p + window of the skewed layout at outer iteration p, and p visits every row in turn when
+	 * T0 is primitive, so a row is done with once p passes it. The array can then be replaced by the window, as long as
+	 * whatever is read after the nest is in the last window or was never written. */
+	auto window = Contract ? RowWindow(assignment, T) : std::nullopt;
+	if (window && (std::gcd(T[0][0], T[0][1]) != 1 || !readAfter)) {
+		window.reset();
+	}
+	/* First and last value of p */
+	long firstRow = LONG_MAX;
+	long lastRow = LONG_MIN;
+	for (auto a: {report.bounds->at(0).first, report.bounds->at(0).second}) {
+		for (auto b: {report.bounds->at(1).first, report.bounds->at(1).second}) {
+			firstRow = std::min(firstRow, (long) T[0][0] * a + (long) T[0][1] * b);
+			lastRow = std::max(lastRow, (long) T[0][0] * a + (long) T[0][1] * b);
+		}
+	}
+	if (window) {
+		auto written = ScheduleVerifier::AccessedBox(LoopDependencies(assignment.writes, {}), *report.bounds);
+		for (auto [a, b]: *readAfter) {
+			long row = (long) T[0][0] * a + (long) T[0][1] * b;
+			bool inWindow = row >= lastRow + window->first && row <= lastRow + window->second;
+			bool isWritten = a >= written[0].first && a <= written[0].second && b >= written[1].first &&
+							 b <= written[1].second;
+			if (!inWindow && isWritten) {
+				LLVM_DEBUG(dbgs() << "Element (" << a << ", " << b << ") is read after the nest, not contracting\n");
+				window.reset();
+				break;
+			}
+		}
+	}
+	/* Elements the loader of a contracted array can skip: with a single write every element of the written box is
+	 * written before the nest reads it when each read trails the write, so its old value is never needed */
+	std::vector<std::pair<long, long>> skipped = {{1, 0}, {1, 0}};
+	if (window && assignment.writes.size() == 1) {
+		auto& write = assignment.writes[0];
+		bool trailing = std::all_of(assignment.reads.begin(), assignment.reads.end(), [&](auto& read) {
+			std::vector<int> distance = {write[0][2] - read[0][2], write[1][2] - read[1][2]};
+			return distance > std::vector<int>{0, 0};
+		});
+		if (trailing) {
+			skipped = ScheduleVerifier::AccessedBox(LoopDependencies(assignment.writes, {}), *report.bounds);
+		}
+	}
+	if (window) {
+		res.contracted = true;
+		res.fullRows = res.rows;
+		res.rows = window->second - window->first + 1;
+		res.savedBytes = (unsigned long) ((res.fullRows - res.rows) * res.columns) * layout->elementSize;
+	} else if (!SkewLayout) {
+		return {};
+	}
+
+	/* A contracted array is never copied as a whole and its window stays in the cache, so only skewed copies are
+	 * costed */
+	if (!res.contracted) {
+		auto levels = CacheSimulator::ParseHierarchy(CacheHierarchy).value_or(CacheSimulator::DefaultHierarchy());
+		double elements = 1;
+		for (auto [lower, upper]: full.box) {
+			elements *= upper - lower + 1;
+		}
+		double footprint = std::ceil(elements * layout->elementSize / levels[0].line);
+		res.originalCost = CacheSimulator::EstimateNest(assignment, *report.bounds, T, {layout->rowLength, 1},
+														layout->elementSize, footprint, levels).Cost();
+		std::vector<std::pair<long, long>> box(full.box.begin(), full.box.end());
+		res.skewedCost = CacheSimulator::EstimateSkewedNest(assignment, *report.bounds, T, *layout, box, res.columns,
+															levels, res.copyBack).Cost();
+		LLVM_DEBUG(dbgs() << "Skewed layout: cost " << res.skewedCost << " with copies, " << res.originalCost
+						  << " in the original layout\n");
+		if (res.skewedCost >= res.originalCost) {
+			NumSkewNotProfitable++;
+			return res;
+		}
+	}
+
+	auto* M = L.getHeader()->getModule();
+	auto& context = M->getContext();
+	auto* Int64Ty = Type::getInt64Ty(context);
+	auto* PtrTy = Type::getInt8PtrTy(context);
+	/* In the field order of PolytopeLayout.c */
+	std::vector<uint64_t> fields = {(uint64_t) layout->rowLength, layout->elementSize};
+	for (auto [lower, upper]: full.box) {
+		fields.push_back((uint64_t) (long) lower);
+		fields.push_back((uint64_t) (long) upper);
+	}
+	for (auto& row: T) {
+		fields.push_back((uint64_t) (long) row[0]);
+		fields.push_back((uint64_t) (long) row[1]);
+	}
+	fields.push_back((uint64_t) (long) full.origin[0]);
+	fields.push_back((uint64_t) (long) full.origin[1]);
+	fields.push_back((uint64_t) res.rows);
+	fields.push_back((uint64_t) res.columns);
+	for (auto [lower, upper]: skipped) {
+		fields.push_back((uint64_t) lower);
+		fields.push_back((uint64_t) upper);
+	}
+	fields.push_back(CacheSimulator::SkewCopyTile);
+	auto* init = ConstantDataArray::get(context, fields);
+	auto* descriptor = new GlobalVariable(*M, init->getType(), true, GlobalValue::PrivateLinkage, init,
+										  "polytope.skew");
+	auto enter = M->getOrInsertFunction("__polytope_skew_enter", PtrTy, PtrTy, Int64Ty->getPointerTo());
+	auto rollingEnter = M->getOrInsertFunction("__polytope_rolling_enter", PtrTy, Int64Ty->getPointerTo());
+	auto copyRows = M->getOrInsertFunction("__polytope_skew_rows", Type::getVoidTy(context), PtrTy, PtrTy,
+										   Int64Ty->getPointerTo(), Int64Ty, Int64Ty, Type::getInt32Ty(context));
+	auto exitFunc = M->getOrInsertFunction("__polytope_skew_exit", Type::getVoidTy(context), PtrTy, PtrTy,
+										   Int64Ty->getPointerTo(), Type::getInt32Ty(context));
+
+	IRBuilder builder(preheader->getTerminator());
+	builder.SetCurrentDebugLocation(L.getStartLoc());
+	/* Element (0, 0) of the array */
+	SmallVector<Value*, 4> indices(first->idx_begin(), first->idx_end() - 2);
+	indices.append(2, builder.getInt64(0));
+	auto* arrayPtr = builder.CreateBitCast(builder.CreateGEP(first->getSourceElementType(), array, indices), PtrTy,
+										   "polytope.array");
+	auto* descriptorPtr = builder.CreateConstInBoundsGEP2_32(init->getType(), descriptor, 0, 0);
+	auto* buffer = res.contracted ? builder.CreateCall(rollingEnter, {descriptorPtr}, "polytope.rolling")
+								  : builder.CreateCall(enter, {arrayPtr, descriptorPtr}, "polytope.skewed");
+	auto* elementTy = first->getResultElementType();
+	auto* elements = builder.CreateBitCast(buffer, elementTy->getPointerTo());
+
+	for (auto* GEP: *accesses) {
+		builder.SetInsertPoint(GEP);
+		auto* a = builder.CreateSExtOrTrunc(GEP->getOperand(GEP->getNumOperands() - 2), Int64Ty);
+		auto* b = builder.CreateSExtOrTrunc(GEP->getOperand(GEP->getNumOperands() - 1), Int64Ty);
+		auto coordinate = [&](int r) {
+			auto* sum = builder.CreateAdd(builder.CreateMul(a, builder.getInt64(T[r][0])),
+										  builder.CreateMul(b, builder.getInt64(T[r][1])));
+			return builder.CreateSub(sum, builder.getInt64(full.origin[r]));
+		};
+		auto* row = coordinate(0);
+		if (res.contracted) {
+			row = builder.CreateURem(row, builder.getInt64(res.rows), "rolling.row");
+		}
+		auto* index = builder.CreateAdd(builder.CreateMul(row, builder.getInt64(res.columns)), coordinate(1),
+										"skewed.index");
+		auto* skewedGEP = builder.CreateInBoundsGEP(elementTy, elements, index, GEP->getName() + ".skewed");
+		GEP->replaceAllUsesWith(skewedGEP);
+		GEP->eraseFromParent();
+	}
+
+	builder.SetInsertPoint(&*exit->getFirstInsertionPt());
+	if (res.contracted) {
+		/* The window of the first iteration but its last row, which the outer header loads with the others */
+		IRBuilder preheaderBuilder(preheader->getTerminator());
+		preheaderBuilder.CreateCall(copyRows, {arrayPtr, buffer, descriptorPtr,
+											   preheaderBuilder.getInt64(firstRow + window->first),
+											   preheaderBuilder.getInt64(firstRow + window->second - 1),
+											   preheaderBuilder.getInt32(1)});
+		/* Loads the row the window moves onto at each outer iteration */
+		IRBuilder headerBuilder(L.getHeader()->getTerminator());
+		auto* placeholder = PoisonValue::get(Int64Ty);
+		auto* rowLoader = headerBuilder.CreateCall(copyRows, {arrayPtr, buffer, descriptorPtr, placeholder,
+															  placeholder, headerBuilder.getInt32(1)});
+		outerIVArguments.push_back({rowLoader, 3, window->second});
+		outerIVArguments.push_back({rowLoader, 4, window->second});
+		if (res.copyBack) {
+			builder.CreateCall(copyRows, {arrayPtr, buffer, descriptorPtr, builder.getInt64(lastRow + window->first),
+										  builder.getInt64(lastRow + window->second), builder.getInt32(0)});
+		}
+	}
+	builder.CreateCall(exitFunc, {arrayPtr, buffer, descriptorPtr, builder.getInt32(res.copyBack && !res.contracted)});
+	res.applied = true;
+	if (res.contracted) {
+		NumContracted++;
+	} else {
+		NumSkewedLayouts++;
+	}
+	if (!res.copyBack) {
+		NumCopyBackElided++;
+	}
+	return res;
+}
+
+/* Backs the array of the nest by a memory-mapped file when the runtime (PolytopeOutOfCore.c) finds it too large for
+ * memory, and tells the kernel which pages the nest needs next and which it is done with. The outer loop of the
+ * transformed nest is split into bands of -polytope-out-of-core-band iterations, which run in order as the wavefronts
+ * they are. At the start of each band the runtime prefetches the pages of the next band and of its halo, the rows the
+ * window of the accesses reaches beyond it, and releases the pages only earlier bands touch. The array must come from
+ * malloc and not escape, so that its allocation and frees can be replaced. Returns the band, or 0 when the nest does
+ * not qualify. */
+unsigned PolytopePass::EmitOutOfCore(Loop& L, const NestReport& report, LoopStandardAnalysisResults& AR) {
+	auto& T = *report.transform;
+	auto* preheader = L.getLoopPreheader();
+	if (!preheader || !report.bounds || !layout || T.size() != 2 || !OutOfCoreBand) {
+		return 0;
+	}
+	auto accesses = ArrayAccesses(L);
+	auto window = RowWindow(*report.assignment, T);
+	if (!accesses || !window || std::gcd(T[0][0], T[0][1]) != 1) {
+		return 0;
+	}
+	auto* first = accesses->front();
+	auto* allocation = dyn_cast<CallInst>(getUnderlyingObject(first->getPointerOperand()));
+	auto* callee = allocation ? allocation->getCalledFunction() : nullptr;
+	LibFunc func;
+	bool replaced = callee && callee->getName() == "__polytope_ooc_alloc";
+	if (!replaced && (!callee || !AR.TLI.getLibFunc(*callee, func) || func != LibFunc_malloc)) {
+		return 0;
+	}
+	SmallVector<CallInst*, 4> frees;
+	SmallVector<Value*, 8> pointers = {allocation};
+	while (!pointers.empty()) {
+		auto* pointer = pointers.pop_back_val();
+		for (auto* U: pointer->users()) {
+			auto* I = cast<Instruction>(U);
+			if (isa<BitCastInst>(I) || isa<GetElementPtrInst>(I)) {
+				pointers.push_back(I);
+			} else if (isFreeCall(I, &AR.TLI)) {
+				frees.push_back(cast<CallInst>(I));
+			} else if (!isa<LoadInst>(I) && !I->isLifetimeStartOrEnd() &&
+					   !(isa<StoreInst>(I) && cast<StoreInst>(I)->getValueOperand() != pointer) &&
+					   !(isa<CallInst>(I) && cast<CallInst>(I)->getCalledFunction() &&
+						 cast<CallInst>(I)->getCalledFunction()->getName().startswith("__polytope_ooc_"))) {
+				return 0;
+			}
+		}
+	}
+
+	auto* M = preheader->getModule();
+	auto& context = M->getContext();
+	auto* Int64Ty = Type::getInt64Ty(context);
+	auto* PtrTy = Type::getInt8PtrTy(context);
+	if (!replaced) {
+		allocation->setCalledFunction(M->getOrInsertFunction("__polytope_ooc_alloc", allocation->getFunctionType()));
+		for (auto* free: frees) {
+			free->setCalledFunction(M->getOrInsertFunction("__polytope_ooc_free", free->getFunctionType()));
+		}
+	}
 
-		if (preservesDependencies) {
-			return transform;
+	long firstRow = LONG_MAX;
+	for (auto a: {report.bounds->at(0).first, report.bounds->at(0).second}) {
+		for (auto b: {report.bounds->at(1).first, report.bounds->at(1).second}) {
+			firstRow = std::min(firstRow, (long) T[0][0] * a + (long) T[0][1] * b);
 		}
 	}
-	if (depth == 0) {
-		return {};
+	/* In the field order of PolytopeOutOfCore.c */
+	std::vector<uint64_t> fields = {(uint64_t) layout->rowLength, layout->elementSize};
+	for (auto [lower, upper]: ScheduleVerifier::AccessedBox(*report.assignment, *report.bounds)) {
+		fields.push_back((uint64_t) lower);
+		fields.push_back((uint64_t) upper);
 	}
-	depth--;
-
-	auto transform1 = ComputeAffineTransformationInner(assignment, genA, genB, IntegerSolver::Multiply(genA, transform),
-													   depth);
-	if (transform1) {
-		return transform1;
+	for (long field: {(long) T[0][0], (long) T[0][1], (long) window->first, (long) window->second, firstRow,
+					  (long) OutOfCoreBand}) {
+		fields.push_back((uint64_t) field);
 	}
+	auto* init = ConstantDataArray::get(context, fields);
+	auto* descriptor = new GlobalVariable(*M, init->getType(), true, GlobalValue::PrivateLinkage, init,
+										  "polytope.ooc");
+	auto advance = M->getOrInsertFunction("__polytope_ooc_advance", Type::getVoidTy(context), PtrTy,
+										  Int64Ty->getPointerTo(), Int64Ty);
 
-	auto transform2 = ComputeAffineTransformationInner(assignment, genA, genB, IntegerSolver::Multiply(genB, transform),
-													   depth);
-	return transform2;
+	IRBuilder builder(preheader->getTerminator());
+	builder.SetCurrentDebugLocation(L.getStartLoc());
+	SmallVector<Value*, 4> indices(first->idx_begin(), first->idx_end() - 2);
+	indices.append(2, builder.getInt64(0));
+	auto* arrayPtr = builder.CreateBitCast(builder.CreateGEP(first->getSourceElementType(),
+															 first->getPointerOperand(), indices), PtrTy,
+										   "polytope.array");
+	builder.SetInsertPoint(L.getHeader()->getTerminator());
+	auto* call = builder.CreateCall(advance, {arrayPtr, builder.CreateConstInBoundsGEP2_32(init->getType(),
+																							descriptor, 0, 0),
+											  PoisonValue::get(Int64Ty)});
+	outerIVArguments.push_back({call, 2, 0});
+	NumOutOfCore++;
+	return OutOfCoreBand;
 }
 
-std::optional<std::vector<std::vector<int>>>
-PolytopePass::ComputeAffineTransformation(const LoopDependencies& assignment) {
-	unsigned dim = IVList.size();
-
-	if (assignment.HasCacheMisses()) {
-		return IntegerSolver::GetInitialTransform(dim);
+/* Emits the original nest and up to -polytope-autotune-variants transformed copies of it: the chosen transform, the
+ * interchange when it is legal and the other transforms collected by the search, each followed by its tiled form when
+ * -polytope-tile is given. The preheader becomes a dispatch block
+ * switching on __polytope_variant_select, and __polytope_variant_exit is called in the exit block all variants share,
+ * so the runtime (PolytopeTune.c) can time each variant. The copies are reported to the loop pass manager as siblings
+ * of the nest, and are marked as transformed like it, so later loop passes visit them but this one leaves them alone.
+ * Returns false, leaving the nest untouched, when the exit block has phis that would have to be merged across
+ * variants, or when no transform is legal. */
+bool PolytopePass::EmitVariants(Loop& L, const NestReport& report, LoopStandardAnalysisResults& AR, LPMUpdater& U) {
+	auto* preheader = L.getLoopPreheader();
+	auto* exit = L.getExitBlock();
+	if (!preheader || !exit || !exit->phis().empty() || L.getSubLoops().size() != 1) {
+		return false;
 	}
 
-	if (!assignment.HasLoopCarrierDependencies()) {
-		return {};
+	/* Each transform, checked again as it may come from the cache, followed by its tiled form with -polytope-tile */
+	using Variant = std::pair<std::vector<std::vector<int>>, std::vector<int>>;
+	std::vector<Variant> variants;
+	auto add = [&](const Variant& variant) {
+		if (variants.size() < AutotuneVariants && std::find(variants.begin(), variants.end(), variant) == variants.end()) {
+			variants.push_back(variant);
+		}
+	};
+	auto addVariant = [&](const std::vector<std::vector<int>>& T) {
+		if (!IsLegalTransform(*report.assignment, T)) {
+			return;
+		}
+		add({T, {}});
+		auto tiled = T;
+		int skew = 0;
+		if (!Tile.empty()) {
+			if (auto tiles = TileTransform(*report.assignment, report.bounds, tiled, skew); !tiles.empty()) {
+				add({tiled, tiles});
+			}
+		}
+	};
+	addVariant(*report.transform);
+	addVariant(IntegerSolver::GetInitialTransform(IVList.size()));
+	std::for_each(report.alternatives.begin(), report.alternatives.end(), addVariant);
+	if (variants.empty()) {
+		return false;
 	}
 
-	auto T = IntegerSolver::GetInitialTransform(dim);
-	auto generators = IntegerSolver::GetGenerators(dim);
-	return ComputeAffineTransformationInner(assignment, generators.first, generators.second,
-											T, 5);
-}
+	auto* F = L.getHeader()->getParent();
+	auto* M = F->getParent();
+	auto& context = M->getContext();
 
-PreservedAnalyses PolytopePass::run(Loop& L, LoopAnalysisManager& AM, LoopStandardAnalysisResults& AR, LPMUpdater& U) {
-	auto assignment = RunAnalysis(L, AR);
-	if (!assignment) {
-		return PreservedAnalyses::all();
+	/* The old preheader becomes the dispatch block and the original nest gets a preheader of its own */
+	auto* dispatch = preheader;
+	SplitEdge(dispatch, L.getHeader(), &AR.DT, &AR.LI);
+	std::vector<Loop*> clones;
+	/* Reductions of each clone, for codegen to privatise in its copy of the body */
+	std::vector<std::vector<Reduction>> cloneReductions;
+	for (size_t v = 0; v < variants.size(); v++) {
+		ValueToValueMapTy VMap;
+		SmallVector<BasicBlock*, 8> blocks;
+		auto* clone = cloneLoopWithPreheader(exit, dispatch, &L, VMap, ".v" + Twine(v + 1), &AR.LI, &AR.DT, blocks);
+		remapInstructionsInBlocks(blocks, VMap);
+		clones.push_back(clone);
+		cloneReductions.push_back(reductions);
+		for (auto& reduction: cloneReductions.back()) {
+			reduction.store = cast<StoreInst>(VMap[reduction.store]);
+			reduction.load = cast<LoadInst>(VMap[reduction.load]);
+			reduction.update = cast<Instruction>(VMap[reduction.update]);
+		}
 	}
 
-	auto transformation = ComputeAffineTransformation(*assignment);
-	if (!transformation) {
-		dbgs() << "No transformation found\n";
-		return PreservedAnalyses::all();
+	std::vector<std::string> descriptions = {"original"};
+	for (auto& [T, tiles]: variants) {
+		descriptions.push_back(MatrixToString(T));
+		if (!tiles.empty()) {
+			descriptions.back() += " in " + std::to_string(tiles[0]) + "x" + std::to_string(tiles[1]) + " tiles";
+		}
+	}
+	std::string key = NestLocation(L) + ";" + CanonicalNest(*report.assignment) + "variants:";
+	for (auto& description: descriptions) {
+		key += description + ";";
 	}
-	auto T = transformation.value();
-	auto H = IntegerSolver::HermiteNormal(T);
-	auto det = IntegerSolver::Det(T);
-
-	auto outerBounds = outerLoop->getBounds(AR.SE).getValue();
-	auto innerBounds = innerLoop->getBounds(AR.SE).getValue();
 
-	Module* M = L.getHeader()->getModule();
-	auto Int32Ty = outerLoop->getInductionVariable(AR.SE)->getType();
-	auto FloatTy = Type::getFloatTy(outerLoop->getHeader()->getContext());
-	std::vector<Type*> IntTypes(2, Int32Ty);
-	FunctionType* FTMin = FunctionType::get(Int32Ty, IntTypes, false);
-	FunctionType* FTMax = FunctionType::get(Int32Ty, IntTypes, false);
-	Function* minFunc = Function::Create(FTMin, Function::ExternalLinkage, "llvm.smin.i32", M);
-	Function* maxFunc = Function::Create(FTMax, Function::ExternalLinkage, "llvm.smax.i32", M);
+	auto* Int32Ty = Type::getInt32Ty(context);
+	auto* PtrTy = Type::getInt8PtrTy(context);
+	auto select = M->getOrInsertFunction("__polytope_variant_select", Int32Ty, PtrTy->getPointerTo(), PtrTy, PtrTy,
+										 Int32Ty);
+	auto exitFunc = M->getOrInsertFunction("__polytope_variant_exit", Type::getVoidTy(context), PtrTy->getPointerTo());
+	/* Filled in by the runtime with its record for this nest on the first call */
+	auto* handle = new GlobalVariable(*M, PtrTy, false, GlobalValue::PrivateLinkage, ConstantPointerNull::get(PtrTy),
+									  "polytope.tune");
 
-	/* Extract redundant IV instructions */
-	auto oldOuterIV = outerLoop->getInductionVariable(AR.SE);
-	auto oldInnerIV = innerLoop->getInductionVariable(AR.SE);
-	auto oldOuterComparison = outerLoop->getLatchCmpInst();
-	auto oldInnerComparison = innerLoop->getLatchCmpInst();
-	/* Retrieve increment instructions by analysing comparison */
-	auto oldOuterIncrement = cast<Instruction>(oldOuterIV->getIncomingValueForBlock(outerLoop->getLoopLatch()));
-	auto oldInnerIncrement = cast<Instruction>(oldInnerIV->getIncomingValueForBlock(innerLoop->getLoopLatch()));
-	auto oldOuterBranch = FindInstr(Instruction::Br, outerLoop->getLoopLatch()).value();
-	auto oldInnerBranch = FindInstr(Instruction::Br, innerLoop->getLoopLatch()).value();
+	auto* originalPreheader = dispatch->getTerminator()->getSuccessor(0);
+	IRBuilder builder(dispatch->getTerminator());
+	builder.SetCurrentDebugLocation(L.getStartLoc());
+	auto* variant = builder.CreateCall(select, {handle,
+												builder.CreateGlobalStringPtr(TransformCache::Fingerprint(key),
+																			  "polytope.key"),
+												builder.CreateGlobalStringPtr(NestLocation(L), "polytope.loc"),
+												builder.getInt32(variants.size() + 1)}, "variant");
+	auto* dispatchSwitch = builder.CreateSwitch(variant, originalPreheader, clones.size());
+	for (size_t v = 0; v < clones.size(); v++) {
+		dispatchSwitch->addCase(builder.getInt32(v + 1), clones[v]->getLoopPreheader());
+	}
+	dispatch->getTerminator()->eraseFromParent();
+	builder.SetInsertPoint(&*exit->getFirstInsertionPt());
+	builder.CreateCall(exitFunc, {handle});
 
-	auto LL = std::make_tuple<>(&outerBounds.getInitialIVValue(), &innerBounds.getInitialIVValue());
-	auto LR = std::make_tuple<>(&outerBounds.getFinalIVValue(), &innerBounds.getInitialIVValue());
-	auto UL = std::make_tuple<>(&outerBounds.getInitialIVValue(), &innerBounds.getFinalIVValue());
-	auto UR = std::make_tuple<>(&outerBounds.getFinalIVValue(), &innerBounds.getFinalIVValue());
+	/* The exit block now joins every variant, so give each its own exit block to keep them in simplified form */
+	AR.DT.recalculate(*F);
+	formDedicatedExitBlocks(&L, &AR.DT, &AR.LI, nullptr, true);
+	for (auto* clone: clones) {
+		formDedicatedExitBlocks(clone, &AR.DT, &AR.LI, nullptr, true);
+	}
 
-	std::tuple<Value*, Value*> outerLBPoint;
-	std::tuple<Value*, Value*> outerUBPoint;
-	std::tuple<Value*, Value*> innerLBPoint;
-	std::tuple<Value*, Value*> innerUBPoint;
-	if (T[0][0] > 0 && T[0][1] > 0) {
-		outerLBPoint = LL;
-		outerUBPoint = UR;
-		if (det > 0) {
-			innerLBPoint = LR;
-			innerUBPoint = UL;
-		} else {
-			innerLBPoint = UL;
-			innerUBPoint = LR;
-		}
-	} else if (T[0][0] <= 0 && T[0][1] > 0) {
-		outerLBPoint = LR;
-		outerUBPoint = UL;
-		if (det > 0) {
-			innerLBPoint = UR;
-			innerUBPoint = LL;
-		} else {
-			innerLBPoint = LL;
-			innerUBPoint = UR;
+	auto* originalOuter = outerLoop;
+	auto* originalInner = innerLoop;
+	auto originalReductions = std::move(reductions);
+	unsigned privatised = 0;
+	for (size_t v = 0; v < clones.size(); v++) {
+		outerLoop = clones[v];
+		innerLoop = clones[v]->getSubLoops().front();
+		reductions = std::move(cloneReductions[v]);
+		GenerateTransformedNest(variants[v].first, *report.assignment, AR, variants[v].second);
+		/* A tiled copy now runs inside its tile loops, and the outermost of them is the sibling */
+		while (clones[v]->getParentLoop() != L.getParentLoop()) {
+			clones[v] = clones[v]->getParentLoop();
+			addStringMetadataToLoop(clones[v], "polytope.transformed", 1);
 		}
-	} else if (T[0][0] > 0 && T[0][1] <= 0) {
-		outerLBPoint = UL;
-		outerUBPoint = LR;
-		if (det > 0) {
-			innerLBPoint = LL;
-			innerUBPoint = UR;
-		} else {
-			innerLBPoint = UR;
-			innerUBPoint = LL;
+		privatised += privatisedReductions;
+		NumVariants++;
+	}
+	outerLoop = originalOuter;
+	innerLoop = originalInner;
+	reductions = std::move(originalReductions);
+	privatisedReductions = privatised;
+	/* A release LLVM does not record the parent loop that the updater checks new siblings against */
+	U.setParentLoop(L.getParentLoop());
+	U.addSiblingLoops(clones);
+
+	OptimizationRemarkEmitter ORE(F);
+	ORE.emit([&]() {
+		OptimizationRemarkAnalysis remark(DEBUG_TYPE, "Variants", L.getStartLoc(), L.getHeader());
+		remark << "emitted " << ore::NV("Variants", (unsigned) descriptions.size()) << " variants for runtime selection:";
+		for (size_t v = 0; v < descriptions.size(); v++) {
+			remark << (v ? "; " : " ") << ore::NV(("Variant" + std::to_string(v)).c_str(), descriptions[v]);
 		}
+		return remark;
+	});
+	return true;
+}
+
+/* Source location of the nest, or the function and header names when there is no debug info */
+std::string PolytopePass::NestLocation(Loop& L) {
+	std::string location;
+	raw_string_ostream os(location);
+	if (auto loc = L.getStartLoc()) {
+		os << loc->getFilename() << ":" << loc.getLine() << ":" << loc.getCol();
 	} else {
-		outerLBPoint = UR;
-		outerUBPoint = LL;
-		if (det > 0) {
-			innerLBPoint = UL;
-			innerUBPoint = LR;
-		} else {
-			innerLBPoint = LR;
-			innerUBPoint = UL;
-		}
+		os << L.getHeader()->getParent()->getName() << ":" << L.getHeader()->getName();
 	}
+	return os.str();
+}
 
-	/* Update outer loop header */
-	IRBuilder builder(outerLoop->getHeader()->getContext());
-	builder.SetInsertPoint(outerLoop->getHeader()->getFirstNonPHI());
-	auto outerLowerBound = builder.CreateAdd(
-			builder.CreateMul(IntToValue(T[0][0]), std::get<0>(outerLBPoint)),
-			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(outerLBPoint)), "p.lower");
-	auto outerIV = builder.CreatePHI(Int32Ty, 2, "p");
-
-	/* Update outer loop latch */
-	builder.SetInsertPoint(outerLoop->getLoopLatch()->getTerminator());
-	auto outerIncrement = builder.CreateAdd(outerIV, IntToValue(H[0][0]), "p.inc");
-	outerIV->addIncoming(outerLowerBound, outerLoop->getLoopPreheader());
-	outerIV->addIncoming(outerIncrement, outerLoop->getLoopLatch());
-	auto outerUpperBound = builder.CreateAdd(
-			builder.CreateMul(IntToValue(T[0][0]), std::get<0>(outerUBPoint)),
-			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(outerUBPoint)), "p.upper");
-	auto outerComp = builder.CreateCmp(CmpInst::ICMP_SLE, outerIncrement, outerUpperBound);
-	auto outerBranch = builder.CreateCondBr(outerComp, outerLoop->getHeader(), outerLoop->getExitBlock());
+void PolytopePass::CountRejection() {
+	switch (rejection) {
+		case Rejection::NotPerfect:
+			NumNotPerfect++;
+			break;
+		case Rejection::NonAffine:
+			NumNonAffine++;
+			break;
+		case Rejection::NoDependencies:
+			NumNoDependencies++;
+			break;
+		case Rejection::NoTransformInBudget:
+			NumNoTransform++;
+			break;
+		case Rejection::IllegalSchedule:
+			NumIllegalSchedule++;
+			break;
+		case Rejection::ColdNest:
+			NumColdNests++;
+			break;
+		case Rejection::ShortTripCount:
+			NumShortTripCount++;
+			break;
+		case Rejection::None:
+			break;
+	}
+}
 
-	/* Determine values for inner loop bounds */
-	builder.SetInsertPoint(innerLoop->getLoopPreheader()->getTerminator());
+void PolytopePass::EmitRemarks(Loop& L, const NestReport& report) {
+	OptimizationRemarkEmitter ORE(L.getHeader()->getParent());
+	auto loc = L.getStartLoc();
+	auto* header = L.getHeader();
+	auto& assignment = report.assignment;
+	auto& times = report.times;
 
-	auto l1 = builder.CreateSub(
-			builder.CreateSub(outerIV, builder.CreateMul(IntToValue(T[0][0]), std::get<0>(innerLBPoint))),
-			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(innerLBPoint)), "l1");
+	if (assignment) {
+		ORE.emit([&]() {
+			return OptimizationRemarkAnalysis(DEBUG_TYPE, "Dependences", loc, header)
+					<< "nest has " << ore::NV("Writes", (unsigned) assignment->writes.size()) << " writes and "
+					<< ore::NV("Reads", (unsigned) assignment->reads.size()) << " reads with dependence vectors "
+					<< ore::NV("DependenceVectors", MatrixToString(assignment->GetDependenceVectors()));
+		});
+		if (!assignment->reductions.empty()) {
+			ORE.emit([&]() {
+				return OptimizationRemarkAnalysis(DEBUG_TYPE, "Reductions", loc, header)
+						<< "recognised " << ore::NV("Reductions", (unsigned) assignment->reductions.size())
+						<< " reductions, left out of the dependences as their updates commute";
+			});
+		}
+	}
 
-	// TODO: Change the check for zero to remove the zero division entirely
-	auto l1Ceil = builder.CreateAdd(
-		builder.CreateCall(maxFunc, {
-			(T[0][0] == 0) ? IntToValue(INT_MIN) : builder.CreateAdd(
-				builder.CreateMul(
-					IntToValue(T[1][0]),
-					builder.CreateSDiv(l1, IntToValue(T[0][0]))
-				),
-				builder.CreateCall(minFunc, {
-					builder.CreateSRem(l1, IntToValue(T[0][0])),
-					IntToValue(1)
-				})
-			),
-			(T[0][1] == 0) ? IntToValue(INT_MIN) : builder.CreateAdd(
-				builder.CreateMul(
-					IntToValue(T[1][1]),
-					builder.CreateSDiv(l1, IntToValue(T[0][1]))
-				),
-				builder.CreateCall(minFunc, {
-					builder.CreateSRem(l1, IntToValue(T[0][1])),
-					IntToValue(1)
-				})
-			)
-		}),
-		builder.CreateAdd(
-			builder.CreateMul(IntToValue(T[1][0]), std::get<0>(innerLBPoint)),
-			builder.CreateMul(IntToValue(T[1][1]), std::get<1>(innerLBPoint))
-		),
-		"l1.ceil"
-	);
+	auto& profile = report.profile;
+	auto profiled = std::any_of(profile.tripCounts.begin(), profile.tripCounts.end(),
+								[](auto tripCount) { return tripCount.has_value(); });
+	if (profile.count || profiled) {
+		ORE.emit([&]() {
+			OptimizationRemarkAnalysis remark(DEBUG_TYPE, "Profile", loc, header);
+			remark << "profile:";
+			if (profile.count) {
+				remark << " nest body executed " << ore::NV("Count", *profile.count) << " times"
+					   << (profile.hot ? " (hot)" : profile.cold ? " (cold)" : "") << ",";
+			}
+			remark << " trip counts";
+			for (size_t d = 0; d < profile.tripCounts.size(); d++) {
+				auto name = "TripCount" + std::to_string(d);
+				remark << (d ? ", " : " ")
+					   << ore::NV(name.c_str(), profile.tripCounts[d] ? std::to_string(*profile.tripCounts[d]) : "?");
+			}
+			return remark;
+		});
+	}
 
-	auto l3 = builder.CreateSub(
-			builder.CreateSub(outerIV, builder.CreateMul(IntToValue(T[0][0]), std::get<0>(innerUBPoint))),
-			builder.CreateMul(IntToValue(T[0][1]), std::get<1>(innerUBPoint)), "l3");
+	for (auto& candidate: report.ranking) {
+		ORE.emit([&]() {
+			OptimizationRemarkAnalysis remark(DEBUG_TYPE, "CandidateCost", loc, header);
+			remark << "candidate " << ore::NV("Transform", MatrixToString(candidate.transform)) << " simulates misses";
+			for (size_t level = 0; level < candidate.stats.misses.size(); level++) {
+				auto name = "L" + std::to_string(level + 1);
+				remark << (level ? ", " : " ") << name << " "
+					   << ore::NV((name + "Misses").c_str(), candidate.stats.misses[level]);
+			}
+			remark << ", mean reuse distance "
+				   << ore::NV("MeanReuseDistance", formatv("{0:F1}", candidate.stats.meanReuseDistance).str());
+			return remark;
+		});
+	}
 
-	/* Upper bound for inner loop */
-	// TODO: Change the check for zero to remove the zero division entirely
-	auto innerUpperBound = builder.CreateAdd(
-			builder.CreateCall(minFunc, {
-				(T[0][0] == 0) ? IntToValue(MAX_INT) :builder.CreateAdd(
-					builder.CreateMul(
-						IntToValue(T[1][0]),
-						builder.CreateSDiv(l3, IntToValue(T[0][0]))
-					),
-					builder.CreateCall(minFunc, {
-						builder.CreateSRem(l3, IntToValue(T[0][0])),
-						IntToValue(1)
-					})
-				),
-				(T[0][1] == 0) ? IntToValue(MAX_INT) : builder.CreateAdd(
-					builder.CreateMul(
-						IntToValue(T[1][1]),
-						builder.CreateSDiv(l3, IntToValue(T[0][1]))
-					),
-					builder.CreateCall(minFunc, {
-						builder.CreateSRem(l3, IntToValue(T[0][1])),
-						IntToValue(1)
-					})
-				)
-			}),
-			builder.CreateAdd(
-				builder.CreateMul(IntToValue(T[1][0]), std::get<0>(innerUBPoint)),
-				builder.CreateMul(IntToValue(T[1][1]), std::get<1>(innerUBPoint))
-			),
-		"q.upper"
-	);
+	if (auto& skewed = report.skewedLayout) {
+		auto costs = [&](auto& remark) {
+			remark << "estimated cost " << ore::NV("SkewedCost", formatv("{0:F0}", skewed->skewedCost).str())
+				   << " with the copies against "
+				   << ore::NV("OriginalCost", formatv("{0:F0}", skewed->originalCost).str()) << " in the original layout";
+		};
+		if (skewed->applied && skewed->contracted) {
+			ORE.emit([&]() {
+				return OptimizationRemark(DEBUG_TYPE, "Contracted", loc, header)
+						<< "replaced the array by a rolling buffer of " << ore::NV("Rows", skewed->rows) << " of its "
+						<< ore::NV("FullRows", skewed->fullRows) << " skewed rows of " << ore::NV("Columns", skewed->columns)
+						<< " elements, saving " << ore::NV("SavedBytes", skewed->savedBytes) << " bytes"
+						<< (skewed->copyBack ? ", the last rows copied back after it" : "");
+			});
+		} else if (skewed->applied) {
+			ORE.emit([&]() {
+				OptimizationRemark remark(DEBUG_TYPE, "SkewedLayout", loc, header);
+				remark << "ran nest on a " << ore::NV("Rows", skewed->rows) << " x "
+					   << ore::NV("Columns", skewed->columns) << " skewed copy of the array"
+					   << (skewed->copyBack ? ", copied back after it" : ", not copied back as the array is dead")
+					   << ": ";
+				costs(remark);
+				return remark;
+			});
+		} else {
+			ORE.emit([&]() {
+				OptimizationRemarkMissed remark(DEBUG_TYPE, "SkewedLayout", loc, header);
+				remark << "skewed layout not applied: ";
+				costs(remark);
+				return remark;
+			});
+		}
+	}
 
-	auto offset = builder.CreateSRem(
-		builder.CreateSub(
-			builder.CreateMul(
-				IntToValue(H[1][0]),
-				builder.CreateSDiv(outerIV, IntToValue(H[0][0]))
-			),
-			l1Ceil
-		),
-		IntToValue(H[1][1]),
-		"offset"
-	);
+	auto& distribution = report.distribution;
+	if (distribution.before || distribution.after || distribution.sunk) {
+		ORE.emit([&]() {
+			OptimizationRemark remark(DEBUG_TYPE, "Distributed", loc, header);
+			remark << "made nest perfect by";
+			StringRef separator = " ";
+			if (distribution.before) {
+				remark << separator << "moving " << ore::NV("Before", distribution.before)
+					   << " stores into a loop before it";
+				separator = ", ";
+			}
+			if (distribution.after) {
+				remark << separator << "moving " << ore::NV("After", distribution.after)
+					   << " stores into a loop after it";
+				separator = ", ";
+			}
+			if (distribution.sunk) {
+				remark << separator << "recomputing " << ore::NV("Sunk", distribution.sunk)
+					   << " values in the inner loop";
+			}
+			return remark;
+		});
+	}
 
-	/* Update inner loop header */
-	builder.SetInsertPoint(innerLoop->getLoopPreheader()->getTerminator());
-	auto innerLowerBound = builder.CreateAdd(l1Ceil, offset, "q.lower");
-	builder.SetInsertPoint(innerLoop->getHeader()->getFirstNonPHI());
-	auto innerIV = builder.CreatePHI(Int32Ty, 2, "q");
-	auto iNew = builder.CreateSDiv(
-				builder.CreateSub(
-					builder.CreateMul(
-						IntToValue(T[1][1]),
-						outerIV
-					),
-					builder.CreateMul(
-						IntToValue(T[0][1]),
-						innerIV
-					)
-				),
-				IntToValue(T[0][0] * T[1][1] - T[0][1] * T[1][0]),
-				"i.new"
-		   );
-	auto jNew = builder.CreateSDiv(
-					builder.CreateSub(
-						builder.CreateMul(
-							IntToValue(T[0][0]),
-							innerIV
-						),
-						builder.CreateMul(
-							IntToValue(T[1][0]),
-							outerIV
-						)
-					),
-				   	IntToValue(T[0][0] * T[1][1] - T[0][1] * T[1][0]),
-				   	"j.new"
-			   );
+	if (report.prefetches) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "Prefetch", loc, header)
+					<< "prefetching " << ore::NV("Streams", report.prefetches) << " strided access streams "
+					<< ore::NV("Distance", (unsigned) PrefetchDistance) << " iterations ahead";
+		});
+	}
 
-	/* Update inner loop latch */
-	builder.SetInsertPoint(innerLoop->getLoopLatch()->getTerminator());
-	auto innerIncrement = builder.CreateAdd(innerIV, IntToValue(H[1][1]), "q.inc");
-	innerIV->addIncoming(innerLowerBound, innerLoop->getLoopPreheader());
-	innerIV->addIncoming(innerIncrement, innerLoop->getLoopLatch());
+	if (report.scalarReplaced) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "ScalarReplacement", loc, header)
+					<< "kept " << ore::NV("Loads", report.scalarReplaced)
+					<< " array reads in registers carried across inner iterations";
+		});
+	}
 
-	auto innerComp = builder.CreateCmp(CmpInst::ICMP_SLE, innerIncrement, innerUpperBound);
-	auto innerBranch = builder.CreateCondBr(innerComp, innerLoop->getHeader(), innerLoop->getExitBlock());
+	if (report.unrollJam) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "UnrollAndJam", loc, header)
+					<< "unrolled the outer loop by " << ore::NV("Factor", report.unrollJam)
+					<< " and jammed the copies, forwarding " << ore::NV("Loads", report.forwardedLoads)
+					<< " loads between them";
+		});
+	}
 
+	if (!report.tiles.empty()) {
+		ORE.emit([&]() {
+			OptimizationRemark remark(DEBUG_TYPE, "Tiled", loc, header);
+			remark << "ran the nest in tiles of " << ore::NV("TileRows", report.tiles[0]) << " x "
+				   << ore::NV("TileColumns", report.tiles[1]) << " transformed iterations";
+			if (report.tileSkew) {
+				remark << ", skewing q by " << ore::NV("Skew", report.tileSkew) << " p";
+			}
+			return remark << "; the tiles run one after another in lexicographic order";
+		});
+	}
 
-	/* Clean up old induction variables */
-	oldOuterIV->replaceAllUsesWith(iNew);
-	oldInnerIV->replaceAllUsesWith(jNew);
+	if (report.outOfCoreBand) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "OutOfCore", loc, header)
+					<< "array backed by a memory-mapped file when too large for memory, with pages advised every "
+					<< ore::NV("Band", report.outOfCoreBand) << " outer iterations";
+		});
+	}
 
-	oldOuterIV->eraseFromParent();
-	oldOuterIncrement->eraseFromParent();
-	oldOuterBranch->eraseFromParent();
-	oldOuterComparison->eraseFromParent();
+	if (report.privatisedReductions) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "PrivatisedReductions", loc, header)
+					<< "kept " << ore::NV("Reductions", report.privatisedReductions)
+					<< " reduction elements in accumulators across the inner loop"
+					<< (report.vectorWidth ? ", one partial result per lane" : "");
+		});
+	}
 
-	oldInnerIV->eraseFromParent();
-	oldInnerIncrement->eraseFromParent();
-	oldInnerBranch->eraseFromParent();
-	oldInnerComparison->eraseFromParent();
+	if (report.vectorWidth) {
+		ORE.emit([&]() {
+			return OptimizationRemark(DEBUG_TYPE, "Vectorized", loc, header)
+					<< "emitted inner loop as explicit vector loop with " << ore::NV("Lanes", report.vectorWidth)
+					<< " lanes and a scalar epilogue";
+		});
+	}
 
-	addStringMetadataToLoop(innerLoop, "llvm.loop.parallel_accesses");
-	addStringMetadataToLoop(innerLoop, "llvm.mem.parallel_loop_access");
-	addStringMetadataToLoop(innerLoop, "llvm.loop.vectorize.enable");
+	if (report.transform) {
+		ORE.emit([&]() {
+			bool interchanged = *report.transform == IntegerSolver::GetInitialTransform(report.transform->size());
+			return OptimizationRemark(DEBUG_TYPE, interchanged ? "Interchanged" : "Transformed",
+									  loc, header)
+					<< "applied polytope transform " << ore::NV("Transform", MatrixToString(*report.transform))
+					<< " to dependence vectors "
+					<< ore::NV("DependenceVectors", MatrixToString(assignment->GetDependenceVectors()))
+					<< " (analysis " << ore::NV("AnalysisMicros", times.analysis) << "us, search "
+					<< ore::NV("SearchMicros", times.search) << "us, codegen "
+					<< ore::NV("CodegenMicros", times.codegen) << "us)";
+		});
+		return;
+	}
 
-	auto boo = innerLoop->isAnnotatedParallel();
+	if (report.rejection == Rejection::None) {
+		return;
+	}
+	ORE.emit([&]() {
+		auto remark = OptimizationRemarkMissed(DEBUG_TYPE, RejectionName(report.rejection), loc, header);
+		remark << "polytope transform not applied: " << ore::NV("Reason", RejectionReason(report.rejection));
+		if (assignment) {
+			remark << " (dependence vectors " << ore::NV("DependenceVectors",
+														  MatrixToString(assignment->GetDependenceVectors()))
+				   << ")";
+		}
+		remark << " (analysis " << ore::NV("AnalysisMicros", times.analysis) << "us, search "
+			   << ore::NV("SearchMicros", times.search) << "us, codegen " << ore::NV("CodegenMicros", times.codegen)
+			   << "us)";
+		return remark;
+	});
+}
 
-	dbgs() << "================================\n";
-	if (assignment->HasCacheMisses()) {
-		dbgs() << "Performed loop interchange\n";
-	} else {
-		dbgs() << "Performed polytope optimisation\n";
-		PrintTransform(T);
+StringRef PolytopePass::RejectionName(Rejection reason) {
+	switch (reason) {
+		case Rejection::NotPerfect:
+			return "NotPerfectNest";
+		case Rejection::NonAffine:
+			return "NonAffine";
+		case Rejection::NoDependencies:
+			return "NoDependencies";
+		case Rejection::NoTransformInBudget:
+			return "NoTransformInBudget";
+		case Rejection::IllegalSchedule:
+			return "IllegalSchedule";
+		case Rejection::ColdNest:
+			return "ColdNest";
+		case Rejection::ShortTripCount:
+			return "ShortTripCount";
+		case Rejection::None:
+			break;
 	}
-	dbgs() << "================================\n";
+	return "None";
+}
 
-	return PreservedAnalyses::none();
+StringRef PolytopePass::RejectionReason(Rejection reason) {
+	switch (reason) {
+		case Rejection::NotPerfect:
+			return "loop is not a perfect 2-deep nest";
+		case Rejection::NonAffine:
+			return "bounds or array accesses are not affine in the induction variables";
+		case Rejection::NoDependencies:
+			return "no loop-carried dependencies to remove";
+		case Rejection::NoTransformInBudget:
+			return "no legal transform found within the search budget";
+		case Rejection::IllegalSchedule:
+			return "the transform found reverses a dependence on the constant iteration domain";
+		case Rejection::ColdNest:
+			return "the profile marks the nest cold";
+		case Rejection::ShortTripCount:
+			return "the profiled inner trip count is too short for a transform to pay off";
+		case Rejection::None:
+			break;
+	}
+	return "";
 }
 
 std::optional<Instruction*> PolytopePass::FindInstr(unsigned int opCode, BasicBlock* basicBlock) {
@@ -619,13 +4223,17 @@ std::optional<Instruction*> PolytopePass::FindInstr(unsigned int opCode, BasicBl
 	return {};
 }
 
-int PolytopePass::ValueToInt(Value* V) {
+/* The value of an integer constant, or nothing when it is not one or does not fit in int */
+std::optional<int> PolytopePass::ValueToInt(Value* V) {
 	auto k = dyn_cast<ConstantInt>(V);
-	return k->getSExtValue();
+	if (!k || !k->getValue().isSignedIntN(32)) {
+		return {};
+	}
+	return (int) k->getSExtValue();
 }
 
-Value* PolytopePass::IntToValue(int n) {
-	return ConstantInt::get(IntegerType::getInt32Ty(outerLoop->getHeader()->getContext()), n);
+Value* PolytopePass::IntToValue(long n) {
+	return ConstantInt::get(ivType, n, true);
 }
 
 
@@ -660,6 +4268,25 @@ void PolytopePass::PrintTransform(const std::vector<std::vector<int>>& T) {
 
 
 
+std::string PolytopePass::MatrixToString(const std::vector<std::vector<int>>& A) {
+	std::string res;
+	raw_string_ostream os(res);
+	for (auto row = A.begin(); row != A.end(); row++) {
+		if (row != A.begin()) {
+			os << ", ";
+		}
+		os << "(";
+		for (auto col = row->begin(); col != row->end(); col++) {
+			if (col != row->begin()) {
+				os << ", ";
+			}
+			os << *col;
+		}
+		os << ")";
+	}
+	return os.str();
+}
+
 llvm::PassPluginLibraryInfo getPolyLoopPluginInfo() {
 	return {LLVM_PLUGIN_API_VERSION, "PolyLoop", LLVM_VERSION_STRING,
 			[](PassBuilder& PB) {
@@ -672,6 +4299,17 @@ llvm::PassPluginLibraryInfo getPolyLoopPluginInfo() {
 							}
 							return false;
 						});
+				/* As a function pass, the loop adaptor also provides block frequencies for profile-guided
+				 * decisions, eg. -passes='require<profile-summary>,function(polytope)' */
+				PB.registerPipelineParsingCallback(
+						[](StringRef Name, FunctionPassManager& FPM,
+						   ArrayRef<PassBuilder::PipelineElement>) {
+							if (Name == "polytope") {
+								FPM.addPass(createFunctionToLoopPassAdaptor(PolytopePass(), false, true));
+								return true;
+							}
+							return false;
+						});
 			}};
 }
 
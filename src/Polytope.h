@@ -3,18 +3,138 @@
 
 #include <optional>
 #include <utility>
+#include "CacheSimulator.h"
 #include "LoopDependencies.h"
+#include "llvm/Analysis/IVDescriptors.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 
 
+/* Reasons a nest is left untouched, reported as missed optimisation remarks */
+enum class Rejection {
+	None,
+	NotPerfect,
+	NonAffine,
+	NoDependencies,
+	NoTransformInBudget,
+	IllegalSchedule,
+	ColdNest,
+	ShortTripCount
+};
+
+/* Wall-clock time spent in each phase of the pass for a single nest, in microseconds */
+struct PhaseTimes {
+	long analysis = 0;
+	long search = 0;
+	long codegen = 0;
+};
+
+/* Profile analyses for the function containing a nest, null when the pipeline has not computed them */
+struct ProfileInfo {
+	llvm::BlockFrequencyInfo* BFI = nullptr;
+	llvm::ProfileSummaryInfo* PSI = nullptr;
+};
+
+/* What the profile says about a nest */
+struct NestProfile {
+	/* Executions of the inner loop body, when the function has an entry count */
+	std::optional<uint64_t> count;
+	/* Average trip count of each loop from its latch branch weights, outermost first */
+	std::vector<std::optional<unsigned>> tripCounts;
+	bool hot = false;
+	bool cold = false;
+};
+
+/* A legal transform considered by the search, with its simulated cache behaviour */
+struct RankedCandidate {
+	std::vector<std::vector<int>> transform;
+	CacheStats stats;
+};
+
+/* Decision on copying the array of a nest into a skewed buffer with -polytope-skew-layout */
+struct SkewedLayout {
+	/* Rows and columns of the buffer */
+	long rows = 0;
+	long columns = 0;
+	/* Estimated cost of the nest in the original layout, and in the skewed layout with the copies */
+	double originalCost = 0;
+	double skewedCost = 0;
+	/* False when the array is dead after the nest, so the copy back is elided */
+	bool copyBack = true;
+	bool applied = false;
+	/* Whether the buffer only keeps the rows the nest still reads, with -polytope-contract, and the rows of the whole
+	 * skewed array */
+	bool contracted = false;
+	long fullRows = 0;
+	unsigned long savedBytes = 0;
+};
+
+/* Statements DistributeNest moved out of an imperfect nest, and values it recomputed in the inner loop */
+struct NestDistribution {
+	unsigned before = 0;
+	unsigned after = 0;
+	unsigned sunk = 0;
+};
+
+/* Outcome of fusing a nest into the adjacent nest after it */
+struct NestFusion {
+	bool fused = false;
+	/* Rows the first nest runs ahead of the second in the fused nest, which leaves that many rows of the first before
+	 * it and of the second after it */
+	unsigned shift = 0;
+	/* The second nest, which runs both bodies once fused */
+	llvm::Loop* nest = nullptr;
+};
+
+/* Outcome of analysing a nest and searching for a transform, before any code is generated */
+struct NestReport {
+	std::optional<LoopDependencies> assignment;
+	std::optional<std::vector<std::vector<int>>> transform;
+	Rejection rejection = Rejection::None;
+	PhaseTimes times;
+	/* Inclusive range of each induction variable, outermost first, when all bounds are constants */
+	std::optional<std::vector<std::pair<int, int>>> bounds;
+	/* Candidates simulated with -polytope-rank-candidates, in the order they were found */
+	std::vector<RankedCandidate> ranking;
+	/* Other legal transforms found by the search with -polytope-autotune, not filled in from the transform cache */
+	std::vector<std::vector<std::vector<int>>> alternatives;
+	NestProfile profile;
+	/* Lanes of the explicit vector inner loop emitted with -polytope-simd, 0 when none was */
+	unsigned vectorWidth = 0;
+	std::optional<SkewedLayout> skewedLayout;
+	/* Outer iterations per band of a nest run out of core with -polytope-out-of-core, 0 when it is not */
+	unsigned outOfCoreBand = 0;
+	/* Software prefetches emitted with -polytope-prefetch-distance */
+	unsigned prefetches = 0;
+	/* Copies of the outer loop body jammed into one inner loop with -polytope-unroll-jam, 0 when it was not unrolled,
+	 * and the loads of the copies replaced by values an earlier copy stored or loaded */
+	unsigned unrollJam = 0;
+	unsigned forwardedLoads = 0;
+	/* Loads replaced by registers carried across inner iterations with -polytope-scalar-replace */
+	unsigned scalarReplaced = 0;
+	/* Reductions whose element the transformed inner loop keeps in an accumulator instead of memory */
+	unsigned privatisedReductions = 0;
+	NestDistribution distribution;
+	/* Outer by inner size of the tiles the transformed nest runs in with -polytope-tile, empty when it is not tiled,
+	 * and the skew of q by p that the transform was given to make the tiles legal */
+	std::vector<int> tiles;
+	int tileSkew = 0;
+};
+
 struct IVInfo {
 	llvm::PHINode* IV = nullptr;
 	llvm::Value* init = nullptr;
 	llvm::Value* final = nullptr;
+	llvm::Value* step = nullptr;
+	/* Whether final is one past the last value, as for i < n, rather than the last value */
+	bool exclusive = false;
 	llvm::Loop* loop = nullptr;
 };
 
@@ -22,12 +142,22 @@ namespace llvm {
 	class PolytopePass : public PassInfoMixin<PolytopePass> {
 	public:
 		bool IsPerfectNest(Loop& L, LoopInfo& LI, ScalarEvolution& SE);
+		NestDistribution DistributeNest(Loop& L, LoopStandardAnalysisResults& AR);
+		void CommitDistribution(const NestDistribution& distribution);
+		void UndoDistribution(Loop& L, LoopStandardAnalysisResults& AR);
+		NestFusion FuseNest(Loop& L, LoopStandardAnalysisResults& AR);
+		void CommitFusion(Loop& L, const NestFusion& fusion, LoopStandardAnalysisResults& AR, LPMUpdater& U);
+		void UndoFusion(Loop& L, const NestFusion& fusion, LoopStandardAnalysisResults& AR);
 		bool HasInvariantBounds();
 		std::optional<LoopDependencies> RunAnalysis(Loop& L, LoopStandardAnalysisResults& AR);
 		std::optional<Instruction*> FindInstr(unsigned int opCode, BasicBlock* basicBlock);
-		int ValueToInt(Value* V);
-		Value* IntToValue(int n);
+		std::optional<int> ValueToInt(Value* V);
+		Value* IntToValue(long n);
 		static void PrintValue(Value* V);
+		NestReport AnalyzeNest(Loop& L, LoopStandardAnalysisResults& AR, ProfileInfo profileInfo = {});
+		static StringRef RejectionName(Rejection reason);
+		static StringRef RejectionReason(Rejection reason);
+		static std::string MatrixToString(const std::vector<std::vector<int>>& A);
 		PreservedAnalyses run(Loop& L, LoopAnalysisManager& AM, LoopStandardAnalysisResults& AR, LPMUpdater& U);
 
 	private:
@@ -37,8 +167,82 @@ namespace llvm {
 		Loop* outerLoop;
 		PHINode* parentIV;
 		unsigned int maxDepth = 0;
+		Rejection rejection = Rejection::None;
+		std::optional<ArrayLayout> layout;
+		NestProfile profile;
+		/* Search depth for the current nest, larger for nests the profile marks hot */
+		unsigned searchDepth = 0;
+		unsigned vectorWidth = 0;
+		/* Vector loop EmitVectorInnerLoop added inside the nest, if any */
+		Loop* vectorLoop = nullptr;
+		/* Type of the induction variables of the nest being generated, which IntToValue builds constants of */
+		IntegerType* ivType = nullptr;
+		/* Induction variables of the last generated nest, the bounds of q at the current p and of p, and the branch
+		 * that skips the inner loop when its bounds are empty, if there is one */
+		PHINode* outerPhi = nullptr;
+		PHINode* innerPhi = nullptr;
+		Value* innerLower = nullptr;
+		Value* innerUpper = nullptr;
+		Value* outerUpper = nullptr;
+		BranchInst* innerGuard = nullptr;
+		/* Arguments of calls in the outer header that are p plus an offset, filled in once codegen has created p */
+		struct OuterIVArgument {
+			CallInst* call;
+			unsigned operand;
+			int offset;
+		};
+		std::vector<OuterIVArgument> outerIVArguments;
+		/* A store of the inner loop that updates an element with an associative and commutative operation of its old
+		 * value, A[f] = A[f] op x, where no other access of the nest touches A[f] */
+		struct Reduction {
+			StoreInst* store;
+			LoadInst* load;
+			Instruction* update;
+			RecurKind kind;
+			/* Index functions of the element, one row per GEP index */
+			std::vector<std::vector<int>> element;
+			/* Phi the update accumulates into once the element is kept in a register */
+			PHINode* accumulator = nullptr;
+		};
+		std::vector<Reduction> reductions;
+		unsigned privatisedReductions = 0;
+		/* Changes of the last DistributeNest until they are committed or undone: the copies sunk into the inner loop
+		 * with the values they replace, the added loops with the blocks around them, and the statements taken out of
+		 * the nest with the instruction each came before */
+		struct AddedLoop {
+			Loop* loop;
+			BasicBlock* from;
+			BasicBlock* to;
+		};
+		struct DistributionChanges {
+			std::vector<std::pair<Instruction*, Instruction*>> sunk;
+			std::vector<AddedLoop> loops;
+			std::vector<std::pair<Instruction*, Instruction*>> removed;
+		};
+		DistributionChanges distributionChanges;
+		/* Changes of the last FuseNest until they are committed or undone: the instructions added to the inner loop of
+		 * the second nest, the exit tests replaced with the branches they were taken from, and the copy of the second
+		 * running its last rows with the blocks around it */
+		struct FusionChanges {
+			std::vector<Instruction*> added;
+			std::vector<std::pair<BranchInst*, Instruction*>> conditions;
+			std::optional<AddedLoop> rest;
+		};
+		FusionChanges fusionChanges;
+		/* Legal transforms collected by the search when ranking by simulated cache misses */
+		std::vector<std::vector<std::vector<int>>> candidates;
+		const LoopDependencies* candidateAssignment = nullptr;
+		std::vector<RankedCandidate> ranking;
+		std::vector<std::vector<std::vector<int>>> alternatives;
 		std::optional<std::vector<int>> GetValueIfAffine(Value* V);
+		std::string CanonicalNest(const LoopDependencies& assignment);
+		std::optional<std::vector<std::pair<int, int>>> GetConstantBounds();
+		NestProfile GetNestProfile(ProfileInfo profileInfo);
 		std::optional<LoopDependencies> GetArrayAccessesIfAffine();
+		std::optional<std::vector<std::vector<int>>> GetElementIfAffine(Value* pointer);
+		std::optional<std::vector<std::vector<int>>> AnalysedElement(Value* pointer);
+		std::vector<Reduction> FindReductions(LoopStandardAnalysisResults& AR);
+		bool IsReductionAccess(const Instruction* I) const;
 		std::optional<std::vector<std::vector<int>>> ComputeAffineTransformation(const LoopDependencies& assignment);
 		std::optional<std::vector<std::vector<int>>> ComputeAffineTransformationInner(const LoopDependencies& assignment,
 																					  const std::vector<std::vector<int>>& genA,
@@ -46,11 +250,58 @@ namespace llvm {
 																					  const std::vector<std::vector<int>>& transform,
 																					  int depth);
 
-		LoopDependencies
+		bool IsLegalTransform(const LoopDependencies& assignment, const std::vector<std::vector<int>>& transform);
+		std::optional<std::vector<std::vector<int>>> RankByCacheMisses();
+		std::optional<LoopDependencies>
 		TransformAssignment(const LoopDependencies& assignment, const std::vector<std::vector<int>>& transform);
+		void GenerateTransformedNest(const std::vector<std::vector<int>>& T, const LoopDependencies& assignment,
+									 LoopStandardAnalysisResults& AR, const std::vector<int>& tiles = {});
+		std::vector<int> ChooseTiles(NestReport& report);
+		std::vector<int> TileTransform(const LoopDependencies& assignment,
+									   const std::optional<std::vector<std::pair<int, int>>>& bounds,
+									   std::vector<std::vector<int>>& T, int& skew);
+		PHINode* EmitTileLoops(const std::vector<int>& tiles, Value* pLower, Value* pUpper, Value* qMin, Value* qMax,
+							   Instruction* outerComparison, LoopStandardAnalysisResults& AR);
+		unsigned PrivatiseReductions(const std::vector<std::vector<int>>& T, bool& complete,
+									 LoopStandardAnalysisResults& AR);
+		Value* CloneAtIteration(Value* V, Value* q, IRBuilderBase& builder, DenseMap<Value*, Value*>& map,
+								const Twine& suffix);
+		unsigned EmitVectorInnerLoop(PHINode* IV, Value* lower, Value* upper, int step,
+									 LoopStandardAnalysisResults& AR);
+		std::optional<SkewedLayout> EmitSkewedLayout(Loop& L, const NestReport& report,
+													 LoopStandardAnalysisResults& AR);
+		struct AccessFunction {
+			Instruction* access;
+			Value* base;
+			/* Bytes per unit of each induction variable, outermost first */
+			std::vector<long> coefficients;
+			long offset;
+		};
+		std::vector<AccessFunction> AccessFunctions();
+		struct AccessStride {
+			Instruction* access;
+			long stride;
+			long offset;
+		};
+		std::vector<AccessStride> AccessStrides(const std::vector<AccessFunction>& accesses,
+												const std::vector<std::vector<int>>& T);
+		unsigned EmitPrefetches(const std::vector<AccessStride>& strides, LoopStandardAnalysisResults& AR);
+		unsigned EmitScalarReplacement(const std::vector<std::vector<int>>& T,
+									   const std::vector<AccessFunction>& accesses, LoopStandardAnalysisResults& AR);
+		unsigned EmitUnrollAndJam(const NestReport& report, const std::vector<AccessFunction>& accesses,
+								  unsigned& forwarded, LoopStandardAnalysisResults& AR);
+		unsigned EmitOutOfCore(Loop& L, const NestReport& report, LoopStandardAnalysisResults& AR);
+		void CountRejection();
+		void EmitRemarks(Loop& L, const NestReport& report);
+		void InstrumentNest(Loop& L, const NestReport& report, StringRef kind);
+		bool EmitVariants(Loop& L, const NestReport& report, LoopStandardAnalysisResults& AR, LPMUpdater& U);
+		static std::string NestLocation(Loop& L);
 		void PrintTransform(const std::vector<std::vector<int>>& T);
 	};
 
 } // namespace llvm
 
+/* Registers the pass with a PassBuilder, for tools that link the pass directly */
+llvm::PassPluginLibraryInfo getPolyLoopPluginInfo();
+
 #endif // LLVM_TRANSFORMS_POLYLOOP_H
\ No newline at end of file
@@ -0,0 +1,170 @@
+/* Skewed copies of the arrays of nests compiled with -polytope-skew-layout. Before the nest the pass calls
+ * __polytope_skew_enter, which copies the box of the array the nest accesses into a new buffer, and the nest then reads
+ * and writes the buffer instead. __polytope_skew_exit copies the box back, unless the pass found the array dead after
+ * the nest, and frees the buffer.
+ *
+ * With -polytope-contract the buffer only holds a window of Rows consecutive rows, row r in slot r % Rows counted from
+ * the origin. __polytope_rolling_enter allocates it, the nest calls __polytope_skew_rows to load each row as the window
+ * moves onto it, and again at exit to copy the last window back.
+ *
+ * Element (a, b) of the array is kept at row T00 a + T01 b and column T10 a + T11 b of the buffer, less the origin, so
+ * that the inner loop of the transformed nest walks a row of the buffer with unit stride. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fields of the layout descriptor the pass emits as a constant array */
+enum {
+	RowLength,
+	ElementSize,
+	RowLower,
+	RowUpper,
+	ColumnLower,
+	ColumnUpper,
+	T00,
+	T01,
+	T10,
+	T11,
+	OriginRow,
+	OriginColumn,
+	Rows,
+	Columns,
+	/* Box of elements the rows loader leaves alone, as the nest writes them before reading them */
+	SkippedRowLower,
+	SkippedRowUpper,
+	SkippedColumnLower,
+	SkippedColumnUpper,
+	/* Side of the square tiles elements are copied in, so that neither the array nor the buffer is walked with a large
+	 * stride */
+	CopyTile,
+	NumFields
+};
+
+static void Copy(char* array, char* buffer, const long* skew, int toBuffer) {
+	long size = skew[ElementSize];
+	long tile = skew[CopyTile];
+	for (long a0 = skew[RowLower]; a0 <= skew[RowUpper]; a0 += tile) {
+		for (long b0 = skew[ColumnLower]; b0 <= skew[ColumnUpper]; b0 += tile) {
+			for (long a = a0; a < a0 + tile && a <= skew[RowUpper]; a++) {
+				for (long b = b0; b < b0 + tile && b <= skew[ColumnUpper]; b++) {
+					long row = skew[T00] * a + skew[T01] * b - skew[OriginRow];
+					long column = skew[T10] * a + skew[T11] * b - skew[OriginColumn];
+					char* element = array + (a * skew[RowLength] + b) * size;
+					char* copy = buffer + (row * skew[Columns] + column) * size;
+					if (toBuffer) {
+						memcpy(copy, element, size);
+					} else {
+						memcpy(element, copy, size);
+					}
+				}
+			}
+		}
+	}
+}
+
+static char* Allocate(const long* skew) {
+	char* buffer = malloc(skew[Rows] * skew[Columns] * skew[ElementSize]);
+	if (!buffer) {
+		fprintf(stderr, "polytope: cannot allocate %ld x %ld skewed buffer\n", skew[Rows], skew[Columns]);
+		abort();
+	}
+	return buffer;
+}
+
+void* __polytope_skew_enter(char* array, const long* skew) {
+	char* buffer = Allocate(skew);
+	Copy(array, buffer, skew, 1);
+	return buffer;
+}
+
+void* __polytope_rolling_enter(const long* skew) {
+	return Allocate(skew);
+}
+
+static long FloorDiv(long n, long d) {
+	return n / d - (n % d != 0 && (n < 0) != (d < 0));
+}
+
+static long CeilDiv(long n, long d) {
+	return n / d + (n % d != 0 && (n < 0) == (d < 0));
+}
+
+/* Narrows [lower, upper] to the a for which the b with T00 a + T01 b = row, as a fraction, is in [bLower, bUpper];
+ * T01 is not zero */
+static void Narrow(const long* skew, long row, long bLower, long bUpper, long* lower, long* upper) {
+	long x = row - skew[T01] * (skew[T01] > 0 ? bUpper : bLower);
+	long y = row - skew[T01] * (skew[T01] > 0 ? bLower : bUpper);
+	if (!skew[T00]) {
+		if (x > 0 || y < 0) {
+			*upper = *lower - 1;
+		}
+		return;
+	}
+	long a = skew[T00] > 0 ? CeilDiv(x, skew[T00]) : CeilDiv(y, skew[T00]);
+	long b = skew[T00] > 0 ? FloorDiv(y, skew[T00]) : FloorDiv(x, skew[T00]);
+	*lower = a > *lower ? a : *lower;
+	*upper = b < *upper ? b : *upper;
+}
+
+static void CopyElement(char* array, char* slot, const long* skew, long a, long b, int toBuffer) {
+	long size = skew[ElementSize];
+	char* element = array + (a * skew[RowLength] + b) * size;
+	char* copy = slot + (skew[T10] * a + skew[T11] * b - skew[OriginColumn]) * size;
+	if (toBuffer) {
+		memcpy(copy, element, size);
+	} else {
+		memcpy(element, copy, size);
+	}
+}
+
+/* Copies the elements of the box on skewed rows first to last into their slots of a rolling buffer, or back. Only the
+ * elements of a row are visited, and loads pass over the skipped box. */
+void __polytope_skew_rows(char* array, char* buffer, const long* skew, long first, long last, int toBuffer) {
+	for (long row = first; row <= last; row++) {
+		if (row < skew[OriginRow]) {
+			continue;
+		}
+		char* slot = buffer + (row - skew[OriginRow]) % skew[Rows] * skew[Columns] * skew[ElementSize];
+		if (!skew[T01]) {
+			/* The row is the part of array row a = row / T00 in the box */
+			long a = row / skew[T00];
+			if (row % skew[T00] || a < skew[RowLower] || a > skew[RowUpper]) {
+				continue;
+			}
+			int skipped = toBuffer && a >= skew[SkippedRowLower] && a <= skew[SkippedRowUpper];
+			for (long b = skew[ColumnLower]; b <= skew[ColumnUpper]; b++) {
+				if (skipped && b >= skew[SkippedColumnLower] && b <= skew[SkippedColumnUpper]) {
+					b = skew[SkippedColumnUpper];
+					continue;
+				}
+				CopyElement(array, slot, skew, a, b, toBuffer);
+			}
+			continue;
+		}
+		/* One element b = (row - T00 a) / T01 for the a where it divides and lands in the box */
+		long lower = skew[RowLower];
+		long upper = skew[RowUpper];
+		Narrow(skew, row, skew[ColumnLower], skew[ColumnUpper], &lower, &upper);
+		long skippedLower = skew[SkippedRowLower];
+		long skippedUpper = toBuffer ? skew[SkippedRowUpper] : skippedLower - 1;
+		Narrow(skew, row, skew[SkippedColumnLower], skew[SkippedColumnUpper], &skippedLower, &skippedUpper);
+		for (long a = lower; a <= upper; a++) {
+			if (a >= skippedLower && a <= skippedUpper) {
+				a = skippedUpper;
+				continue;
+			}
+			long rest = row - skew[T00] * a;
+			if (rest % skew[T01] == 0) {
+				CopyElement(array, slot, skew, a, rest / skew[T01], toBuffer);
+			}
+		}
+	}
+}
+
+void __polytope_skew_exit(char* array, char* buffer, const long* skew, int copyBack) {
+	if (copyBack) {
+		Copy(array, buffer, skew, 0);
+	}
+	free(buffer);
+}
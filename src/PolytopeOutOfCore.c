@@ -0,0 +1,212 @@
+/* Out-of-core arrays for nests compiled with -polytope-out-of-core. The pass replaces the malloc and frees of the array
+ * of such a nest by __polytope_ooc_alloc and __polytope_ooc_free, which back allocations larger than
+ * $POLYTOPE_OOC_THRESHOLD bytes (default half the physical memory) by a shared mapping of an unlinked file in
+ * $POLYTOPE_OOC_DIR (default $TMPDIR, or /tmp), so that the kernel writes pages out instead of swapping.
+ *
+ * The nest calls __polytope_ooc_advance at every outer iteration p. At the start of each band of iterations it asks
+ * for the pages of the next band with MADV_WILLNEED, so they are read ahead while this band runs, and drops the pages
+ * whose elements are on skewed rows before the window of this band with MADV_DONTNEED; their contents stay in the
+ * file. Element (a, b) of the array is on skewed row T00 a + T01 b, which iteration p reaches through the accesses with
+ * offsets WindowLower to WindowUpper. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Fields of the descriptor the pass emits as a constant array */
+enum {
+	RowLength,
+	ElementSize,
+	RowLower,
+	RowUpper,
+	ColumnLower,
+	ColumnUpper,
+	T00,
+	T01,
+	WindowLower,
+	WindowUpper,
+	FirstRow,
+	Band,
+	NumFields
+};
+
+struct Mapping {
+	char* address;
+	unsigned long length;
+	struct Mapping* next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Mapping* mappings = NULL;
+
+static unsigned long Threshold(void) {
+	const char* threshold = getenv("POLYTOPE_OOC_THRESHOLD");
+	if (threshold && *threshold) {
+		return strtoul(threshold, NULL, 10);
+	}
+	return (unsigned long) sysconf(_SC_PHYS_PAGES) * (unsigned long) sysconf(_SC_PAGESIZE) / 2;
+}
+
+static void* Map(unsigned long size) {
+	const char* dir = getenv("POLYTOPE_OOC_DIR");
+	if (!dir || !*dir) {
+		dir = getenv("TMPDIR");
+	}
+	if (!dir || !*dir) {
+		dir = "/tmp";
+	}
+	size_t length = strlen(dir) + 32;
+	char* path = malloc(length);
+	if (!path) {
+		return NULL;
+	}
+	snprintf(path, length, "%s/polytope-ooc-XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		free(path);
+		return NULL;
+	}
+	unlink(path);
+	free(path);
+	void* address = MAP_FAILED;
+	if (ftruncate(fd, (off_t) size) == 0) {
+		address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (address == MAP_FAILED) {
+		perror("polytope: cannot map out-of-core array");
+		return NULL;
+	}
+	/* Without its record __polytope_ooc_free could not tell the mapping from a malloc, so the array is malloced instead */
+	struct Mapping* mapping = malloc(sizeof(*mapping));
+	if (!mapping) {
+		munmap(address, size);
+		return NULL;
+	}
+	mapping->address = address;
+	mapping->length = size;
+	pthread_mutex_lock(&lock);
+	mapping->next = mappings;
+	mappings = mapping;
+	pthread_mutex_unlock(&lock);
+	return address;
+}
+
+/* Falls back to malloc for small arrays, or when the file cannot be created */
+void* __polytope_ooc_alloc(unsigned long size) {
+	void* address = size && size >= Threshold() ? Map(size) : NULL;
+	return address ? address : malloc(size);
+}
+
+void __polytope_ooc_free(void* address) {
+	pthread_mutex_lock(&lock);
+	for (struct Mapping** m = &mappings; *m; m = &(*m)->next) {
+		if ((*m)->address == address) {
+			struct Mapping* mapping = *m;
+			*m = mapping->next;
+			pthread_mutex_unlock(&lock);
+			munmap(mapping->address, mapping->length);
+			free(mapping);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	free(address);
+}
+
+static int Mapped(const char* array) {
+	pthread_mutex_lock(&lock);
+	struct Mapping* m = mappings;
+	while (m && (array < m->address || array >= m->address + m->length)) {
+		m = m->next;
+	}
+	pthread_mutex_unlock(&lock);
+	return m != NULL;
+}
+
+static long FloorDiv(long n, long d) {
+	return n / d - (n % d != 0 && (n < 0) != (d < 0));
+}
+
+static long CeilDiv(long n, long d) {
+	return n / d + (n % d != 0 && (n < 0) == (d < 0));
+}
+
+/* Columns of array row a whose elements are on skewed rows first to last, as an inclusive range */
+static void Span(const long* ooc, long a, long first, long last, long* lower, long* upper) {
+	*lower = ooc[ColumnLower];
+	*upper = ooc[ColumnUpper];
+	long x = first - ooc[T00] * a;
+	long y = last - ooc[T00] * a;
+	if (!ooc[T01]) {
+		if (x > 0 || y < 0) {
+			*upper = *lower - 1;
+		}
+		return;
+	}
+	long l = ooc[T01] > 0 ? CeilDiv(x, ooc[T01]) : CeilDiv(y, ooc[T01]);
+	long u = ooc[T01] > 0 ? FloorDiv(y, ooc[T01]) : FloorDiv(x, ooc[T01]);
+	*lower = l > *lower ? l : *lower;
+	*upper = u < *upper ? u : *upper;
+}
+
+/* Pages holding columns lower to upper of array row a, rounded out to whole pages, or in to the pages holding nothing
+ * else */
+static void Pages(char* array, const long* ooc, long a, long lower, long upper, int outward, char** begin, char** end) {
+	unsigned long page = (unsigned long) sysconf(_SC_PAGESIZE);
+	unsigned long first = (unsigned long) (array + (a * ooc[RowLength] + lower) * ooc[ElementSize]);
+	unsigned long last = (unsigned long) (array + (a * ooc[RowLength] + upper + 1) * ooc[ElementSize]);
+	*begin = (char*) ((outward ? first : first + page - 1) / page * page);
+	*end = (char*) ((outward ? last + page - 1 : last) / page * page);
+}
+
+void __polytope_ooc_advance(char* array, const long* ooc, long p) {
+	if ((p - ooc[FirstRow]) % ooc[Band] || !Mapped(array)) {
+		return;
+	}
+	long start = ooc[FirstRow] + ooc[WindowLower];
+	for (long a = ooc[RowLower]; a <= ooc[RowUpper]; a++) {
+		long lower, upper;
+		char* begin;
+		char* end;
+		/* The next band and its halo, and this one too when the nest starts */
+		long first = p == ooc[FirstRow] ? p : p + ooc[Band];
+		Span(ooc, a, first + ooc[WindowLower], p + 2 * ooc[Band] - 1 + ooc[WindowUpper], &lower, &upper);
+		if (lower <= upper) {
+			Pages(array, ooc, a, lower, upper, 1, &begin, &end);
+			madvise(begin, end - begin, MADV_WILLNEED);
+		}
+		/* Pages all of whose elements are on rows before the window, less those released at the previous band */
+		char* releasedBegin = NULL;
+		char* releasedEnd = NULL;
+		if (p != ooc[FirstRow]) {
+			Span(ooc, a, start, p - ooc[Band] + ooc[WindowLower] - 1, &lower, &upper);
+			if (lower <= upper) {
+				Pages(array, ooc, a, lower, upper, 0, &releasedBegin, &releasedEnd);
+			}
+		}
+		Span(ooc, a, start, p + ooc[WindowLower] - 1, &lower, &upper);
+		if (lower > upper) {
+			continue;
+		}
+		Pages(array, ooc, a, lower, upper, 0, &begin, &end);
+		if (releasedBegin < releasedEnd) {
+			/* The range grows on either side of the one released before */
+			if (begin < releasedBegin) {
+				madvise(begin, releasedBegin - begin, MADV_DONTNEED);
+			}
+			begin = releasedEnd > begin ? releasedEnd : begin;
+		}
+		if (begin < end) {
+			madvise(begin, end - begin, MADV_DONTNEED);
+		}
+	}
+}
@@ -0,0 +1,259 @@
+/* Profiling runtime for nests instrumented with -polytope-instrument or -polytope-instrument-control. The pass calls
+ * __polytope_nest_enter before a nest and __polytope_nest_exit after it; this file reads the hardware counters of the
+ * calling thread around each execution and adds the differences to a per-nest record. The totals are written at exit
+ * to $POLYTOPE_PROFILE (default polytope-profile.csv), as JSON when the file name ends in .json.
+ *
+ * Counters are opened per thread with perf_event_open. Events the kernel or CPU does not support are reported as -1,
+ * and if none can be opened (no PMU, perf_event_paranoid, containers) only the clock_gettime time is recorded. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { Cycles, Instructions, L1DMisses, LLCMisses, NumCounters };
+
+static const char* CounterNames[NumCounters] = {"cycles", "instructions", "l1d_misses", "llc_misses"};
+
+/* Nests may be nested through calls, so each thread keeps a stack of open readings */
+#define MaxDepth 64
+
+struct NestRecord {
+	char* location;
+	char* function;
+	char* kind;
+	char* transform;
+	unsigned long calls;
+	double seconds;
+	long counters[NumCounters];
+	struct NestRecord* next;
+};
+
+struct Reading {
+	double time;
+	long counters[NumCounters];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct NestRecord* records = NULL;
+static int supported[NumCounters];
+
+static __thread int opened = 0;
+static __thread int fds[NumCounters];
+static __thread struct Reading stack[MaxDepth];
+static __thread int depth = 0;
+
+static int OpenCounter(unsigned type, unsigned long config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void OpenCounters(void) {
+	unsigned long l1dReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+								(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	fds[Cycles] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[Instructions] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[L1DMisses] = OpenCounter(PERF_TYPE_HW_CACHE, l1dReadMiss);
+	fds[LLCMisses] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	pthread_mutex_lock(&lock);
+	for (int c = 0; c < NumCounters; c++) {
+		supported[c] |= fds[c] >= 0;
+	}
+	pthread_mutex_unlock(&lock);
+	opened = 1;
+}
+
+static void Read(struct Reading* reading) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	reading->time = ts.tv_sec + ts.tv_nsec * 1e-9;
+	for (int c = 0; c < NumCounters; c++) {
+		long value = 0;
+		if (fds[c] < 0 || read(fds[c], &value, sizeof(value)) != sizeof(value)) {
+			value = 0;
+		}
+		reading->counters[c] = value;
+	}
+}
+
+/* Writes a CSV field followed by a comma, quoted with its quotes doubled when it holds a comma, quote or line break */
+static void WriteCSVField(FILE* out, const char* field) {
+	if (!field[strcspn(field, ",\"\r\n")]) {
+		fprintf(out, "%s,", field);
+		return;
+	}
+	fputc('"', out);
+	for (const char* c = field; *c; c++) {
+		if (*c == '"') {
+			fputc('"', out);
+		}
+		fputc(*c, out);
+	}
+	fputs("\",", out);
+}
+
+/* Writes a JSON string, escaping quotes, backslashes and control characters */
+static void WriteJSONString(FILE* out, const char* string) {
+	fputc('"', out);
+	for (const unsigned char* c = (const unsigned char*) string; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(out, "\\%c", *c);
+		} else if (*c < 0x20) {
+			fprintf(out, "\\u%04x", *c);
+		} else {
+			fputc(*c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void WriteCSV(FILE* out) {
+	fprintf(out, "location,function,kind,transform,calls,seconds");
+	for (int c = 0; c < NumCounters; c++) {
+		fprintf(out, ",%s", CounterNames[c]);
+	}
+	fprintf(out, "\n");
+	for (struct NestRecord* r = records; r; r = r->next) {
+		WriteCSVField(out, r->location);
+		WriteCSVField(out, r->function);
+		WriteCSVField(out, r->kind);
+		WriteCSVField(out, r->transform);
+		fprintf(out, "%lu,%.9f", r->calls, r->seconds);
+		for (int c = 0; c < NumCounters; c++) {
+			fprintf(out, ",%ld", supported[c] ? r->counters[c] : -1);
+		}
+		fprintf(out, "\n");
+	}
+}
+
+static void WriteJSON(FILE* out) {
+	fprintf(out, "[\n");
+	for (struct NestRecord* r = records; r; r = r->next) {
+		fprintf(out, "  {\"location\": ");
+		WriteJSONString(out, r->location);
+		fprintf(out, ", \"function\": ");
+		WriteJSONString(out, r->function);
+		fprintf(out, ", \"kind\": ");
+		WriteJSONString(out, r->kind);
+		fprintf(out, ", \"transform\": ");
+		WriteJSONString(out, r->transform);
+		fprintf(out, ", \"calls\": %lu, \"seconds\": %.9f", r->calls, r->seconds);
+		for (int c = 0; c < NumCounters; c++) {
+			fprintf(out, ", \"%s\": %ld", CounterNames[c], supported[c] ? r->counters[c] : -1);
+		}
+		fprintf(out, "}%s\n", r->next ? "," : "");
+	}
+	fprintf(out, "]\n");
+}
+
+static void Dump(void) {
+	const char* path = getenv("POLYTOPE_PROFILE");
+	if (!path || !*path) {
+		path = "polytope-profile.csv";
+	}
+	FILE* out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	size_t length = strlen(path);
+	if (length >= 5 && !strcmp(path + length - 5, ".json")) {
+		WriteJSON(out);
+	} else {
+		WriteCSV(out);
+	}
+	pthread_mutex_unlock(&lock);
+	fclose(out);
+}
+
+static void FreeRecord(struct NestRecord* record) {
+	free(record->location);
+	free(record->function);
+	free(record->kind);
+	free(record->transform);
+	free(record);
+}
+
+/* Registers the record for a nest on its first execution; later calls find it through the handle. Returns NULL, and
+ * the nest is not profiled, when there is no memory for the record. */
+static struct NestRecord* Register(void** handle, const char* location, const char* function, const char* kind,
+								   const char* transform) {
+	pthread_mutex_lock(&lock);
+	struct NestRecord* record = *handle;
+	if (!record) {
+		record = calloc(1, sizeof(*record));
+		if (!record) {
+			fprintf(stderr, "polytope: cannot allocate the profile record of %s\n", location);
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		/* Copied, as the profile is written at exit when the strings of a JIT compiled caller may be gone */
+		record->location = strdup(location);
+		record->function = strdup(function);
+		record->kind = strdup(kind);
+		record->transform = strdup(transform);
+		if (!record->location || !record->function || !record->kind || !record->transform) {
+			fprintf(stderr, "polytope: cannot allocate the profile record of %s\n", location);
+			FreeRecord(record);
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		if (!records) {
+			atexit(Dump);
+		}
+		record->next = records;
+		records = record;
+		__atomic_store_n(handle, record, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lock);
+	return record;
+}
+
+void __polytope_nest_enter(void** handle, const char* location, const char* function, const char* kind,
+						   const char* transform) {
+	if (!__atomic_load_n(handle, __ATOMIC_ACQUIRE) && !Register(handle, location, function, kind, transform)) {
+		return;
+	}
+	if (!opened) {
+		OpenCounters();
+	}
+	if (depth < MaxDepth) {
+		Read(&stack[depth]);
+	}
+	depth++;
+}
+
+void __polytope_nest_exit(void** handle) {
+	struct NestRecord* record = __atomic_load_n(handle, __ATOMIC_ACQUIRE);
+	if (depth == 0 || !record) {
+		return;
+	}
+	depth--;
+	if (depth >= MaxDepth) {
+		return;
+	}
+	struct Reading now;
+	Read(&now);
+	pthread_mutex_lock(&lock);
+	record->calls++;
+	record->seconds += now.time - stack[depth].time;
+	for (int c = 0; c < NumCounters; c++) {
+		record->counters[c] += now.counters[c] - stack[depth].counters[c];
+	}
+	pthread_mutex_unlock(&lock);
+}
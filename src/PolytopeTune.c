@@ -0,0 +1,318 @@
+/* Dispatch runtime for nests compiled with -polytope-autotune. The pass emits the original nest and several transformed
+ * variants behind a switch on __polytope_variant_select, and calls __polytope_variant_exit where the variants join
+ * again. The first invocations of each nest cycle through the variants, $POLYTOPE_TUNE_TRIALS (default 3) times each,
+ * and the variant with the fastest single run is then used for the rest of the program.
+ *
+ * Decisions are kept in $POLYTOPE_TUNE_FILE (default polytope-tune.txt), one tab separated line per nest and CPU model:
+ * the key the pass derived from the nest and its variants, the CPU model, the winning variant, its time in seconds and
+ * the nest location. A nest whose key and CPU model are found there starts on the recorded variant without tuning. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Nests may be nested through calls, so each thread keeps a stack of open timings */
+#define MaxDepth 64
+
+struct TuneRecord {
+	const char* key;
+	const char* location;
+	int variants;
+	/* Variant locked in, or -1 while tuning */
+	int winner;
+	int nextVariant;
+	int* trials;
+	double* best;
+	/* Whether the winner was decided by this run and so has to be written back */
+	int decided;
+	struct TuneRecord* next;
+};
+
+struct PersistedDecision {
+	char* key;
+	char* cpu;
+	int winner;
+	char* line;
+	struct PersistedDecision* next;
+};
+
+struct Timing {
+	struct TuneRecord* record;
+	int variant;
+	double start;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct TuneRecord* records = NULL;
+static struct PersistedDecision* persisted = NULL;
+static int loaded = 0;
+static int trialsPerVariant = 3;
+static char cpuModel[256] = "unknown";
+
+static __thread struct Timing stack[MaxDepth];
+static __thread int depth = 0;
+
+static double Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char* TunePath(void) {
+	const char* path = getenv("POLYTOPE_TUNE_FILE");
+	return path && *path ? path : "polytope-tune.txt";
+}
+
+static void ReadCPUModel(void) {
+	FILE* in = fopen("/proc/cpuinfo", "r");
+	if (!in) {
+		return;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), in)) {
+		if (strncmp(line, "model name", 10) != 0) {
+			continue;
+		}
+		char* value = strchr(line, ':');
+		if (value) {
+			value += strspn(value + 1, " \t") + 1;
+			value[strcspn(value, "\t\n")] = 0;
+			snprintf(cpuModel, sizeof(cpuModel), "%s", value);
+		}
+		break;
+	}
+	fclose(in);
+}
+
+static void FreeDecision(struct PersistedDecision* decision) {
+	free(decision->line);
+	free(decision->key);
+	free(decision->cpu);
+	free(decision);
+}
+
+/* Reads the decisions of earlier runs; called once, with the lock held */
+static void Load(void) {
+	loaded = 1;
+	const char* trials = getenv("POLYTOPE_TUNE_TRIALS");
+	if (trials && atoi(trials) > 0) {
+		trialsPerVariant = atoi(trials);
+	}
+	ReadCPUModel();
+	FILE* in = fopen(TunePath(), "r");
+	if (!in) {
+		return;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), in)) {
+		struct PersistedDecision* decision = calloc(1, sizeof(*decision));
+		if (!decision) {
+			break;
+		}
+		decision->line = strdup(line);
+		char* save = NULL;
+		char* key = strtok_r(line, "\t\n", &save);
+		char* cpu = strtok_r(NULL, "\t\n", &save);
+		char* winner = strtok_r(NULL, "\t\n", &save);
+		if (key && cpu) {
+			decision->key = strdup(key);
+			decision->cpu = strdup(cpu);
+		}
+		if (!winner || !decision->line || !decision->key || !decision->cpu) {
+			FreeDecision(decision);
+			continue;
+		}
+		decision->winner = atoi(winner);
+		decision->next = persisted;
+		persisted = decision;
+	}
+	fclose(in);
+}
+
+static int Matches(const struct PersistedDecision* decision, const char* key) {
+	return !strcmp(decision->key, key) && !strcmp(decision->cpu, cpuModel);
+}
+
+/* Rewrites the decision file with the decisions of this run replacing those for the same nest and CPU model */
+static void Dump(void) {
+	pthread_mutex_lock(&lock);
+	int changed = 0;
+	for (struct TuneRecord* r = records; r; r = r->next) {
+		changed |= r->decided;
+	}
+	if (!changed) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	/* Written next to the file under a unique name and renamed over it, so processes finishing together each replace
+	 * the file whole rather than writing into the same temporary */
+	const char* path = TunePath();
+	size_t length = strlen(path) + 8;
+	char* temporary = malloc(length);
+	if (!temporary) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	snprintf(temporary, length, "%s.XXXXXX", path);
+	int fd = mkstemp(temporary);
+	FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!out) {
+		perror(temporary);
+		if (fd >= 0) {
+			close(fd);
+			unlink(temporary);
+		}
+		free(temporary);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	/* mkstemp creates the file readable by the owner only */
+	fchmod(fd, 0644);
+	for (struct PersistedDecision* d = persisted; d; d = d->next) {
+		int replaced = 0;
+		for (struct TuneRecord* r = records; r && !replaced; r = r->next) {
+			replaced = r->decided && Matches(d, r->key);
+		}
+		if (!replaced) {
+			fputs(d->line, out);
+		}
+	}
+	for (struct TuneRecord* r = records; r; r = r->next) {
+		if (r->decided) {
+			fprintf(out, "%s\t%s\t%d\t%.9f\t%s\n", r->key, cpuModel, r->winner, r->best[r->winner], r->location);
+		}
+	}
+	if (fclose(out) != 0 || rename(temporary, path) != 0) {
+		perror(path);
+		unlink(temporary);
+	}
+	free(temporary);
+	pthread_mutex_unlock(&lock);
+}
+
+static void FreeRecord(struct TuneRecord* record) {
+	free((char*) record->key);
+	free((char*) record->location);
+	free(record->trials);
+	free(record->best);
+	free(record);
+}
+
+/* Creates the record for a nest on its first execution, starting from a persisted decision when there is one */
+static struct TuneRecord* Register(void** handle, const char* key, const char* location, int variants) {
+	pthread_mutex_lock(&lock);
+	struct TuneRecord* record = *handle;
+	if (!record) {
+		if (!loaded) {
+			Load();
+		}
+		if (!records) {
+			atexit(Dump);
+		}
+		record = calloc(1, sizeof(*record));
+		if (!record) {
+			fprintf(stderr, "polytope: cannot allocate the tuning record of %s\n", location);
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		/* Copied, as the decisions are written at exit when the strings of a JIT compiled caller may be gone */
+		record->key = strdup(key);
+		record->location = strdup(location);
+		record->variants = variants;
+		record->winner = -1;
+		record->trials = calloc(variants, sizeof(int));
+		record->best = calloc(variants, sizeof(double));
+		if (!record->key || !record->location || !record->trials || !record->best) {
+			fprintf(stderr, "polytope: cannot allocate the tuning record of %s\n", location);
+			FreeRecord(record);
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		for (struct PersistedDecision* d = persisted; d; d = d->next) {
+			if (Matches(d, key) && d->winner >= 0 && d->winner < variants) {
+				record->winner = d->winner;
+				break;
+			}
+		}
+		record->next = records;
+		records = record;
+		__atomic_store_n(handle, record, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lock);
+	return record;
+}
+
+int __polytope_variant_select(void** handle, const char* key, const char* location, int variants) {
+	struct TuneRecord* record = __atomic_load_n(handle, __ATOMIC_ACQUIRE);
+	if (!record) {
+		record = Register(handle, key, location, variants);
+	}
+	/* Without a record the original nest runs, untimed */
+	if (!record) {
+		if (depth < MaxDepth) {
+			stack[depth].record = NULL;
+		}
+		depth++;
+		return 0;
+	}
+	int variant = __atomic_load_n(&record->winner, __ATOMIC_ACQUIRE);
+	int timed = variant < 0;
+	if (timed) {
+		pthread_mutex_lock(&lock);
+		variant = record->winner;
+		timed = variant < 0;
+		if (timed) {
+			variant = record->nextVariant;
+			record->nextVariant = (variant + 1) % variants;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	if (depth < MaxDepth) {
+		stack[depth].record = timed ? record : NULL;
+		stack[depth].variant = variant;
+		stack[depth].start = timed ? Now() : 0;
+	}
+	depth++;
+	return variant;
+}
+
+void __polytope_variant_exit(void** handle) {
+	(void) handle;
+	if (depth == 0) {
+		return;
+	}
+	depth--;
+	if (depth >= MaxDepth || !stack[depth].record) {
+		return;
+	}
+	double elapsed = Now() - stack[depth].start;
+	struct TuneRecord* record = stack[depth].record;
+	int variant = stack[depth].variant;
+	pthread_mutex_lock(&lock);
+	if (record->winner < 0) {
+		if (!record->trials[variant] || elapsed < record->best[variant]) {
+			record->best[variant] = elapsed;
+		}
+		record->trials[variant]++;
+		int done = 1;
+		int winner = 0;
+		for (int v = 0; v < record->variants; v++) {
+			done &= record->trials[v] >= trialsPerVariant;
+			if (record->best[v] < record->best[winner]) {
+				winner = v;
+			}
+		}
+		if (done) {
+			record->decided = 1;
+			__atomic_store_n(&record->winner, winner, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,231 @@
+#ifndef LLVM_TRANSFORMS_POLYLOOP_SCHEDULEVERIFIER_H
+#define LLVM_TRANSFORMS_POLYLOOP_SCHEDULEVERIFIER_H
+
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "LoopDependencies.h"
+
+/* A dependence between two iterations that a transform reverses */
+struct ScheduleViolation {
+	/* "flow" (write then read), "anti" (read then write) or "output" (write then write) */
+	std::string kind;
+	std::vector<int> source;
+	std::vector<int> sink;
+	std::vector<int> element;
+};
+
+/* Checks a transform by interpreting the nest over a concrete rectangular iteration domain instead of compiling it.
+ * The iterations are ranked by the lexicographic order of their transformed coordinates, which is the order the
+ * transformed nest executes them in. The original execution is then replayed, tracking for every array element its
+ * last writer and the latest-scheduled reader since that write, so each flow, anti and output dependence is checked in
+ * constant time. Within an iteration the reads run before the writes, as in the assignments the pass accepts. */
+class ScheduleVerifier {
+public:
+	/* Upper limit on the domain, so the check stays cheap enough to run inside the pass, and on the accessed region
+	 * tracked in a table rather than a hash map, which stays within a megabyte */
+	static constexpr size_t MaxIterations = 1 << 22;
+	static constexpr size_t MaxDenseElements = 1 << 16;
+
+	/* bounds holds the inclusive range of each induction variable, outermost first */
+	ScheduleVerifier(const LoopDependencies& assignment, std::vector<std::pair<int, int>> bounds)
+			: writes(assignment.writes), reads(assignment.reads), bounds(std::move(bounds)) {};
+
+	size_t Iterations() const {
+		size_t res = 1;
+		for (auto [lower, upper]: bounds) {
+			if (upper < lower) {
+				return 0;
+			}
+			res *= upper - lower + 1;
+			if (res > MaxIterations) {
+				return res;
+			}
+		}
+		return res;
+	}
+
+	bool Checkable() const {
+		return !bounds.empty() && Iterations() <= MaxIterations;
+	}
+
+	/* Returns the first dependence, in original execution order, whose sink the transform, tiled in the transformed
+	 * space when tiles are given, schedules before its source */
+	std::optional<ScheduleViolation> Verify(const std::vector<std::vector<int>>& T,
+											const std::vector<int>& tiles = {}) const {
+		if (!Checkable()) {
+			return {};
+		}
+		auto rank = Schedule(T, tiles);
+		auto box = AccessedBox();
+		size_t elements = 1;
+		for (auto [lower, upper]: box) {
+			elements = std::min(elements * (upper - lower + 1), MaxDenseElements + 1);
+		}
+
+		std::vector<ElementState> dense(elements <= MaxDenseElements ? elements : 0);
+		std::unordered_map<long, ElementState> sparse;
+		auto state = [&](long key) -> ElementState& {
+			return dense.empty() ? sparse[key] : dense[key];
+		};
+
+		auto n = rank.size();
+		std::vector<int> x(bounds.size());
+		for (long it = 0; it < (long) n; it++) {
+			Point(bounds, it, x);
+			for (auto& read: reads) {
+				auto key = Key(read, x, box);
+				auto& s = state(key);
+				if (s.writer >= 0 && s.writer != it && rank[s.writer] > rank[it]) {
+					return Violation("flow", s.writer, it, read, x);
+				}
+				if (s.reader < 0 || rank[it] > rank[s.reader]) {
+					s.reader = it;
+				}
+			}
+			for (auto& write: writes) {
+				auto key = Key(write, x, box);
+				auto& s = state(key);
+				if (s.writer >= 0 && s.writer != it && rank[s.writer] > rank[it]) {
+					return Violation("output", s.writer, it, write, x);
+				}
+				if (s.reader >= 0 && s.reader != it && rank[s.reader] > rank[it]) {
+					return Violation("anti", s.reader, it, write, x);
+				}
+				s.writer = it;
+				s.reader = -1;
+			}
+		}
+		return {};
+	}
+
+	/* Coordinates of the iteration with the given position in the original, row-major execution order */
+	static void Point(const std::vector<std::pair<int, int>>& bounds, long index, std::vector<int>& x) {
+		for (int d = (int) bounds.size() - 1; d >= 0; d--) {
+			long extent = bounds[d].second - bounds[d].first + 1;
+			x[d] = bounds[d].first + (int) (index % extent);
+			index /= extent;
+		}
+	}
+
+	/* Original positions of the iterations, in the order the transformed nest executes them: lexicographic in the
+	 * transformed coordinates y = Tx, or, given tile sizes, in the tile indices floor(y / tile) and then in y */
+	static std::vector<long> ExecutionOrder(const std::vector<std::pair<int, int>>& bounds,
+											const std::vector<std::vector<int>>& T, const std::vector<int>& tiles = {}) {
+		long n = 1;
+		for (auto [lower, upper]: bounds) {
+			n *= std::max(0, upper - lower + 1);
+		}
+		auto dim = bounds.size();
+		auto width = tiles.empty() ? dim : 2 * dim;
+		std::vector<long> coordinates(n * width);
+		std::vector<int> x(dim);
+		for (long it = 0; it < n; it++) {
+			Point(bounds, it, x);
+			for (size_t r = 0; r < dim; r++) {
+				long y = 0;
+				for (size_t c = 0; c < dim; c++) {
+					y += (long) T[r][c] * x[c];
+				}
+				if (tiles.empty()) {
+					coordinates[it * width + r] = y;
+				} else {
+					coordinates[it * width + r] = IntegerSolver::SignedDiv((int) y, tiles[r]);
+					coordinates[it * width + dim + r] = y;
+				}
+			}
+		}
+		std::vector<long> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](long a, long b) {
+			return std::lexicographical_compare(coordinates.begin() + a * width, coordinates.begin() + (a + 1) * width,
+												coordinates.begin() + b * width, coordinates.begin() + (b + 1) * width);
+		});
+		return order;
+	}
+
+	/* Index of an access at iteration x; index rows hold one coefficient per induction variable and the constant last.
+	 * Coefficients of induction variables beyond x (eg. an enclosing loop) are ignored. */
+	static long Index(const std::vector<int>& row, const std::vector<int>& x) {
+		long res = row.back();
+		for (size_t d = 0; d < x.size() && d + 1 < row.size(); d++) {
+			res += (long) row[d] * x[d];
+		}
+		return res;
+	}
+
+	/* Smallest box containing every element accessed over the domain */
+	static std::vector<std::pair<long, long>> AccessedBox(const LoopDependencies& assignment,
+														  const std::vector<std::pair<int, int>>& bounds) {
+		std::vector<std::pair<long, long>> box;
+		auto extend = [&](const std::vector<std::vector<int>>& access) {
+			for (size_t d = 0; d < access.size(); d++) {
+				long lower = access[d].back();
+				long upper = access[d].back();
+				for (size_t v = 0; v < bounds.size() && v + 1 < access[d].size(); v++) {
+					long a = (long) access[d][v] * bounds[v].first;
+					long b = (long) access[d][v] * bounds[v].second;
+					lower += std::min(a, b);
+					upper += std::max(a, b);
+				}
+				if (box.size() <= d) {
+					box.emplace_back(lower, upper);
+				} else {
+					box[d] = {std::min(box[d].first, lower), std::max(box[d].second, upper)};
+				}
+			}
+		};
+		std::for_each(assignment.writes.begin(), assignment.writes.end(), extend);
+		std::for_each(assignment.reads.begin(), assignment.reads.end(), extend);
+		return box;
+	}
+
+private:
+	struct ElementState {
+		long writer = -1;
+		long reader = -1;
+	};
+
+	std::vector<std::vector<std::vector<int>>> writes;
+	std::vector<std::vector<std::vector<int>>> reads;
+	std::vector<std::pair<int, int>> bounds;
+
+	/* Position of every iteration in the transformed execution order */
+	std::vector<long> Schedule(const std::vector<std::vector<int>>& T, const std::vector<int>& tiles) const {
+		auto order = ExecutionOrder(bounds, T, tiles);
+		std::vector<long> rank(order.size());
+		for (long position = 0; position < (long) order.size(); position++) {
+			rank[order[position]] = position;
+		}
+		return rank;
+	}
+
+	std::vector<std::pair<long, long>> AccessedBox() const {
+		return AccessedBox(LoopDependencies(writes, reads), bounds);
+	}
+
+	long Key(const std::vector<std::vector<int>>& access, const std::vector<int>& x,
+			 const std::vector<std::pair<long, long>>& box) const {
+		long key = 0;
+		for (size_t d = 0; d < access.size(); d++) {
+			key = key * (box[d].second - box[d].first + 1) + Index(access[d], x) - box[d].first;
+		}
+		return key;
+	}
+
+	ScheduleViolation Violation(const std::string& kind, long source, long sink,
+								const std::vector<std::vector<int>>& access, const std::vector<int>& x) const {
+		ScheduleViolation res{kind, std::vector<int>(bounds.size()), x, {}};
+		Point(bounds, source, res.source);
+		for (auto& row: access) {
+			res.element.push_back((int) Index(row, x));
+		}
+		return res;
+	}
+};
+
+#endif // LLVM_TRANSFORMS_POLYLOOP_SCHEDULEVERIFIER_H
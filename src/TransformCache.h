@@ -0,0 +1,125 @@
+#ifndef LLVM_TRANSFORMS_POLYLOOP_TRANSFORMCACHE_H
+#define LLVM_TRANSFORMS_POLYLOOP_TRANSFORMCACHE_H
+
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Polytope.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+/* Outcome of the search for a nest, as stored in the cache */
+struct CachedDecision {
+	std::optional<std::vector<std::vector<int>>> transform;
+	Rejection rejection = Rejection::None;
+};
+
+/* Content-addressed store of search decisions, one file per nest fingerprint. Entries are written to a unique
+ * temporary file and renamed into place, so parallel compiler processes only ever see complete entries. Any failure
+ * to read or write the cache is treated as a miss rather than an error. */
+class TransformCache {
+public:
+	explicit TransformCache(std::string dir) : dir(std::move(dir)) {};
+
+	/* Hash of the canonical description of a nest, used as the cache key */
+	static std::string Fingerprint(llvm::StringRef canonical) {
+		auto digest = llvm::SHA1::hash(llvm::arrayRefFromStringRef(canonical));
+		return llvm::toHex(digest, true);
+	}
+
+	/* Cache key of a nest: the fingerprint of its canonical description and of the versions of the entry format and
+	 * the search, so that entries a different search made are never reused */
+	static std::string Key(llvm::StringRef canonical) {
+		return Fingerprint("polytope-cache " + std::to_string(FormatVersion) + " search " +
+						   std::to_string(SearchVersion) + ";" + canonical.str());
+	}
+
+	std::optional<CachedDecision> Lookup(llvm::StringRef key) const {
+		auto buffer = llvm::MemoryBuffer::getFile(Path(key));
+		if (!buffer) {
+			return {};
+		}
+		std::istringstream in((*buffer)->getBuffer().str());
+		std::string magic;
+		int version;
+		std::string field;
+		int reason;
+		CachedDecision decision;
+		if (!(in >> magic >> version) || magic != "polytope-cache" || version != FormatVersion) {
+			return {};
+		}
+		if (!(in >> field >> reason) || field != "rejection") {
+			return {};
+		}
+		decision.rejection = static_cast<Rejection>(reason);
+		unsigned dim;
+		if (!(in >> field >> dim) || field != "transform") {
+			return {};
+		}
+		if (dim > 0) {
+			std::vector<std::vector<int>> T(dim, std::vector<int>(dim, 0));
+			for (auto& row: T) {
+				for (auto& x: row) {
+					if (!(in >> x)) {
+						return {};
+					}
+				}
+			}
+			decision.transform = T;
+		}
+		return decision;
+	}
+
+	void Store(llvm::StringRef key, const CachedDecision& decision) const {
+		if (llvm::sys::fs::create_directories(dir)) {
+			return;
+		}
+		int fd;
+		llvm::SmallString<128> tmp;
+		if (llvm::sys::fs::createUniqueFile(dir + "/" + key + "-%%%%%%%%.tmp", fd, tmp)) {
+			return;
+		}
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			os << "polytope-cache " << FormatVersion << "\n";
+			os << "rejection " << static_cast<int>(decision.rejection) << "\n";
+			os << "transform " << (decision.transform ? decision.transform->size() : 0);
+			if (decision.transform) {
+				for (auto& row: *decision.transform) {
+					for (auto x: row) {
+						os << " " << x;
+					}
+				}
+			}
+			os << "\n";
+			/* A write error on the final flush is only seen once the stream is closed */
+			os.close();
+			if (os.has_error()) {
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return;
+			}
+		}
+		/* rename is atomic, so a concurrent reader sees either no entry or a complete one */
+		if (llvm::sys::fs::rename(tmp, Path(key))) {
+			llvm::sys::fs::remove(tmp);
+		}
+	}
+
+private:
+	static constexpr int FormatVersion = 1;
+	/* Bumped whenever the search can decide differently for a nest with the same description */
+	static constexpr int SearchVersion = 3;
+	std::string dir;
+
+	std::string Path(llvm::StringRef key) const {
+		return dir + "/" + key.str() + ".txt";
+	}
+};
+
+#endif // LLVM_TRANSFORMS_POLYLOOP_TRANSFORMCACHE_H